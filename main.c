@@ -27,6 +27,23 @@
  *
  * windows build script is TODO
  *
+ * ```./build_dedicated``` builds a headless dedicated server without video
+ * or opengl. it simulates players on the map at a fixed tick rate, driven
+ * by clients that talk to it over in-process loopback, and logs tick
+ * times, traces per tick and players per core. run it with no arguments
+ * for more info
+ *
+ * ```./build_bench``` builds the microbenchmarks. they load each map given
+ * on the command line and time point lookups, pvs checks, point and box
+ * traces, sliding, tessellation, entity parsing and the visible face
+ * gather over the same seeded samples every run, then print the results
+ * as json so they can be diffed across commits
+ *
+ * ```-generate synth.bsp``` also writes a synthetic map and benchmarks it,
+ * with ```-rooms```, ```-pvs```, ```-patches``` and ```-entities``` to
+ * scale it. the map is a valid ibsp file that the game and the server
+ * can load too
+ *
  * # usage
  * unzip the .pk3 files from your copy of quake 3. some of these will
  * contain .bsp files for the maps. you can run q3playground on them
@@ -44,6 +61,15 @@
  *
  * controls are WASD, space, mouse, right click. toggle noclip with F
  *
+ * TAB toggles an overlay with last frame's stats: visible clusters,
+ * leaves, faces and patches, triangles, draw calls, traces and timings.
+ * averages are logged every second, ```-stats file.json``` also appends
+ * them to that file as one json object per line
+ *
+ * when started with ```-trace file.json```, P writes the most recent
+ * load and frame timings to that file as a chrome trace. open it
+ * in chrome://tracing or https://ui.perfetto.dev
+ *
  * run ```q3playground``` with no arguments for more info
  *
  * # license
@@ -58,6 +84,15 @@
  *   https://web.archive.org/web/20041206085743/http://www.nathanostgard.com:80/tutorials/quake3/collision/
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* mmap flags for huge pages */
+#endif
+
+/* the benchmarks are headless, so they build on top of the server */
+#ifdef BENCHMARK
+#define DEDICATED
+#endif
+
 #include <SDL2/SDL.h>
 
 #define degrees(rad) ((rad) * (180.0f / M_PI))
@@ -85,42 +120,6 @@
 #define log_puts(x) log_print(lninfo, "%s", x)
 #define log_dump(spec, var) log_print(lninfo, #var " = %" spec, var)
 
-void log_print(char const* file, int line, char* fmt, ...)
-{
-    va_list va;
-    char* msg;
-    int msg_len;
-    char* p;
-    char* end;
-
-    msg_len = 0;
-    msg_len += SDL_snprintf(0, 0, "[%s:%d] ", file, line);
-    va_start(va, fmt);
-    msg_len += SDL_vsnprintf(0, 0, fmt, va);
-    va_end(va);
-    msg_len += 2;
-
-    msg = SDL_malloc(msg_len);
-    if (!msg) {
-        SDL_Log("log_print alloc failed: %s", SDL_GetError());
-        return;
-    }
-
-    p = msg;
-    end = msg + msg_len;
-    p += SDL_snprintf(p, end - p, "[%s:%d] ", file, line);
-
-    va_start(va, fmt);
-    p += SDL_vsnprintf(p, end - p, fmt, va);
-    va_end(va);
-
-    for (p = msg; p < end; p += SDL_MAX_LOG_MESSAGE - 7) {
-        SDL_Log("%s", p);
-    }
-
-    SDL_free(msg);
-}
-
 struct vec_header
 {
     int n;
@@ -191,6 +190,14 @@ void nrm3(float* v)
     div3_scalar(v, len);
 }
 
+unsigned rand_next(unsigned* seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
 char* snprintf_alloc(char* fmt, ...)
 {
     va_list va;
@@ -211,2005 +218,8689 @@ char* snprintf_alloc(char* fmt, ...)
     return str;
 }
 
-SDL_RWops* open_data_file(char* file, char* mode)
+/*
+ * per-thread blocks that other threads walk, like the profiler rings.
+ * the first call on a thread allocates a zeroed block, gives it the next
+ * index and runs init on it before it's published, so walkers only ever
+ * see null or a block that's ready. returns null if the thread can't get
+ * one, once MAX_THREAD_SLOTS threads registered or if calloc fails
+ */
+
+#define MAX_THREAD_SLOTS 64
+
+typedef void thread_slot_init(void* slot, int index);
+
+struct thread_slots
 {
-    static char* data_path = 0;
-    SDL_RWops* io;
-    char* real_path;
+    SDL_TLSID tls;
+    SDL_atomic_t count;
+    void* slots[MAX_THREAD_SLOTS]; /* set atomically */
+};
 
-    if (!data_path)
-    {
-        data_path = SDL_GetBasePath();
-        if (!data_path) {
-            data_path = "./";
-        }
+void* thread_slot(struct thread_slots* ts, int size, thread_slot_init* init)
+{
+    void* slot;
+    int index;
 
-        log_dump("s", data_path);
+    slot = SDL_TLSGet(ts->tls);
+
+    if (slot) {
+        return slot;
     }
 
-    real_path = snprintf_alloc("%s/%s", data_path, file);
-    io = SDL_RWFromFile(real_path, mode);
-    SDL_free(real_path);
+    if (SDL_AtomicGet(&ts->count) >= MAX_THREAD_SLOTS) {
+        return 0;
+    }
 
-    return io;
-}
+    slot = SDL_calloc(1, size);
 
-char* read_entire_file(char* file)
-{
-    SDL_RWops* io;
-    char* res = 0;
-    char buf[1024];
-    size_t n;
+    if (!slot) {
+        return 0;
+    }
 
-    io = open_data_file(file, "rb");
-    if (!io) {
-        log_puts(SDL_GetError());
-        SDL_ClearError();
+    index = SDL_AtomicAdd(&ts->count, 1);
+
+    if (index >= MAX_THREAD_SLOTS) {
+        SDL_free(slot);
         return 0;
     }
 
-    while (1)
-    {
-        n = SDL_RWread(io, buf, 1, sizeof(buf));
+    if (init) {
+        init(slot, index);
+    }
 
-        if (!n)
-        {
-            if (*SDL_GetError())
-            {
-                log_print(lninfo, "SDL_RWread failed: %s", SDL_GetError());
-                SDL_ClearError();
-                vec_free(res);
-                goto cleanup;
-            }
+    SDL_TLSSet(ts->tls, slot, 0);
+    SDL_AtomicSetPtr(&ts->slots[index], slot);
 
-            break;
-        }
+    return slot;
+}
 
-        vec_cat(res, buf, n);
-    }
+int thread_slot_count(struct thread_slots* ts)
+{
+    return SDL_min(MAX_THREAD_SLOTS, SDL_AtomicGet(&ts->count));
+}
 
-cleanup:
-    SDL_RWclose(io);
-    return res;
+/* null if that thread is still being registered */
+
+void* thread_slot_at(struct thread_slots* ts, int index)
+{
+    return SDL_AtomicGetPtr(&ts->slots[index]);
 }
 
 /* --------------------------------------------------------------------- */
 
-#include <SDL2/SDL_opengl.h>
-#include <GL/glu.h>
+/*
+ * async logging. log_print doesn't format anything, it copies the format
+ * and its arguments into a ring owned by the calling thread and returns.
+ * strings are copied too, so they can be freed or reused right after.
+ * a background thread formats the records and hands them to SDL_Log, so a
+ * tick or frame never waits on the console
+ *
+ * each ring has a single writer and a single reader, the head and tail
+ * are the only shared state. when a ring is full or a thread logs faster
+ * than LOG_RATE lines per second (after a burst of LOG_BURST) the lines
+ * are dropped and counted. lines from different threads are not ordered
+ * with respect to each other
+ *
+ * fmt must outlive the record, which is always the case for literals.
+ * records whose arguments don't fit are formatted right away into a heap
+ * buffer, that only happens for huge strings like the gl extension list.
+ * before log_init, or if the thread can't start, everything is printed
+ * synchronously like before
+ */
 
-int gl_display;
-int gl_window_mode;
-int gl_width;
-int gl_height;
+#define LOG_RING_SIZE 1024 /* records per thread, power of two */
+#define LOG_ARGS_SIZE 232
+#define LOG_RATE 64
+#define LOG_BURST 256
+#define LOG_FLUSH_MS 10
 
-SDL_Window* gl_window;
-SDL_GLContext* gl_context;
+enum log_arg { LOG_INT, LOG_UINT, LOG_LONG, LOG_ULONG, LOG_DOUBLE,
+    LOG_STRING, LOG_POINTER, LOG_NONE };
 
-int gl_major_version;
-int gl_sl_major_version;
-int gl_max_texture_size;
+struct log_record
+{
+    char const* file;
+    int line;
+    char* fmt;
+    char* text; /* preformatted, freed after printing */
+    char args[LOG_ARGS_SIZE];
+};
 
-#define glGetCString (char*)glGetString
-#define log_glstring(i) log_print(lninfo, #i " = %s", glGetCString(i))
+struct log_ring
+{
+    int thread;
+    int tokens;
+    Uint32 refill_time;
+    SDL_atomic_t head;
+    SDL_atomic_t tail;
+    SDL_atomic_t dropped;
+    struct log_record records[LOG_RING_SIZE];
+};
 
-void gl_init()
+struct thread_slots log_rings;
+SDL_Thread* log_thread;
+SDL_sem* log_wake;
+SDL_atomic_t log_quit;
+char* log_line;
+
+void log_ring_init(void* slot, int index)
 {
-    int flags;
+    struct log_ring* ring;
 
-    if (gl_window) {
-        SDL_SetWindowSize(gl_window, gl_width, gl_height);
-        return;
+    ring = (struct log_ring*)slot;
+    ring->thread = index;
+    ring->tokens = LOG_BURST;
+    ring->refill_time = SDL_GetTicks();
+}
+
+struct log_ring* log_ring()
+{
+    if (!log_thread) {
+        return 0;
     }
 
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 1);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
+    return (struct log_ring*)thread_slot(&log_rings,
+        sizeof(struct log_ring), log_ring_init);
+}
 
-    flags = SDL_WINDOW_OPENGL;
+/* returns 0 if this line is over the thread's budget */
 
-    if (!gl_window_mode)
-    {
-        SDL_DisplayMode mode;
+int log_take_token(struct log_ring* ring)
+{
+    Uint32 now;
+    int refill;
 
-        flags |= SDL_WINDOW_FULLSCREEN;
+    now = SDL_GetTicks();
 
-        if (!SDL_GetDesktopDisplayMode(gl_display, &mode)) {
-            gl_width = mode.w;
-            gl_height = mode.h;
-        }
+    if (now - ring->refill_time >= 1000)
+    {
+        ring->tokens = LOG_BURST;
+        ring->refill_time = now;
+    }
+    else
+    {
+        refill = (int)(now - ring->refill_time) * LOG_RATE / 1000;
 
-        else {
-            log_print(lninfo, "SDL_GetDesktopDisplayMode failed: %s",
-                SDL_GetError());
+        if (refill > 0) {
+            ring->tokens = SDL_min(LOG_BURST, ring->tokens + refill);
+            ring->refill_time += refill * 1000 / LOG_RATE;
         }
     }
 
-    gl_window = SDL_CreateWindow("opengl",
-        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        gl_width, gl_height, flags);
+    if (ring->tokens <= 0) {
+        return 0;
+    }
 
-    gl_context = SDL_GL_CreateContext(gl_window);
+    --ring->tokens;
 
-    glEnable(GL_BLEND);
-    glEnable(GL_DEPTH_TEST);
+    return 1;
+}
 
-    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &gl_max_texture_size);
+/*
+ * parses the conversion at fmt, which points past the %. returns where it
+ * ends and stores the type of the argument it takes. only the subset of
+ * printf this code uses is understood, anything else is printed as is
+ */
 
-    log_glstring(GL_EXTENSIONS);
-    log_glstring(GL_VERSION);
-    log_glstring(GL_RENDERER);
-    log_glstring(GL_SHADING_LANGUAGE_VERSION);
-    log_glstring(GL_VENDOR);
-    log_dump("d", gl_max_texture_size);
+char* log_conversion(char* fmt, int* type)
+{
+    int is_long;
+
+    for (; *fmt && SDL_strchr("-+ #0123456789.", *fmt); ++fmt);
+
+    is_long = *fmt == 'l';
+    fmt += is_long;
+
+    switch (*fmt)
+    {
+    case 'd':
+    case 'i':
+    case 'c':
+        *type = is_long ? LOG_LONG : LOG_INT;
+        break;
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+        *type = is_long ? LOG_ULONG : LOG_UINT;
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'g':
+    case 'G':
+        *type = LOG_DOUBLE;
+        break;
+    case 's':
+        *type = LOG_STRING;
+        break;
+    case 'p':
+        *type = LOG_POINTER;
+        break;
+    default:
+        *type = LOG_NONE;
+        return *fmt ? fmt + 1 : fmt;
+    }
+
+    return fmt + 1;
 }
 
-void gl_perspective(float horizontal_fov, float near, float far)
+#define log_put(x) \
+    if (end - p < (int)sizeof(x)) return 0; \
+    memcpy(p, &x, sizeof(x)); \
+    p += sizeof(x)
+
+/* returns 0 if the arguments don't fit in the record */
+
+int log_pack(struct log_record* record, char* fmt, va_list va)
 {
-    float aspect;
-    float vertical_fov;
-    float tan_half_fov;
+    char* p;
+    char* end;
 
-    aspect = (float)gl_width / gl_height;
-    tan_half_fov = SDL_tanf(radians(horizontal_fov) * 0.5f);
-    vertical_fov = 2 * (float)SDL_atan(tan_half_fov / aspect);
-    gluPerspective(degrees(vertical_fov), aspect, near, far);
-}
+    p = record->args;
+    end = record->args + LOG_ARGS_SIZE;
 
-/* --------------------------------------------------------------------- */
+    while ((fmt = SDL_strchr(fmt, '%')))
+    {
+        int type;
+        int i;
+        unsigned u;
+        long l;
+        unsigned long ul;
+        double d;
+        void* ptr;
+        char* str;
+        int len;
 
-/*
- * using packed structs isn't portable in multiple ways but I'd rather keep
- * the code short and simple
- */
+        fmt = log_conversion(fmt + 1, &type);
 
-#ifdef _MSC_VER
-#define packed(declaration) \
-    __pragma pack(push, 1) \
-    declaration \
-    __pragma pack(pop)
-#else
-#define packed(declaration) \
-    declaration __attribute__((__packed__))
-#endif
+        switch (type)
+        {
+        case LOG_INT: i = va_arg(va, int); log_put(i); break;
+        case LOG_UINT: u = va_arg(va, unsigned); log_put(u); break;
+        case LOG_LONG: l = va_arg(va, long); log_put(l); break;
+        case LOG_ULONG: ul = va_arg(va, unsigned long); log_put(ul); break;
+        case LOG_DOUBLE: d = va_arg(va, double); log_put(d); break;
+        case LOG_POINTER: ptr = va_arg(va, void*); log_put(ptr); break;
+
+        case LOG_STRING:
+            str = va_arg(va, char*);
+            str = str ? str : "(null)";
+            len = SDL_strlen(str) + 1;
+
+            if (end - p < len) {
+                return 0;
+            }
 
-packed(
-struct bsp_dirent
-{
-    int offset;
-    int length;
-});
+            memcpy(p, str, len);
+            p += len;
+            break;
+        }
+    }
 
-packed(
-struct bsp_header
-{
-    char magic[4];
-    int version;
-    struct bsp_dirent dirents[17];
-});
+    return 1;
+}
 
-enum bsp_contents
-{
-    CONTENTS_SOLID = 1,
-    LAST_CONTENTS
-};
+#undef log_put
+#define log_get(x) memcpy(&x, *args, sizeof(x))
 
-packed(
-struct bsp_texture
-{
-    char name[64];
-    int flags;
-    int contents;
-});
+/* formats one argument and appends it to log_line */
 
-packed(
-struct bsp_plane
+void log_format_arg(char* spec, int type, char** args)
 {
-    float normal[3];
-    float dist;
-});
+    char* buf;
+    int len;
+    int i;
+    unsigned u;
+    long l;
+    unsigned long ul;
+    double d;
+    void* ptr;
+
+    /* once to measure, once to write */
+    for (buf = 0, len = 0; ; buf = vec_reserve(log_line, len + 1))
+    {
+        int n;
 
-packed(
-struct bsp_node
-{
-    int plane;
-    int child[2]; /* front, back */
-    int mins[3];
-    int maxs[3];
-});
+        n = buf ? len + 1 : 0;
 
-packed(
-struct bsp_leaf
-{
-    int cluster;
-    int area;
-    int mins[3];
-    int maxs[3];
-    int leafface;
-    int n_leaffaces;
-    int leafbrush;
-    int n_leafbrushes;
-});
+        switch (type)
+        {
+        case LOG_INT: log_get(i); len = SDL_snprintf(buf, n, spec, i); break;
+        case LOG_UINT: log_get(u); len = SDL_snprintf(buf, n, spec, u); break;
+        case LOG_LONG: log_get(l); len = SDL_snprintf(buf, n, spec, l); break;
+        case LOG_ULONG:
+            log_get(ul);
+            len = SDL_snprintf(buf, n, spec, ul);
+            break;
+        case LOG_DOUBLE:
+            log_get(d);
+            len = SDL_snprintf(buf, n, spec, d);
+            break;
+        case LOG_POINTER:
+            log_get(ptr);
+            len = SDL_snprintf(buf, n, spec, ptr);
+            break;
+        case LOG_STRING:
+            len = SDL_snprintf(buf, n, spec, *args);
+            break;
+        }
 
-packed(
-struct bsp_model
-{
-    float mins[3];
-    float maxs[3];
-    int face;
-    int n_faces;
-    int brush;
-    int n_brushes;
-});
+        if (buf) {
+            break;
+        }
+    }
 
-packed(
-struct bsp_brush
-{
-    int brushside;
-    int n_brushsides;
-    int texture;
-});
+    vec_hdr(log_line)->n += len;
 
-packed(
-struct bsp_brushside
-{
-    int plane;
-    int texture;
-});
+    switch (type)
+    {
+    case LOG_INT: *args += sizeof(int); break;
+    case LOG_UINT: *args += sizeof(unsigned); break;
+    case LOG_LONG: *args += sizeof(long); break;
+    case LOG_ULONG: *args += sizeof(unsigned long); break;
+    case LOG_DOUBLE: *args += sizeof(double); break;
+    case LOG_POINTER: *args += sizeof(void*); break;
+    case LOG_STRING: *args += SDL_strlen(*args) + 1; break;
+    }
+}
 
-packed(
-struct bsp_vertex
-{
-    float position[3];
-    float texcoord[2][2];
-    float normal[3];
-    int color;
-});
+#undef log_get
 
-packed(
-struct bsp_effect
+void log_format(struct log_record* record)
 {
-    char name[64];
-    int brush;
-    int unknown;
-});
+    char* fmt;
+    char* args;
+    char prefix[256];
+    int len;
 
-packed(
-struct bsp_face
+    len = SDL_snprintf(prefix, sizeof(prefix), "[%s:%d] ", record->file,
+        record->line);
+
+    vec_clear(log_line);
+    vec_cat(log_line, prefix, SDL_min(len, (int)sizeof(prefix) - 1));
+
+    if (record->text) {
+        vec_cat(log_line, record->text, (int)SDL_strlen(record->text));
+        return;
+    }
+
+    fmt = record->fmt;
+    args = record->args;
+
+    while (*fmt)
+    {
+        char* spec_end;
+        char spec[32];
+        int type;
+
+        if (*fmt != '%')
+        {
+            for (spec_end = fmt; *spec_end && *spec_end != '%'; ++spec_end);
+            vec_cat(log_line, fmt, (int)(spec_end - fmt));
+            fmt = spec_end;
+            continue;
+        }
+
+        spec_end = log_conversion(fmt + 1, &type);
+
+        if (type == LOG_NONE || spec_end - fmt >= (int)sizeof(spec))
+        {
+            /* %% and anything we don't understand */
+            if (spec_end - fmt == 2 && fmt[1] == '%') {
+                vec_append(log_line, '%');
+            } else {
+                vec_cat(log_line, fmt, (int)(spec_end - fmt));
+            }
+        }
+        else
+        {
+            memcpy(spec, fmt, spec_end - fmt);
+            spec[spec_end - fmt] = 0;
+            log_format_arg(spec, type, &args);
+        }
+
+        fmt = spec_end;
+    }
+}
+
+void log_write(struct log_record* record)
 {
-    int texture;
-    int effect;
-    int type;
-    int vertex;
-    int n_vertices;
-    int meshvert;
-    int n_meshverts;
-    int lm_index;
-    int lm_start[2];
-    int lm_size[2];
-    float lm_origin[3];
-    float lm_vecs[2][3];
-    float normal[3];
-    int size[2];
-});
+    char* p;
+    char* end;
 
-enum bsp_face_type
+    log_format(record);
+    vec_append(log_line, 0);
+
+    p = log_line;
+    end = log_line + vec_len(log_line);
+
+    for (; p < end - 1; p += SDL_MAX_LOG_MESSAGE - 7) {
+        SDL_Log("%.*s", (int)SDL_min(end - 1 - p, SDL_MAX_LOG_MESSAGE - 7),
+            p);
+    }
+
+    SDL_free(record->text);
+    record->text = 0;
+}
+
+/* prints everything that's queued up, returns how many lines it printed */
+
+int log_drain()
 {
-    BSP_POLYGON = 1,
-    BSP_PATCH,
-    BSP_MESH,
-    BSP_BILLBOARD
-};
+    int i;
+    int n;
 
-packed(
-struct bsp_lightmap
+    n = 0;
+
+    for (i = 0; i < thread_slot_count(&log_rings); ++i)
+    {
+        struct log_ring* ring;
+        int head;
+        int tail;
+        int dropped;
+
+        ring = (struct log_ring*)thread_slot_at(&log_rings, i);
+
+        /* still being registered */
+        if (!ring) {
+            continue;
+        }
+
+        head = SDL_AtomicGet(&ring->head);
+        tail = SDL_AtomicGet(&ring->tail);
+
+        for (; tail != head; ++tail, ++n) {
+            log_write(&ring->records[tail & (LOG_RING_SIZE - 1)]);
+            SDL_AtomicSet(&ring->tail, tail + 1);
+        }
+
+        dropped = SDL_AtomicSet(&ring->dropped, 0);
+
+        if (dropped) {
+            SDL_Log("[%s:%d] dropped %d log lines from thread %d",
+                __FILE__, __LINE__, dropped, ring->thread);
+        }
+    }
+
+    return n;
+}
+
+int log_flush_thread(void* data)
 {
-    unsigned char map[128][128][3];
-});
+    (void)data;
 
-packed(
-struct bsp_lightvol
+    while (1)
+    {
+        int quit;
+
+        /* read first so the last lines are drained before we quit */
+        quit = SDL_AtomicGet(&log_quit);
+
+        if (!log_drain() && quit) {
+            break;
+        }
+
+        SDL_SemWaitTimeout(log_wake, LOG_FLUSH_MS);
+    }
+
+    return 0;
+}
+
+void log_print(char const* file, int line, char* fmt, ...)
 {
-    unsigned char ambient[3];
-    unsigned char directional[3];
-    unsigned char dir[2];
-});
+    struct log_ring* ring;
+    struct log_record stack_record;
+    struct log_record* record;
+    va_list va;
+    int head;
+    int ok;
 
-packed(
-struct bsp_visdata
+    head = 0;
+    ring = log_ring();
+
+    if (ring)
+    {
+        head = SDL_AtomicGet(&ring->head);
+
+        if (head - SDL_AtomicGet(&ring->tail) >= LOG_RING_SIZE ||
+            !log_take_token(ring))
+        {
+            SDL_AtomicAdd(&ring->dropped, 1);
+            return;
+        }
+
+        record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    } else {
+        record = &stack_record;
+    }
+
+    record->file = file;
+    record->line = line;
+    record->fmt = fmt;
+    record->text = 0;
+
+    va_start(va, fmt);
+    ok = log_pack(record, fmt, va);
+    va_end(va);
+
+    if (!ok)
+    {
+        int len;
+
+        va_start(va, fmt);
+        len = SDL_vsnprintf(0, 0, fmt, va) + 1;
+        va_end(va);
+
+        record->text = SDL_malloc(len);
+
+        if (!record->text) {
+            SDL_Log("log_print alloc failed: %s", SDL_GetError());
+            return;
+        }
+
+        va_start(va, fmt);
+        SDL_vsnprintf(record->text, len, fmt, va);
+        va_end(va);
+    }
+
+    if (ring) {
+        SDL_AtomicSet(&ring->head, head + 1);
+    } else {
+        log_write(record);
+    }
+}
+
+void log_shutdown()
 {
-    int n_vecs;
-    int sz_vecs;
-});
+    if (!log_thread) {
+        return;
+    }
 
-struct bsp_file
+    SDL_AtomicSet(&log_quit, 1);
+    SDL_SemPost(log_wake);
+    SDL_WaitThread(log_thread, 0);
+    log_thread = 0;
+}
+
+/* starts the flush thread, whatever is still queued is printed at exit */
+
+void log_init()
 {
-    char* raw_data;
-    struct bsp_header* header;
+    log_rings.tls = SDL_TLSCreate();
+    log_wake = SDL_CreateSemaphore(0);
+    log_thread = SDL_CreateThread(log_flush_thread, "log", 0);
 
-    char* entities;
-    int entities_len;
+    if (!log_thread) {
+        log_print(lninfo, "SDL_CreateThread failed: %s", SDL_GetError());
+        return;
+    }
 
-    struct bsp_texture* textures;
-    int n_textures;
+    atexit(log_shutdown);
 
-    struct bsp_plane* planes;
-    int n_planes;
+    /* the main thread is always the first ring */
+    log_ring();
+}
 
-    struct bsp_node* nodes;
-    int n_nodes;
+SDL_RWops* open_data_file(char* file, char* mode)
+{
+    static char* data_path = 0;
+    SDL_RWops* io;
+    char* real_path;
 
-    struct bsp_leaf* leaves;
-    int n_leaves;
+    if (!data_path)
+    {
+        data_path = SDL_GetBasePath();
+        if (!data_path) {
+            data_path = "./";
+        }
 
-    int* leaffaces;
-    int n_leaffaces;
+        log_dump("s", data_path);
+    }
 
-    int* leafbrushes;
-    int n_leafbrushes;
+    real_path = snprintf_alloc("%s/%s", data_path, file);
+    io = SDL_RWFromFile(real_path, mode);
+    SDL_free(real_path);
 
-    struct bsp_model* models;
-    int n_models;
+    return io;
+}
 
-    struct bsp_brush* brushes;
-    int n_brushes;
+char* read_entire_file(char* file)
+{
+    SDL_RWops* io;
+    char* res = 0;
+    char buf[1024];
+    size_t n;
+
+    io = open_data_file(file, "rb");
+    if (!io) {
+        log_puts(SDL_GetError());
+        SDL_ClearError();
+        return 0;
+    }
+
+    while (1)
+    {
+        n = SDL_RWread(io, buf, 1, sizeof(buf));
+
+        if (!n)
+        {
+            if (*SDL_GetError())
+            {
+                log_print(lninfo, "SDL_RWread failed: %s", SDL_GetError());
+                SDL_ClearError();
+                vec_free(res);
+                goto cleanup;
+            }
+
+            break;
+        }
+
+        vec_cat(res, buf, n);
+    }
+
+cleanup:
+    SDL_RWclose(io);
+    return res;
+}
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * memory accounting. mem_init routes every SDL allocation through these
+ * hooks, which put a small header in front of each block with its size
+ * and the tag of the subsystem that was active on that thread when it was
+ * made. realloc keeps the original tag. mem_tag switches the current
+ * thread's tag and returns the old one so it can be put back
+ *
+ * the map arena hands out memory on top of this, so it keeps its own per
+ * tag counts and its chunks are counted under the arena tag
+ */
+
+enum mem_tag
+{
+    MEM_OTHER,
+    MEM_BSP,
+    MEM_PATCHES,
+    MEM_ENTITIES,
+    MEM_VISIBILITY,
+    MEM_COLLISION,
+    MEM_NET,
+    MEM_ARENA,
+    MEM_TAGS
+};
+
+char* mem_tag_names[] = {
+    "other", "bsp", "patches", "entities", "visibility", "collision", "net",
+    "arena"
+};
+
+struct mem_stats
+{
+    SDL_atomic_t current;
+    SDL_atomic_t peak;
+    SDL_atomic_t blocks;
+    SDL_atomic_t allocs; /* malloc, calloc and realloc calls */
+};
+
+/* keeps the blocks 16-byte aligned */
+#define MEM_HEADER 16
+
+struct mem_header
+{
+    size_t size;
+    int tag;
+};
+
+struct mem_stats mem_stats[MEM_TAGS];
+SDL_TLSID mem_tls;
+SDL_malloc_func mem_real_malloc;
+SDL_calloc_func mem_real_calloc;
+SDL_realloc_func mem_real_realloc;
+SDL_free_func mem_real_free;
+
+int mem_current_tag()
+{
+    return mem_tls ? (int)(size_t)SDL_TLSGet(mem_tls) : MEM_OTHER;
+}
+
+int mem_tag(int tag)
+{
+    int old;
+
+    old = mem_current_tag();
+
+    if (mem_tls) {
+        SDL_TLSSet(mem_tls, (void*)(size_t)tag, 0);
+    }
+
+    return old;
+}
+
+void mem_count(int tag, int bytes, int blocks, int allocs)
+{
+    struct mem_stats* stats;
+    int current;
+
+    stats = &mem_stats[tag];
+    current = SDL_AtomicAdd(&stats->current, bytes) + bytes;
+    SDL_AtomicAdd(&stats->blocks, blocks);
+    SDL_AtomicAdd(&stats->allocs, allocs);
+
+    while (1)
+    {
+        int peak;
+
+        peak = SDL_AtomicGet(&stats->peak);
+
+        if (current <= peak ||
+            SDL_AtomicCAS(&stats->peak, peak, current))
+        {
+            break;
+        }
+    }
+}
+
+void* mem_track(void* block, size_t size, int tag)
+{
+    struct mem_header* hdr;
+
+    if (!block) {
+        return 0;
+    }
+
+    hdr = (struct mem_header*)block;
+    hdr->size = size;
+    hdr->tag = tag;
+    mem_count(tag, (int)size, 1, 1);
+
+    return (char*)block + MEM_HEADER;
+}
+
+void* SDLCALL mem_malloc(size_t size)
+{
+    return mem_track(mem_real_malloc(MEM_HEADER + size), size,
+        mem_current_tag());
+}
+
+void* SDLCALL mem_calloc(size_t n, size_t size)
+{
+    if (size && n > ((size_t)-1 - MEM_HEADER) / size) {
+        return 0;
+    }
+
+    return mem_track(mem_real_calloc(1, MEM_HEADER + n * size), n * size,
+        mem_current_tag());
+}
+
+void* SDLCALL mem_realloc(void* p, size_t size)
+{
+    struct mem_header* hdr;
+    size_t old_size;
+
+    if (!p) {
+        return mem_malloc(size);
+    }
+
+    hdr = (struct mem_header*)((char*)p - MEM_HEADER);
+    old_size = hdr->size;
+    hdr = (struct mem_header*)mem_real_realloc(hdr, MEM_HEADER + size);
+
+    if (!hdr) {
+        return 0;
+    }
+
+    hdr->size = size;
+    mem_count(hdr->tag, (int)size - (int)old_size, 0, 1);
+
+    return (char*)hdr + MEM_HEADER;
+}
+
+void SDLCALL mem_free(void* p)
+{
+    struct mem_header* hdr;
+
+    if (!p) {
+        return;
+    }
+
+    hdr = (struct mem_header*)((char*)p - MEM_HEADER);
+    mem_count(hdr->tag, -(int)hdr->size, -1, 0);
+    mem_real_free(hdr);
+}
+
+/* must run before anything is allocated through SDL */
+
+void mem_init()
+{
+    SDL_GetMemoryFunctions(&mem_real_malloc, &mem_real_calloc,
+        &mem_real_realloc, &mem_real_free);
+
+    if (SDL_SetMemoryFunctions(mem_malloc, mem_calloc, mem_realloc,
+        mem_free) < 0)
+    {
+        log_print(lninfo, "SDL_SetMemoryFunctions failed: %s",
+            SDL_GetError());
+        return;
+    }
+
+    mem_tls = SDL_TLSCreate();
+}
+
+/* arena_bytes is the map arena's per tag usage, can be null */
+
+void mem_report(int* arena_bytes)
+{
+    int i;
+
+    for (i = 0; i < MEM_TAGS; ++i)
+    {
+        struct mem_stats* stats;
+
+        stats = &mem_stats[i];
+
+        log_print(lninfo, "mem %s | %d bytes, %d peak | %d blocks, "
+            "%d allocs | %d in map arena", mem_tag_names[i],
+            SDL_AtomicGet(&stats->current), SDL_AtomicGet(&stats->peak),
+            SDL_AtomicGet(&stats->blocks), SDL_AtomicGet(&stats->allocs),
+            arena_bytes ? arena_bytes[i] : 0);
+    }
+}
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * scoped profiler. prof_begin and prof_end bracket a zone and can nest.
+ * each thread records its finished zones in its own ring, so there's no
+ * locking: the owning thread is the only writer and publishes the new
+ * head after the zone is written. when the ring wraps the oldest zones
+ * are overwritten
+ *
+ * it's off unless a trace file is given. prof_dump writes whatever is in
+ * the rings as chrome trace json, which opens in chrome://tracing or
+ * ui.perfetto.dev. zones that are being overwritten while we dump can
+ * come out garbled, the ones that don't make sense are skipped
+ */
+
+#define PROF_RING_SIZE 65536 /* power of two */
+#define PROF_MAX_DEPTH 32
+
+struct prof_zone
+{
+    char* name;
+    Uint64 start;
+    Uint64 end;
+};
+
+struct prof_ring
+{
+    int thread;
+    int depth;
+    char* names[PROF_MAX_DEPTH];
+    Uint64 starts[PROF_MAX_DEPTH];
+    SDL_atomic_t head;
+    struct prof_zone zones[PROF_RING_SIZE];
+};
+
+char* prof_path;
+Uint64 prof_epoch;
+struct thread_slots prof_rings;
+
+void prof_ring_init(void* slot, int index)
+{
+    ((struct prof_ring*)slot)->thread = index;
+}
+
+struct prof_ring* prof_ring()
+{
+    struct prof_ring* ring;
+    int old_tag;
+
+    ring = (struct prof_ring*)SDL_TLSGet(prof_rings.tls);
+
+    if (ring) {
+        return ring;
+    }
+
+    old_tag = mem_tag(MEM_OTHER);
+    ring = (struct prof_ring*)thread_slot(&prof_rings,
+        sizeof(struct prof_ring), prof_ring_init);
+    mem_tag(old_tag);
+
+    return ring;
+}
+
+void prof_begin(char* name)
+{
+    struct prof_ring* ring;
+
+    if (!prof_path || !(ring = prof_ring())) {
+        return;
+    }
+
+    /* too deep, still counted so the ends match up */
+    if (ring->depth < PROF_MAX_DEPTH) {
+        ring->names[ring->depth] = name;
+        ring->starts[ring->depth] = SDL_GetPerformanceCounter();
+    }
+
+    ++ring->depth;
+}
+
+void prof_end()
+{
+    struct prof_ring* ring;
+    struct prof_zone* zone;
+    int head;
+
+    if (!prof_path || !(ring = prof_ring()) || ring->depth <= 0) {
+        return;
+    }
+
+    --ring->depth;
+
+    if (ring->depth >= PROF_MAX_DEPTH) {
+        return;
+    }
+
+    head = SDL_AtomicGet(&ring->head);
+    zone = &ring->zones[head & (PROF_RING_SIZE - 1)];
+    zone->name = ring->names[ring->depth];
+    zone->start = ring->starts[ring->depth];
+    zone->end = SDL_GetPerformanceCounter();
+    SDL_AtomicSet(&ring->head, head + 1);
+}
+
+/* path is where prof_dump writes, null keeps the profiler off */
+
+void prof_init(char* path)
+{
+    prof_path = path;
+
+    if (!prof_path) {
+        return;
+    }
+
+    prof_rings.tls = SDL_TLSCreate();
+    prof_epoch = SDL_GetPerformanceCounter();
+
+    /* the main thread is always the first one in the trace */
+    prof_ring();
+}
+
+void prof_dump()
+{
+    SDL_RWops* io;
+    char* json;
+    double us;
+    int i;
+
+    if (!prof_path) {
+        return;
+    }
+
+    json = 0;
+    us = 1000000.0 / SDL_GetPerformanceFrequency();
+    vec_cat(json, "{\"traceEvents\":[", 16);
+
+    for (i = 0; i < thread_slot_count(&prof_rings); ++i)
+    {
+        struct prof_ring* ring;
+        int head;
+        int j;
+        char buf[256];
+        int len;
+
+        ring = (struct prof_ring*)thread_slot_at(&prof_rings, i);
+
+        /* still being registered */
+        if (!ring) {
+            continue;
+        }
+
+        head = SDL_AtomicGet(&ring->head);
+
+        len = SDL_snprintf(buf, sizeof(buf), "%s{\"name\":\"thread_name\","
+            "\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":"
+            "\"%s %d\"}}", vec_len(json) > 16 ? "," : "", ring->thread,
+            ring->thread ? "job" : "main", ring->thread);
+        vec_cat(json, buf, len);
+
+        for (j = SDL_max(0, head - PROF_RING_SIZE); j < head; ++j)
+        {
+            struct prof_zone zone;
+
+            zone = ring->zones[j & (PROF_RING_SIZE - 1)];
+
+            if (!zone.name || zone.start < prof_epoch ||
+                zone.end < zone.start)
+            {
+                continue;
+            }
+
+            len = SDL_snprintf(buf, sizeof(buf), ",{\"name\":\"%s\","
+                "\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                "\"dur\":%.3f}", zone.name, ring->thread,
+                (zone.start - prof_epoch) * us,
+                (zone.end - zone.start) * us);
+            vec_cat(json, buf, len);
+        }
+    }
+
+    vec_cat(json, "]}\n", 3);
+
+    io = open_data_file(prof_path, "wb");
+
+    if (!io || SDL_RWwrite(io, json, vec_len(json), 1) != 1) {
+        log_print(lninfo, "can't write %s: %s", prof_path, SDL_GetError());
+        SDL_ClearError();
+    } else {
+        log_print(lninfo, "wrote trace to %s", prof_path);
+    }
+
+    if (io) {
+        SDL_RWclose(io);
+    }
+
+    vec_free(json);
+}
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * hardware counters through linux perf_event_open, turned on with -perf.
+ * perf_begin and perf_end bracket a phase, and the counter deltas are
+ * added to that phase's totals. each thread opens its own counter group
+ * the first time it measures something, so job threads work too. the
+ * counters only count user space, which is allowed at the default
+ * perf_event_paranoid level
+ *
+ * a group read is a syscall, so phases should wrap batches of work. the
+ * per op numbers of the benchmarks come from the same counters
+ *
+ * counters that the cpu or the vm doesn't have are left out. on other
+ * platforms this does nothing
+ */
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum perf_counter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTERS
+};
+
+char* perf_counter_names[] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+};
+
+enum perf_phase
+{
+    PERF_TRACE,
+    PERF_VISIBILITY,
+    PERF_TESSELLATION,
+    PERF_RENDER,
+    PERF_PHASES
+};
+
+char* perf_phase_names[] = {
+    "trace", "visibility", "tessellation", "render"
+};
+
+struct perf_thread
+{
+    int fds[PERF_COUNTERS]; /* -1 if the counter isn't available */
+    int n_open; /* counters in the group, in enum order */
+    Uint64 starts[PERF_PHASES][PERF_COUNTERS];
+    Uint64 totals[PERF_PHASES][PERF_COUNTERS];
+    int calls[PERF_PHASES];
+};
+
+int perf_enabled;
+struct thread_slots perf_threads;
+
+#ifdef __linux__
+int perf_open(int counter, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    switch (counter)
+    {
+    case PERF_CYCLES:
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PERF_INSTRUCTIONS:
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PERF_L1D_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case PERF_LLC_MISSES:
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case PERF_BRANCH_MISSES:
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+/* the counters are only opened once the thread has a slot */
+
+void perf_thread_init(void* slot, int index)
+{
+    struct perf_thread* thread;
+    int i;
+
+    thread = (struct perf_thread*)slot;
+    (void)index;
+
+    for (i = 0; i < PERF_COUNTERS; ++i) {
+        thread->fds[i] = -1;
+    }
+
+#ifdef __linux__
+    for (i = 0; i < PERF_COUNTERS; ++i)
+    {
+        thread->fds[i] = perf_open(i, thread->n_open ? thread->fds[0] : -1);
+
+        /* no cycles means no group leader, so nothing else either */
+        if (thread->fds[i] < 0 && !i) {
+            break;
+        }
+
+        thread->n_open += thread->fds[i] >= 0;
+    }
+
+    if (thread->n_open) {
+        ioctl(thread->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+struct perf_thread* perf_thread()
+{
+    return (struct perf_thread*)thread_slot(&perf_threads,
+        sizeof(struct perf_thread), perf_thread_init);
+}
+
+/* values gets every counter in enum order, 0 for missing ones */
+
+int perf_read(struct perf_thread* thread, Uint64* values)
+{
+    Uint64 buf[1 + PERF_COUNTERS];
+    int i, j;
+
+    memset(values, 0, sizeof(Uint64) * PERF_COUNTERS);
+
+    if (!thread->n_open) {
+        return 0;
+    }
+
+#ifdef __linux__
+    if (read(thread->fds[0], buf, sizeof(Uint64) * (1 + thread->n_open)) <
+        (int)(sizeof(Uint64) * (1 + thread->n_open)))
+    {
+        return 0;
+    }
+#else
+    (void)buf;
+#endif
+
+    for (i = 0, j = 1; i < PERF_COUNTERS; ++i)
+    {
+        if (thread->fds[i] >= 0) {
+            values[i] = buf[j++];
+        }
+    }
+
+    return 1;
+}
+
+void perf_begin(int phase)
+{
+    struct perf_thread* thread;
+
+    if (!perf_enabled || !(thread = perf_thread())) {
+        return;
+    }
+
+    perf_read(thread, thread->starts[phase]);
+}
+
+void perf_end(int phase)
+{
+    struct perf_thread* thread;
+    Uint64 values[PERF_COUNTERS];
+    int i;
+
+    if (!perf_enabled || !(thread = perf_thread()) ||
+        !perf_read(thread, values))
+    {
+        return;
+    }
+
+    for (i = 0; i < PERF_COUNTERS; ++i) {
+        thread->totals[phase][i] += values[i] - thread->starts[phase][i];
+    }
+
+    ++thread->calls[phase];
+}
+
+void perf_init()
+{
+    struct perf_thread* thread;
+    int i;
+
+    if (!perf_enabled) {
+        return;
+    }
+
+    perf_threads.tls = SDL_TLSCreate();
+    thread = perf_thread();
+
+    if (!thread || !thread->n_open)
+    {
+        log_puts("perf counters aren't available, check "
+            "/proc/sys/kernel/perf_event_paranoid");
+        perf_enabled = 0;
+        return;
+    }
+
+    for (i = 0; i < PERF_COUNTERS; ++i)
+    {
+        if (thread->fds[i] < 0) {
+            log_print(lninfo, "no %s counter", perf_counter_names[i]);
+        }
+    }
+}
+
+/*
+ * logs every phase summed over all threads and starts over. the threads
+ * don't lock their counters, so no job can be running
+ */
+
+void perf_report()
+{
+    int i, j, k;
+
+    if (!perf_enabled) {
+        return;
+    }
+
+    for (i = 0; i < PERF_PHASES; ++i)
+    {
+        Uint64 totals[PERF_COUNTERS];
+        int calls;
+
+        memset(totals, 0, sizeof(totals));
+        calls = 0;
+
+        for (j = 0; j < thread_slot_count(&perf_threads); ++j)
+        {
+            struct perf_thread* thread;
+
+            thread = (struct perf_thread*)thread_slot_at(&perf_threads, j);
+
+            if (!thread) {
+                continue;
+            }
+
+            for (k = 0; k < PERF_COUNTERS; ++k) {
+                totals[k] += thread->totals[i][k];
+                thread->totals[i][k] = 0;
+            }
+
+            calls += thread->calls[i];
+            thread->calls[i] = 0;
+        }
+
+        if (!calls) {
+            continue;
+        }
+
+        log_print(lninfo, "perf %s | %d calls | %.0f cycles %.0f "
+            "instructions %.2f ipc | misses %.0f l1d %.0f llc %.0f branch",
+            perf_phase_names[i], calls, (double)totals[PERF_CYCLES],
+            (double)totals[PERF_INSTRUCTIONS],
+            totals[PERF_CYCLES] ?
+                (double)totals[PERF_INSTRUCTIONS] / totals[PERF_CYCLES] : 0,
+            (double)totals[PERF_L1D_MISSES], (double)totals[PERF_LLC_MISSES],
+            (double)totals[PERF_BRANCH_MISSES]);
+    }
+}
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * map arena. everything that is sized by the map and built once per load
+ * comes from here, and loading another map just rewinds it. the chunks
+ * are kept, so once the biggest map has been loaded there's no allocator
+ * traffic at all and nothing to fragment in a long running server
+ *
+ * growable vecs like the patch and entity lists aren't in here, but they
+ * are cleared rather than freed on load so they keep their capacity too
+ *
+ * with -hugepages the chunks are mapped with 2mb pages on linux, which
+ * cuts tlb misses when walking the bsp and the geometry. if no huge pages
+ * are reserved it asks for transparent huge pages instead, and anywhere
+ * else it's plain SDL_malloc
+ */
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#define ARENA_CHUNK (16 << 20)
+#define ARENA_ALIGN 16
+#define HUGE_PAGE (2 << 20)
+
+struct arena_chunk
+{
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+    int mapped;
+};
+
+#define ARENA_HEADER \
+    ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena
+{
+    struct arena_chunk* first;
+    struct arena_chunk* current;
+    int tag_bytes[MEM_TAGS];
+};
+
+struct arena map_arena;
+int arena_huge_pages;
+
+struct arena_chunk* arena_new_chunk(size_t size)
+{
+    struct arena_chunk* chunk;
+    size_t total;
+    int old_tag;
+
+    chunk = 0;
+    total = ARENA_HEADER + size;
+    old_tag = mem_tag(MEM_ARENA);
+
+#if defined(__linux__) && defined(MAP_ANONYMOUS)
+    if (arena_huge_pages)
+    {
+        void* p;
+
+        total = (total + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+        p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+        p = mmap(0, total, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+        if (p == MAP_FAILED)
+        {
+            p = mmap(0, total, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+#ifdef MADV_HUGEPAGE
+            if (p != MAP_FAILED) {
+                madvise(p, total, MADV_HUGEPAGE);
+            }
+#endif
+        }
+
+        if (p != MAP_FAILED) {
+            chunk = (struct arena_chunk*)p;
+            chunk->mapped = 1;
+            mem_count(MEM_ARENA, (int)total, 1, 1);
+        }
+    }
+#endif
+
+    if (!chunk)
+    {
+        chunk = (struct arena_chunk*)SDL_malloc(total);
+
+        if (!chunk) {
+            mem_tag(old_tag);
+            return 0;
+        }
+
+        chunk->mapped = 0;
+    }
+
+    mem_tag(old_tag);
+
+    chunk->next = 0;
+    chunk->size = total - ARENA_HEADER;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+/* memory is not cleared. returns 0 if out of memory */
+
+void* arena_alloc(struct arena* arena, size_t size)
+{
+    struct arena_chunk* chunk;
+    void* p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    chunk = arena->current;
+
+    /* move on to the chunks a reset freed up before making new ones */
+    while (!chunk || chunk->used + size > chunk->size)
+    {
+        struct arena_chunk* next;
+
+        next = chunk ? chunk->next : arena->first;
+
+        if (!next)
+        {
+            next = arena_new_chunk(SDL_max(ARENA_CHUNK, size));
+
+            if (!next) {
+                return 0;
+            }
+
+            if (chunk) {
+                chunk->next = next;
+            } else {
+                arena->first = next;
+            }
+        }
+
+        next->used = 0;
+        chunk = next;
+    }
+
+    arena->current = chunk;
+    p = (char*)chunk + ARENA_HEADER + chunk->used;
+    chunk->used += size;
+    arena->tag_bytes[mem_current_tag()] += (int)size;
+
+    return p;
+}
+
+void* arena_calloc(struct arena* arena, size_t size)
+{
+    void* p;
+
+    p = arena_alloc(arena, size);
+
+    if (p) {
+        memset(p, 0, size);
+    }
+
+    return p;
+}
+
+void arena_reset(struct arena* arena)
+{
+    memset(arena->tag_bytes, 0, sizeof(arena->tag_bytes));
+    arena->current = arena->first;
+
+    if (arena->first) {
+        arena->first->used = 0;
+    }
+}
+
+size_t arena_used(struct arena* arena)
+{
+    struct arena_chunk* chunk;
+    size_t used;
+
+    used = 0;
+
+    for (chunk = arena->first; chunk; chunk = chunk->next)
+    {
+        used += chunk->used;
+
+        if (chunk == arena->current) {
+            break;
+        }
+    }
+
+    return used;
+}
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * tiny job system. parallel_for splits n indices into chunks that a fixed
+ * pool of worker threads grab with an atomic counter. the calling thread
+ * works on the job too and only returns once every chunk is done
+ *
+ * parallel_for_async leaves the job to the workers and returns right away,
+ * jobs_wait blocks until it's done. starting another job waits for the
+ * pending one first
+ *
+ * only one job runs at a time and it must be started from the main thread
+ */
+
+#define MAX_JOB_THREADS 32
+
+typedef void job_func(void* data, int start, int end);
+
+struct job
+{
+    job_func* func;
+    void* data;
+    int n;
+    int chunk;
+    SDL_atomic_t next;
+};
+
+int n_job_threads;
+SDL_Thread* job_threads[MAX_JOB_THREADS];
+SDL_sem* job_start;
+SDL_sem* job_finished;
+struct job current_job;
+int job_pending;
+int jobs_quit;
+
+void run_job(struct job* job)
+{
+    while (1)
+    {
+        int start;
+
+        start = SDL_AtomicAdd(&job->next, job->chunk);
+
+        if (start >= job->n) {
+            break;
+        }
+
+        job->func(job->data, start, SDL_min(job->n, start + job->chunk));
+    }
+}
+
+int job_thread(void* data)
+{
+    (void)data;
+
+    while (1)
+    {
+        SDL_SemWait(job_start);
+
+        if (jobs_quit) {
+            break;
+        }
+
+        prof_begin("job");
+        run_job(&current_job);
+        prof_end();
+        SDL_SemPost(job_finished);
+    }
+
+    return 0;
+}
+
+/* n_threads <= 0 picks one thread per cpu, the main thread included */
+
+void jobs_init(int n_threads)
+{
+    if (n_threads <= 0) {
+        n_threads = SDL_GetCPUCount();
+    }
+
+    n_threads = SDL_max(0, SDL_min(MAX_JOB_THREADS, n_threads - 1));
+
+    job_start = SDL_CreateSemaphore(0);
+    job_finished = SDL_CreateSemaphore(0);
+
+    for (n_job_threads = 0; n_job_threads < n_threads; ++n_job_threads)
+    {
+        job_threads[n_job_threads] =
+            SDL_CreateThread(job_thread, "job", 0);
+
+        if (!job_threads[n_job_threads]) {
+            log_print(lninfo, "SDL_CreateThread failed: %s",
+                SDL_GetError());
+            break;
+        }
+    }
+
+    log_dump("d", n_job_threads);
+}
+
+void jobs_wait()
+{
+    int i;
+
+    if (!job_pending) {
+        return;
+    }
+
+    for (i = 0; i < n_job_threads; ++i) {
+        SDL_SemWait(job_finished);
+    }
+
+    job_pending = 0;
+}
+
+void jobs_shutdown()
+{
+    int i;
+
+    jobs_wait();
+    jobs_quit = 1;
+
+    for (i = 0; i < n_job_threads; ++i) {
+        SDL_SemPost(job_start);
+    }
+
+    for (i = 0; i < n_job_threads; ++i) {
+        SDL_WaitThread(job_threads[i], 0);
+    }
+
+    n_job_threads = 0;
+}
+
+/* returns 0 if the job was too small to hand out and already ran */
+
+int job_kick(int n, int chunk, job_func* func, void* data)
+{
+    int i;
+
+    jobs_wait();
+
+    if (n <= 0) {
+        return 0;
+    }
+
+    current_job.func = func;
+    current_job.data = data;
+    current_job.n = n;
+    current_job.chunk = SDL_max(1, chunk);
+    SDL_AtomicSet(&current_job.next, 0);
+
+    /* not worth waking up the workers for a single chunk */
+    if (!n_job_threads || n <= current_job.chunk) {
+        func(data, 0, n);
+        return 0;
+    }
+
+    for (i = 0; i < n_job_threads; ++i) {
+        SDL_SemPost(job_start);
+    }
+
+    job_pending = 1;
+
+    return 1;
+}
+
+void parallel_for(int n, int chunk, job_func* func, void* data)
+{
+    if (job_kick(n, chunk, func, data)) {
+        run_job(&current_job);
+        jobs_wait();
+    }
+}
+
+void parallel_for_async(int n, int chunk, job_func* func, void* data)
+{
+    job_kick(n, chunk, func, data);
+}
+
+/* --------------------------------------------------------------------- */
+
+#ifndef DEDICATED
+#include <SDL2/SDL_opengl.h>
+#include <GL/glu.h>
+
+int gl_display;
+int gl_window_mode;
+int gl_width;
+int gl_height;
+
+SDL_Window* gl_window;
+SDL_GLContext* gl_context;
+
+int gl_major_version;
+int gl_sl_major_version;
+int gl_max_texture_size;
+
+#define glGetCString (char*)glGetString
+#define log_glstring(i) log_print(lninfo, #i " = %s", glGetCString(i))
+
+void gl_init()
+{
+    int flags;
+
+    if (gl_window) {
+        SDL_SetWindowSize(gl_window, gl_width, gl_height);
+        return;
+    }
+
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 1);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
+
+    flags = SDL_WINDOW_OPENGL;
+
+    if (!gl_window_mode)
+    {
+        SDL_DisplayMode mode;
+
+        flags |= SDL_WINDOW_FULLSCREEN;
+
+        if (!SDL_GetDesktopDisplayMode(gl_display, &mode)) {
+            gl_width = mode.w;
+            gl_height = mode.h;
+        }
+
+        else {
+            log_print(lninfo, "SDL_GetDesktopDisplayMode failed: %s",
+                SDL_GetError());
+        }
+    }
+
+    gl_window = SDL_CreateWindow("opengl",
+        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        gl_width, gl_height, flags);
+
+    gl_context = SDL_GL_CreateContext(gl_window);
+
+    glEnable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &gl_max_texture_size);
+
+    log_glstring(GL_EXTENSIONS);
+    log_glstring(GL_VERSION);
+    log_glstring(GL_RENDERER);
+    log_glstring(GL_SHADING_LANGUAGE_VERSION);
+    log_glstring(GL_VENDOR);
+    log_dump("d", gl_max_texture_size);
+}
+
+void gl_perspective(float horizontal_fov, float near, float far)
+{
+    float aspect;
+    float vertical_fov;
+    float tan_half_fov;
+
+    aspect = (float)gl_width / gl_height;
+    tan_half_fov = SDL_tanf(radians(horizontal_fov) * 0.5f);
+    vertical_fov = 2 * (float)SDL_atan(tan_half_fov / aspect);
+    gluPerspective(degrees(vertical_fov), aspect, near, far);
+}
+#endif /* DEDICATED */
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * using packed structs isn't portable in multiple ways but I'd rather keep
+ * the code short and simple
+ */
+
+#ifdef _MSC_VER
+#define packed(declaration) \
+    __pragma pack(push, 1) \
+    declaration \
+    __pragma pack(pop)
+#else
+#define packed(declaration) \
+    declaration __attribute__((__packed__))
+#endif
+
+packed(
+struct bsp_dirent
+{
+    int offset;
+    int length;
+});
+
+packed(
+struct bsp_header
+{
+    char magic[4];
+    int version;
+    struct bsp_dirent dirents[17];
+});
+
+enum bsp_contents
+{
+    CONTENTS_SOLID = 1,
+    LAST_CONTENTS
+};
+
+packed(
+struct bsp_texture
+{
+    char name[64];
+    int flags;
+    int contents;
+});
+
+packed(
+struct bsp_plane
+{
+    float normal[3];
+    float dist;
+});
+
+packed(
+struct bsp_node
+{
+    int plane;
+    int child[2]; /* front, back */
+    int mins[3];
+    int maxs[3];
+});
+
+packed(
+struct bsp_leaf
+{
+    int cluster;
+    int area;
+    int mins[3];
+    int maxs[3];
+    int leafface;
+    int n_leaffaces;
+    int leafbrush;
+    int n_leafbrushes;
+});
+
+packed(
+struct bsp_model
+{
+    float mins[3];
+    float maxs[3];
+    int face;
+    int n_faces;
+    int brush;
+    int n_brushes;
+});
+
+packed(
+struct bsp_brush
+{
+    int brushside;
+    int n_brushsides;
+    int texture;
+});
+
+packed(
+struct bsp_brushside
+{
+    int plane;
+    int texture;
+});
+
+packed(
+struct bsp_vertex
+{
+    float position[3];
+    float texcoord[2][2];
+    float normal[3];
+    int color;
+});
+
+packed(
+struct bsp_effect
+{
+    char name[64];
+    int brush;
+    int unknown;
+});
+
+packed(
+struct bsp_face
+{
+    int texture;
+    int effect;
+    int type;
+    int vertex;
+    int n_vertices;
+    int meshvert;
+    int n_meshverts;
+    int lm_index;
+    int lm_start[2];
+    int lm_size[2];
+    float lm_origin[3];
+    float lm_vecs[2][3];
+    float normal[3];
+    int size[2];
+});
+
+enum bsp_face_type
+{
+    BSP_POLYGON = 1,
+    BSP_PATCH,
+    BSP_MESH,
+    BSP_BILLBOARD
+};
+
+packed(
+struct bsp_lightmap
+{
+    unsigned char map[128][128][3];
+});
+
+packed(
+struct bsp_lightvol
+{
+    unsigned char ambient[3];
+    unsigned char directional[3];
+    unsigned char dir[2];
+});
+
+packed(
+struct bsp_visdata
+{
+    int n_vecs;
+    int sz_vecs;
+});
+
+struct bsp_file
+{
+    struct bsp_header* header;
+
+    char* entities;
+    int entities_len;
+
+    struct bsp_texture* textures;
+    int n_textures;
+
+    struct bsp_plane* planes;
+    int n_planes;
+
+    struct bsp_node* nodes;
+    int n_nodes;
+
+    struct bsp_leaf* leaves;
+    int n_leaves;
+
+    int* leaffaces;
+    int n_leaffaces;
+
+    int* leafbrushes;
+    int n_leafbrushes;
+
+    struct bsp_model* models;
+    int n_models;
+
+    struct bsp_brush* brushes;
+    int n_brushes;
+
+    struct bsp_brushside* brushsides;
+    int n_brushsides;
+
+    struct bsp_vertex* vertices;
+    int n_vertices;
+
+    unsigned short* meshverts; /* see bsp_load_meshverts */
+    int n_meshverts;
+    unsigned char* mesh_index_sizes; /* per face, 2 or 4 bytes */
+    int* wide_meshverts;
+    int* wide_meshvert_offsets; /* per face, null if all faces fit */
+
+    struct bsp_effect* effects;
+    int n_effects;
+
+    struct bsp_face* faces;
+    int n_faces;
+
+    struct bsp_lightmap* lightmaps;
+    int n_lightmaps;
+
+    struct bsp_lightvol* lightvols;
+    int n_lightvols;
+
+    struct bsp_visdata* visdata;
+    unsigned char* visdata_vecs;
+    unsigned char* phs_vecs; /* same layout as visdata_vecs */
+};
+
+/*
+ * load profiles pick which lumps get read. a dedicated server only needs
+ * what collision, visibility and the entities use, and never reads the
+ * geometry or the lightmaps, which tend to be the biggest lumps. render
+ * is the other way around, for clients that just fly around in noclip
+ *
+ * lumps that aren't loaded get a zero length in the header and null
+ * pointers, so code that checks for missing vis data keeps working
+ */
+
+#define lump_bit(i) (1 << (i))
+
+#define LUMPS_COLLISION ( \
+    lump_bit(0) | lump_bit(1) | lump_bit(2) | lump_bit(3) | lump_bit(4) | \
+    lump_bit(6) | lump_bit(7) | lump_bit(8) | lump_bit(9) | lump_bit(16) \
+)
+
+#define LUMPS_RENDER ( \
+    lump_bit(0) | lump_bit(1) | lump_bit(2) | lump_bit(3) | lump_bit(4) | \
+    lump_bit(5) | lump_bit(7) | lump_bit(10) | lump_bit(11) | \
+    lump_bit(12) | lump_bit(13) | lump_bit(14) | lump_bit(15) | \
+    lump_bit(16) \
+)
+
+#define LUMPS_FULL (lump_bit(17) - 1)
+
+int profile_lumps(char* profile)
+{
+    if (!strcmp(profile, "render")) {
+        return LUMPS_RENDER;
+    }
+
+    if (!strcmp(profile, "collision")) {
+        return LUMPS_COLLISION;
+    }
+
+    if (!strcmp(profile, "full")) {
+        return LUMPS_FULL;
+    }
+
+    return -1;
+}
+
+/*
+ * meshes index their own vertices, so nearly all of them fit in 16 bits.
+ * the lump is narrowed while it's read, so the 32-bit ints never take up
+ * memory. faces with bigger indices are rare, when there's any they get
+ * a 32-bit copy of just their meshverts, read again from the file
+ *
+ * must run after the faces are loaded
+ */
+
+int bsp_load_meshverts(struct bsp_file* file, SDL_RWops* io,
+    struct bsp_dirent* dirent)
+{
+    int chunk[1024];
+    int* wide;
+    int any_wide;
+    int n_wide_faces;
+    int n_meshes;
+    int n;
+    int i, j;
+
+    n = dirent->length / sizeof(int);
+    file->n_meshverts = n;
+    file->meshverts = (unsigned short*)
+        arena_alloc(&map_arena, n * sizeof(file->meshverts[0]));
+    file->mesh_index_sizes = (unsigned char*)
+        arena_alloc(&map_arena, file->n_faces);
+    file->wide_meshverts = 0;
+    file->wide_meshvert_offsets = 0;
+
+    if (!file->meshverts || !file->mesh_index_sizes ||
+        SDL_RWseek(io, dirent->offset, RW_SEEK_SET) < 0)
+    {
+        return 0;
+    }
+
+    any_wide = 0;
+
+    for (i = 0; i < n; i += sizeof(chunk) / sizeof(chunk[0]))
+    {
+        int count;
+
+        count = SDL_min(n - i, (int)(sizeof(chunk) / sizeof(chunk[0])));
+
+        if (SDL_RWread(io, chunk, sizeof(int), count) != (size_t)count) {
+            return 0;
+        }
+
+        for (j = 0; j < count; ++j)
+        {
+            any_wide |= (unsigned)chunk[j] > 0xFFFF;
+            file->meshverts[i + j] = (unsigned short)chunk[j];
+        }
+    }
+
+    memset(file->mesh_index_sizes, 2, file->n_faces);
+    n_meshes = 0;
+
+    for (i = 0; i < file->n_faces; ++i) {
+        n_meshes += file->faces[i].n_meshverts != 0;
+    }
+
+    if (!any_wide) {
+        log_print(lninfo, "%d/%d meshes use 16-bit indices", n_meshes,
+            n_meshes);
+        return 1;
+    }
+
+    /* slow path, find out which faces overflowed and keep their ints */
+    n_wide_faces = 0;
+    wide = 0;
+
+    file->wide_meshvert_offsets = (int*)
+        arena_alloc(&map_arena, file->n_faces * sizeof(int));
+
+    if (!file->wide_meshvert_offsets) {
+        return 0;
+    }
+
+    for (i = 0; i < file->n_faces; ++i)
+    {
+        struct bsp_face* face;
+        int* dst;
+
+        face = &file->faces[i];
+        file->wide_meshvert_offsets[i] = -1;
+
+        if (face->meshvert < 0 || face->n_meshverts <= 0 ||
+            face->meshvert + face->n_meshverts > n)
+        {
+            continue;
+        }
+
+        dst = vec_reserve(wide, face->n_meshverts);
+
+        if (SDL_RWseek(io, dirent->offset + face->meshvert * sizeof(int),
+                RW_SEEK_SET) < 0 ||
+            SDL_RWread(io, dst, sizeof(int), face->n_meshverts) !=
+                (size_t)face->n_meshverts)
+        {
+            vec_free(wide);
+            return 0;
+        }
+
+        for (j = 0; j < face->n_meshverts; ++j)
+        {
+            if ((unsigned)dst[j] > 0xFFFF) {
+                break;
+            }
+        }
+
+        if (j == face->n_meshverts) {
+            continue;
+        }
+
+        file->mesh_index_sizes[i] = 4;
+        file->wide_meshvert_offsets[i] = vec_len(wide);
+        vec_hdr(wide)->n += face->n_meshverts;
+        ++n_wide_faces;
+    }
+
+    file->wide_meshverts = (int*)
+        arena_alloc(&map_arena, vec_len(wide) * sizeof(int));
+
+    if (file->wide_meshverts) {
+        memcpy(file->wide_meshverts, wide, vec_len(wide) * sizeof(int));
+    }
+
+    vec_free(wide);
+
+    log_print(lninfo, "%d/%d meshes use 16-bit indices",
+        n_meshes - n_wide_faces, n_meshes);
+
+    return file->wide_meshverts != 0;
+}
+
+int bsp_load(struct bsp_file* file, char* path, int lumps)
+{
+    SDL_RWops* io;
+    struct bsp_header* header;
+    struct bsp_dirent* dirents;
+    char* data[17];
+    Sint64 file_size;
+    int resident;
+    int i;
+    int res;
+
+    log_puts(path);
+    res = 0;
+
+    io = open_data_file(path, "rb");
+    if (!io) {
+        log_puts(SDL_GetError());
+        SDL_ClearError();
+        return 0;
+    }
+
+    file_size = SDL_RWsize(io);
+
+    /* everything else in the file struct points into the map arena */
+    header = (struct bsp_header*)arena_alloc(&map_arena, sizeof(*header));
+
+    if (!header || SDL_RWread(io, header, sizeof(*header), 1) != 1) {
+        log_puts("E: file is too small, truncated header data");
+        goto cleanup;
+    }
+
+    dirents = header->dirents;
+    resident = sizeof(*header);
+
+    for (i = 0; i < 17; ++i)
+    {
+        struct bsp_dirent* dirent;
+
+        dirent = &dirents[i];
+        data[i] = 0;
+
+        if (!(lumps & lump_bit(i))) {
+            dirent->length = 0;
+            continue;
+        }
+
+        if (dirent->offset < 0 || dirent->length < 0 ||
+            (Sint64)dirent->offset + dirent->length > file_size)
+        {
+            log_print(lninfo, "E: lump %d is out of bounds", i);
+            goto cleanup;
+        }
+
+        /* read after the faces by bsp_load_meshverts */
+        if (i == 11) {
+            resident += dirent->length / 2;
+            continue;
+        }
+
+        data[i] = (char*)arena_alloc(&map_arena, dirent->length);
+
+        if (!data[i] ||
+            SDL_RWseek(io, dirent->offset, RW_SEEK_SET) < 0 ||
+            SDL_RWread(io, data[i], 1, dirent->length) !=
+                (size_t)dirent->length)
+        {
+            log_print(lninfo, "E: failed to read lump %d", i);
+            goto cleanup;
+        }
+
+        resident += dirent->length;
+    }
+
+    file->header = header;
+    file->entities = data[0];
+    file->entities_len = dirents[0].length;
+
+#define lump(i, name, type) \
+    file->name = (type*)data[i]; \
+    file->n_##name = dirents[i].length / sizeof(type); \
+
+    lump(1, textures, struct bsp_texture)
+    lump(2, planes, struct bsp_plane)
+    lump(3, nodes, struct bsp_node)
+    lump(4, leaves, struct bsp_leaf)
+    lump(5, leaffaces, int)
+    lump(6, leafbrushes, int)
+    lump(7, models, struct bsp_model)
+    lump(8, brushes, struct bsp_brush)
+    lump(9, brushsides, struct bsp_brushside)
+    lump(10, vertices, struct bsp_vertex)
+    lump(12, effects, struct bsp_effect)
+    lump(13, faces, struct bsp_face)
+    lump(14, lightmaps, struct bsp_lightmap)
+    lump(15, lightvols, struct bsp_lightvol)
+
+#undef lump
+
+    file->visdata = (struct bsp_visdata*)data[16];
+    file->visdata_vecs =
+        data[16] ? (unsigned char*)&file->visdata[1] : 0;
+
+    file->meshverts = 0;
+    file->n_meshverts = 0;
+
+    if ((lumps & lump_bit(11)) &&
+        !bsp_load_meshverts(file, io, &dirents[11]))
+    {
+        log_print(lninfo, "E: failed to read lump %d", 11);
+        goto cleanup;
+    }
+
+    log_print(lninfo, "%d of %d bytes resident", resident, (int)file_size);
+    res = 1;
+
+cleanup:
+    SDL_RWclose(io);
+    return res;
+}
+
+/*
+ * the plane dist is the distance from the origin along the normal so if
+ * we project the camera position onto the normal with the dot product and
+ * subtract dist, we get the distance between the camera position and the
+ * plane
+ *
+ * note that leaf indices are negative, and that's how we tell we hit a
+ * leaf while navigating the bsp tree
+ *
+ * since 0 is taken by positive indices, leaf index -1 maps to leaf 0,
+ * -2 to 1, and so on
+ */
+
+int bsp_find_leaf(struct bsp_file* file, float* camera_pos)
+{
+    int index;
+
+    index = 0;
+
+    while (index >= 0)
+    {
+        float distance;
+        struct bsp_node* node;
+        struct bsp_plane* plane;
+
+        node = &file->nodes[index];
+        plane = &file->planes[node->plane];
+
+        distance = dot3(camera_pos, plane->normal) - plane->dist;
+
+        if (distance >= 0) {
+            index = node->child[0];
+        } else {
+            index = node->child[1];
+        }
+    }
+
+    return (-index) - 1;
+}
+
+/*
+ * the visdata vecs are huge bitmasks. each bit is one y step and each
+ * sz_vecs bytes is one x step
+ *
+ * cluster x is visible from cluster y if the y-th bit in the x-th bitmask
+ * is set. it's basically a visibility matrix with every possible
+ * combination of clusters packed as bitmask
+ */
+
+int bsp_cluster_visible(struct bsp_file* file, int from, int target)
+{
+    int index;
+
+    index = from * file->visdata->sz_vecs + target / 8;
+    return (file->visdata_vecs[index] & (1 << (target % 8))) != 0;
+}
+
+/*
+ * the phs (potentially hearable set) of a cluster is every cluster that is
+ * potentially visible from any of the clusters in its pvs. we build it
+ * once at load time by or-ing together the pvs rows of every cluster in
+ * each pvs row, a word at a time, with clusters spread across the job
+ * threads
+ */
+
+void bsp_build_phs_rows(void* data, int start, int end)
+{
+    struct bsp_file* file;
+    int sz_vecs;
+    int n_words;
+    int i, j, k;
+
+    file = (struct bsp_file*)data;
+    sz_vecs = file->visdata->sz_vecs;
+    n_words = sz_vecs / sizeof(size_t);
+
+    for (i = start; i < end; ++i)
+    {
+        unsigned char* pvs;
+        unsigned char* phs;
+
+        pvs = &file->visdata_vecs[i * sz_vecs];
+        phs = &file->phs_vecs[i * sz_vecs];
+        SDL_memcpy(phs, pvs, sz_vecs);
+
+        for (j = 0; j < file->visdata->n_vecs; ++j)
+        {
+            unsigned char* src;
+
+            if (!pvs[j / 8]) {
+                j |= 7;
+                continue;
+            }
+
+            if (!(pvs[j / 8] & (1 << (j % 8)))) {
+                continue;
+            }
+
+            src = &file->visdata_vecs[j * sz_vecs];
+
+            /* memcpy because rows aren't necessarily word aligned */
+            for (k = 0; k < n_words; ++k)
+            {
+                size_t a, b;
+
+                SDL_memcpy(&a, &phs[k * sizeof(size_t)], sizeof(size_t));
+                SDL_memcpy(&b, &src[k * sizeof(size_t)], sizeof(size_t));
+                a |= b;
+                SDL_memcpy(&phs[k * sizeof(size_t)], &a, sizeof(size_t));
+            }
+
+            for (k = n_words * sizeof(size_t); k < sz_vecs; ++k) {
+                phs[k] |= src[k];
+            }
+        }
+    }
+}
+
+void bsp_build_phs(struct bsp_file* file)
+{
+    int size;
+
+    if (file->header->dirents[16].length < (int)sizeof(struct bsp_visdata))
+    {
+        file->phs_vecs = 0;
+        return;
+    }
+
+    size = file->visdata->n_vecs * file->visdata->sz_vecs;
+    file->phs_vecs = (unsigned char*)arena_alloc(&map_arena, size);
+    parallel_for(file->visdata->n_vecs, 16, bsp_build_phs_rows, file);
+}
+
+/*
+ * pvs/phs row of a cluster. null if the cluster is outside the map or
+ * there is no vis data, in which case everything should be treated as
+ * visible
+ */
+
+unsigned char* bsp_pvs_row(struct bsp_file* file, int cluster)
+{
+    if (cluster < 0 ||
+        file->header->dirents[16].length < (int)sizeof(struct bsp_visdata))
+    {
+        return 0;
+    }
+
+    return &file->visdata_vecs[cluster * file->visdata->sz_vecs];
+}
+
+unsigned char* bsp_phs_row(struct bsp_file* file, int cluster)
+{
+    if (cluster < 0 || !file->phs_vecs) {
+        return 0;
+    }
+
+    return &file->phs_vecs[cluster * file->visdata->sz_vecs];
+}
+
+int bsp_cluster_hearable(struct bsp_file* file, int from, int target)
+{
+    unsigned char* row;
+
+    row = bsp_phs_row(file, from);
+    return !row || (row[target / 8] & (1 << (target % 8))) != 0;
+}
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * swar byte scanning. a size_t holds several bytes, and with the usual bit
+ * tricks all of them get compared against the same byte at once. no
+ * intrinsics, so it's the same few ops on any cpu and word size
+ */
+
+#define SWAR_ONES ((size_t)-1 / 0xFF)
+#define SWAR_LOWS (SWAR_ONES * 0x7F)
+
+/* high bit set in exactly the bytes of x that are equal to c */
+
+size_t swar_match(size_t x, int c)
+{
+    x ^= SWAR_ONES * (unsigned char)c;
+    return ~(((x & SWAR_LOWS) + SWAR_LOWS) | x | SWAR_LOWS);
+}
+
+/* first c in [p, end), end if there's none */
+
+char* find_byte(char* p, char* end, int c)
+{
+    size_t word;
+
+    for (; end - p >= (int)sizeof(word); p += sizeof(word))
+    {
+        memcpy(&word, p, sizeof(word));
+
+        if (swar_match(word, c)) {
+            break;
+        }
+    }
+
+    while (p < end && *p != (char)c) {
+        ++p;
+    }
+
+    return p;
+}
+
+int count_byte(char* p, char* end, int c)
+{
+    size_t word;
+    int n;
+
+    n = 0;
+
+    for (; end - p >= (int)sizeof(word); p += sizeof(word))
+    {
+        memcpy(&word, p, sizeof(word));
+
+        /* add up the matches, one per byte, in the top byte */
+        word = (swar_match(word, c) >> 7) * SWAR_ONES;
+        n += (int)(word >> ((sizeof(word) - 1) * 8));
+    }
+
+    for (; p < end; ++p) {
+        n += *p == (char)c;
+    }
+
+    return n;
+}
+
+/*
+ * tiny lexer for the quake 3 entity syntax
+ *
+ * {
+ * "key1" "value1"
+ * "key2" "value2"
+ * }
+ * {
+ * "key1" "value1"
+ * "key2" "value2"
+ * }
+ * ...
+ *
+ * it works in place on the entity lump and stops at its end, strings are
+ * terminated by overwriting their closing quote
+ */
+
+enum entities_token
+{
+    ENTITIES_LAST_LITERAL_TOKEN = 255,
+    ENTITIES_STRING,
+    ENTITIES_LAST_TOKEN
+};
+
+void describe_entities_token(char* dst, int dst_size, int kind)
+{
+    switch (kind)
+    {
+    case ENTITIES_STRING:
+        SDL_snprintf(dst, dst_size, "%s", "string");
+        break;
+
+    default:
+        if (kind >= 0 && kind <= ENTITIES_LAST_LITERAL_TOKEN) {
+            SDL_snprintf(dst, dst_size, "'%c'", (char)kind);
+        } else {
+            SDL_snprintf(dst, dst_size, "unknown (%d)", kind);
+        }
+    }
+}
+
+struct entities_lexer
+{
+    char* start;
+    char* p;
+    char* end;
+    int token_kind;
+    char* str;
+};
+
+/* only needed for warnings, so it's counted when one happens */
+
+int entities_line(struct entities_lexer* lex)
+{
+    return count_byte(lex->start, lex->p, '\n') + 1;
+}
+
+int lex_entities(struct entities_lexer* lex)
+{
+    char* quote;
+
+    for (; lex->p < lex->end; ++lex->p)
+    {
+        switch (*lex->p)
+        {
+        case '\n':
+        case '\t':
+        case '\v':
+        case '\f':
+        case '\r':
+        case ' ':
+            continue;
+        }
+
+        break;
+    }
+
+    if (lex->p >= lex->end) {
+        lex->token_kind = 0;
+        return 0;
+    }
+
+    if (*lex->p != '"')
+    {
+        lex->token_kind = (int)*lex->p;
+
+        /* the lump is usually null terminated, that's the end too */
+        if (lex->token_kind) {
+            ++lex->p;
+        }
+
+        return lex->token_kind;
+    }
+
+    lex->str = lex->p + 1;
+    quote = find_byte(lex->str, lex->end, '"');
+
+    if (quote >= lex->end)
+    {
+        log_print(lninfo, "W: unterminated string at line %d",
+            entities_line(lex));
+
+        lex->p = lex->end;
+        lex->token_kind = 0;
+        return 0;
+    }
+
+    *quote = 0;
+    lex->p = quote + 1;
+    lex->token_kind = ENTITIES_STRING;
+
+    return lex->token_kind;
+}
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * keys and classnames are interned into atoms as the entities are parsed,
+ * so a lookup hashes the key once and then only compares ints. every
+ * (entity, key atom) pair goes into one hash table that maps it to the
+ * value, and every classname atom has the list of entities of that class
+ *
+ * atoms point into the entity string, so they're rebuilt along with the
+ * entities on every map load
+ */
+
+struct entity_field
+{
+    char* key;
+    char* value;
+    int atom;
+};
+
+/* all the fields are in one array, in entity order */
+
+struct entity
+{
+    int first_field;
+    int n_fields;
+};
+
+struct field_slot
+{
+    int entity; /* -1 for empty slots */
+    int atom;
+    char* value;
+};
+
+struct entity* entities;
+struct entity_field* field_pool;
+char** atoms;
+int* atom_table; /* -1 for empty slots */
+struct field_slot* field_table;
+int** class_entities; /* entity lists indexed by classname atom */
+
+unsigned hash_string(char* str)
+{
+    unsigned hash;
+
+    hash = 2166136261u;
+
+    for (; *str; ++str) {
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+    }
+
+    return hash;
+}
+
+#define hash_field(entity, atom) \
+    ((unsigned)(entity) * 2654435761u ^ (unsigned)(atom) * 40503u)
+
+/* the atom's slot in atom_table, or the empty slot it would go in */
+
+int* atom_slot(char* str)
+{
+    int i;
+    int mask;
+
+    mask = vec_len(atom_table) - 1;
+
+    for (i = hash_string(str) & mask; ; i = (i + 1) & mask)
+    {
+        if (atom_table[i] < 0 || !strcmp(atoms[atom_table[i]], str)) {
+            return &atom_table[i];
+        }
+    }
+}
+
+void rehash_atoms(int capacity)
+{
+    int i;
+
+    vec_clear(atom_table);
+    vec_reserve(atom_table, capacity);
+    vec_hdr(atom_table)->n = capacity;
+
+    for (i = 0; i < capacity; ++i) {
+        atom_table[i] = -1;
+    }
+
+    for (i = 0; i < vec_len(atoms); ++i) {
+        *atom_slot(atoms[i]) = i;
+    }
+}
+
+int atom_find(char* str)
+{
+    return atom_table ? *atom_slot(str) : -1;
+}
+
+int atom_intern(char* str)
+{
+    int* slot;
+
+    /* keep the table at most half full */
+    if (vec_len(atoms) * 2 >= vec_len(atom_table)) {
+        rehash_atoms(SDL_max(64, vec_len(atom_table) * 2));
+    }
+
+    slot = atom_slot(str);
+
+    if (*slot < 0) {
+        *slot = vec_len(atoms);
+        vec_append(atoms, str);
+    }
+
+    return *slot;
+}
+
+struct field_slot* field_slot(int entity, int atom)
+{
+    int i;
+    int mask;
+
+    mask = vec_len(field_table) - 1;
+
+    for (i = hash_field(entity, atom) & mask; ; i = (i + 1) & mask)
+    {
+        struct field_slot* slot;
+
+        slot = &field_table[i];
+
+        if (slot->entity < 0 ||
+            (slot->entity == entity && slot->atom == atom))
+        {
+            return slot;
+        }
+    }
+}
+
+/* for hot code that looks up the same key a lot and interned it already */
+
+char* entity_get_atom(int entity, int atom)
+{
+    struct field_slot* slot;
+
+    if (atom < 0 || !field_table) {
+        return 0;
+    }
+
+    slot = field_slot(entity, atom);
+
+    return slot->entity < 0 ? 0 : slot->value;
+}
+
+char* entity_get(int entity, char* key)
+{
+    return entity_get_atom(entity, atom_find(key));
+}
+
+/* list of entity indices, 0 if there's none */
+
+int* entities_of_class(char* classname)
+{
+    int atom;
+
+    atom = atom_find(classname);
+
+    if (atom < 0 || atom >= vec_len(class_entities)) {
+        return 0;
+    }
+
+    return class_entities[atom];
+}
+
+/* first entity of this class, -1 if there's none */
+
+int entity_by_classname(char* classname)
+{
+    int* list;
+
+    list = entities_of_class(classname);
+
+    return vec_len(list) ? list[0] : -1;
+}
+
+void index_entities()
+{
+    int i, j;
+    int n_fields;
+    int capacity;
+    int classname;
+    int target;
+    int targetname;
+
+    classname = atom_intern("classname");
+    target = atom_intern("target");
+    targetname = atom_intern("targetname");
+    n_fields = 0;
+
+    for (i = 0; i < vec_len(entities); ++i)
+    {
+        struct entity_field* fields;
+
+        fields = &field_pool[entities[i].first_field];
+        n_fields += entities[i].n_fields;
+
+        /*
+         * decode_entities interns targets and targetnames too, doing it
+         * here keeps class_entities as long as the atom table
+         */
+        for (j = 0; j < entities[i].n_fields; ++j)
+        {
+            if (fields[j].atom == classname || fields[j].atom == target ||
+                fields[j].atom == targetname)
+            {
+                atom_intern(fields[j].value);
+            }
+        }
+    }
+
+    for (i = 0; i < vec_len(class_entities); ++i) {
+        vec_clear(class_entities[i]);
+    }
+
+    while (vec_len(class_entities) < vec_len(atoms)) {
+        vec_append(class_entities, 0);
+    }
+
+    capacity = 16;
+
+    while (capacity < n_fields * 2) {
+        capacity *= 2;
+    }
+
+    vec_clear(field_table);
+    vec_reserve(field_table, capacity);
+    vec_hdr(field_table)->n = capacity;
+
+    for (i = 0; i < capacity; ++i) {
+        field_table[i].entity = -1;
+    }
+
+    for (i = 0; i < vec_len(entities); ++i)
+    {
+        struct entity_field* fields;
+
+        fields = &field_pool[entities[i].first_field];
+
+        for (j = 0; j < entities[i].n_fields; ++j)
+        {
+            struct field_slot* slot;
+
+            slot = field_slot(i, fields[j].atom);
+
+            /* duplicate keys, the first one wins */
+            if (slot->entity >= 0) {
+                continue;
+            }
+
+            slot->entity = i;
+            slot->atom = fields[j].atom;
+            slot->value = fields[j].value;
+
+            if (fields[j].atom == classname) {
+                vec_append(class_entities[atom_find(fields[j].value)], i);
+            }
+        }
+    }
+}
+
+int entities_expect(struct entities_lexer* lex, int kind)
+{
+    if (lex->token_kind != kind)
+    {
+        char got[64];
+        char exp[64];
+
+        describe_entities_token(got, sizeof(got), lex->token_kind);
+        describe_entities_token(exp, sizeof(exp), kind);
+
+        log_print(lninfo, "W: got %s, expected %s at line %d",
+            got, exp, entities_line(lex));
+
+        return 0;
+    }
+
+    lex_entities(lex);
+
+    return 1;
+}
+
+/*
+ * the fields that code actually looks at are decoded once at load into
+ * one array per component, so per-tick code works on plain floats and
+ * ints instead of parsing strings. targets, targetnames and classnames
+ * are atoms, so matching them is an int compare
+ *
+ * components that an entity doesn't have are zero or -1, the bits in
+ * entity_components say which ones are there
+ */
+
+enum component_bits
+{
+    COMPONENT_ORIGIN = 1<<0,
+    COMPONENT_ANGLES = 1<<1,
+    COMPONENT_MODEL = 1<<2,
+    LAST_COMPONENT_BIT
+};
+
+unsigned char* entity_components;
+float* entity_origins; /* 3 per entity */
+float* entity_angles; /* pitch, yaw, roll in radians, 3 per entity */
+int* entity_models; /* inline bsp model index */
+int* entity_classnames;
+int* entity_targets;
+int* entity_targetnames;
+
+/* reads up to 3 floats, returns how many */
+
+int parse_vec3(char* str, float* v)
+{
+    int i;
+
+    for (i = 0; *str && i < 3; ++i) {
+        v[i] = (float)SDL_strtod(str, &str);
+    }
+
+    return i;
+}
+
+void decode_entities()
+{
+    int i, j;
+    int n;
+    int origin, angle, angles, model, classname, target, targetname;
+
+    n = vec_len(entities);
+
+    origin = atom_find("origin");
+    angle = atom_find("angle");
+    angles = atom_find("angles");
+    model = atom_find("model");
+    classname = atom_find("classname");
+    target = atom_find("target");
+    targetname = atom_find("targetname");
+
+#define component(name, count) \
+    vec_clear(name); \
+    memset(vec_reserve(name, n * (count)), 0, \
+        n * (count) * sizeof(name[0])); \
+    vec_hdr(name)->n = n * (count);
+
+    component(entity_components, 1)
+    component(entity_origins, 3)
+    component(entity_angles, 3)
+    component(entity_models, 1)
+    component(entity_classnames, 1)
+    component(entity_targets, 1)
+    component(entity_targetnames, 1)
+
+#undef component
+
+    for (i = 0; i < n; ++i)
+    {
+        char* str;
+        float* v;
+
+        str = entity_get_atom(i, origin);
+
+        if (str) {
+            parse_vec3(str, &entity_origins[i * 3]);
+            entity_components[i] |= COMPONENT_ORIGIN;
+        }
+
+        v = &entity_angles[i * 3];
+        str = entity_get_atom(i, angles);
+
+        if (str)
+        {
+            parse_vec3(str, v);
+
+            for (j = 0; j < 3; ++j) {
+                v[j] = (float)radians(v[j]);
+            }
+
+            entity_components[i] |= COMPONENT_ANGLES;
+        }
+
+        else if ((str = entity_get_atom(i, angle)))
+        {
+            v[1] = (float)radians(SDL_strtod(str, 0));
+            entity_components[i] |= COMPONENT_ANGLES;
+        }
+
+        entity_models[i] = -1;
+        str = entity_get_atom(i, model);
+
+        if (str && str[0] == '*') {
+            entity_models[i] = SDL_atoi(str + 1);
+            entity_components[i] |= COMPONENT_MODEL;
+        }
+
+        str = entity_get_atom(i, classname);
+        entity_classnames[i] = str ? atom_find(str) : -1;
+
+        str = entity_get_atom(i, target);
+        entity_targets[i] = str ? atom_intern(str) : -1;
+
+        str = entity_get_atom(i, targetname);
+        entity_targetnames[i] = str ? atom_intern(str) : -1;
+    }
+}
+
+/*
+ * every field is 4 quotes, so counting the quotes first gives an upper
+ * bound for the number of fields and they all fit in one allocation.
+ * same for entities and braces
+ */
+
+void parse_entities(char* data, int len)
+{
+    struct entities_lexer lex;
+    int max_fields;
+
+    vec_clear(entities);
+    vec_clear(field_pool);
+    vec_clear(atoms);
+    rehash_atoms(SDL_max(64, vec_len(atom_table)));
+
+    max_fields = count_byte(data, data + len, '"') / 4;
+    vec_reserve(field_pool, max_fields);
+    vec_reserve(entities, count_byte(data, data + len, '{'));
+
+    memset(&lex, 0, sizeof(lex));
+    lex.start = data;
+    lex.p = data;
+    lex.end = data + len;
+    lex_entities(&lex);
+
+    do
+    {
+        struct entity* entity;
+
+        if (!entities_expect(&lex, '{')) {
+            break;
+        }
+
+        entity = vec_append_p(entities);
+        entity->first_field = vec_len(field_pool);
+        entity->n_fields = 0;
+
+        while (lex.token_kind == ENTITIES_STRING)
+        {
+            struct entity_field* field;
+
+            field = vec_append_p(field_pool);
+            field->key = lex.str;
+            field->atom = atom_intern(lex.str);
+            lex_entities(&lex);
+
+            if (lex.token_kind != ENTITIES_STRING) {
+                vec_hdr(field_pool)->n--;
+                goto done;
+            }
+
+            field->value = lex.str;
+            ++entity->n_fields;
+
+            lex_entities(&lex);
+        }
+
+        if (!entities_expect(&lex, '}')) {
+            break;
+        }
+    }
+    while (lex.token_kind);
+
+done:
+    index_entities();
+    decode_entities();
+}
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * quake3 uses a different coordinate system, so we use quake's matrix
+ * as identity, where x, y, z are forward, left and up
+ */
+
+float quake_matrix[] = {
+    0, 0, -1, 0,
+    -1, 0, 0, 0,
+    0, 1, 0, 0,
+    0, 0, 0, 1
+};
+
+char* argv0;
+int running = 1;
+float delta_time;
+
+/*
+ * vertices and indices are byte offsets into patch_geometry, -1 until the
+ * patch is laid out, see init_patches. levels is the number of segments
+ * along u and v. index_size is 2 for unsigned short indices and 4 for int
+ *
+ * the geometry is relative to origin, the position and texcoords of the
+ * first control point. identical patches share the geometry of the one
+ * at index source, see dedup_patches
+ */
+
+struct patch
+{
+    int face;
+    int x, y;
+    float origin[7];
+    int source;
+    int levels[2];
+    int n_vertices;
+    int vertices;
+    int n_indices;
+    int indices;
+    int index_size;
+    int n_rows;
+    int triangles_per_row;
+};
+
+char* map_file;
+struct bsp_file map;
+int* visible_faces;
+unsigned char* visible_faces_mask;
+struct patch* patches;
+int* face_patches;
+char* patch_geometry;
+
+#define patch_vertices(patch) \
+    ((struct bsp_vertex*)(patch_geometry + (patch)->vertices))
+#define patch_indices(patch) (patch_geometry + (patch)->indices)
+
+/*
+ * per frame counters. frame_stats is filled in as the frame goes and is
+ * copied to last_frame_stats when it's done. second_stats adds up the
+ * frames until update_fps reports them. the server only uses the traces
+ */
+
+enum trace_site
+{
+    TRACE_GROUND,
+    TRACE_SLIDE,
+    TRACE_WEAPON,
+    TRACE_RADIUS,
+    TRACE_SITES
+};
+
+char* trace_site_names[] = { "ground", "slide", "weapon", "radius" };
+
+struct frame_stats
+{
+    int clusters;
+    int leaves;
+    int faces;
+    int patches;
+    int fallback_patches; /* not tessellated yet */
+    int triangles;
+    int draw_calls;
+    int state_changes;
+    int traces[TRACE_SITES];
+    float frame_ms;
+    float update_ms;
+    float render_ms;
+};
+
+struct frame_stats frame_stats;
+struct frame_stats last_frame_stats;
+
+/* gl calls that change state go through this so they get counted */
+#define gl_state(call) (++frame_stats.state_changes, call)
+struct frame_stats second_stats;
+int second_frames;
+char* stats_file; /* see stats_report */
+SDL_RWops* stats_io;
+int stats_overlay;
+
+enum plane_type
+{
+    PLANE_X,
+    PLANE_Y,
+    PLANE_Z,
+    PLANE_NONAXIAL,
+    LAST_PLANE_TYPE
+};
+
+struct plane
+{
+    int signbits;
+    int type;
+};
+
+struct plane* planes;
+
+int tessellation_level;
+float tessellation_error = 1;
+float camera_pos[3];
+float camera_angle[2]; /* yaw, pitch */
+float velocity[3];
+int noclip;
+
+int movement;
+float wishdir[3]; /* movement inputs in local player space, not unit */
+int wishlook[2]; /* look inputs in screen space, not unit */
+float* ground_normal;
+
+enum movement_bits
+{
+    MOVEMENT_JUMP = 1<<1,
+    MOVEMENT_JUMP_THIS_FRAME = 1<<2,
+    MOVEMENT_JUMPING = 1<<3,
+    LAST_MOVEMENT_BIT
+};
+
+float player_mins[] = { -15, -15, -24 };
+float player_maxs[] = { 15, 15, 32 };
+
+float cl_forwardspeed = 400;
+float cl_sidespeed = 350;
+float cl_movement_accelerate = 15;
+float cl_movement_airaccelerate = 7;
+float cl_movement_friction = 8;
+float sv_gravity = 800;
+float sv_max_speed = 320;
+float cl_stop_speed = 200;
+float cpm_air_stop_acceleration = 2.5f;
+float cpm_air_control_amount = 150;
+float cpm_strafe_acceleration = 70;
+float cpm_wish_speed = 30;
+
+#ifdef DEDICATED
+int sv_players;
+int sv_tickrate;
+float sv_time;
+int sv_nosleep;
+#endif
+
+#ifdef BENCHMARK
+char** bench_maps;
+int bench_n_maps;
+int bench_samples;
+int bench_repeats;
+char* synth_path;
+int synth_rooms = 64;
+float synth_pvs = 0.1f;
+int synth_patches = 4; /* per room */
+int synth_entities = 16; /* per room, on top of the spawn */
+#endif
+
+int job_thread_count;
+char* load_profile; /* see profile_lumps */
+char* trace_file; /* see prof_init */
+
+/* split up because c89 only guarantees 509 characters per string */
+
+void print_usage()
+{
+    SDL_Log(
+#ifdef BENCHMARK
+        "usage: %s [options] [/path/to/file.bsp ...]\n"
+        "\n"
+        "runs the benchmarks on each map and prints the results as json\n"
+#else
+        "usage: %s [options] /path/to/file.bsp\n"
+#endif
+        "\n"
+        "available options:",
+        argv0
+    );
+
+    SDL_Log(
+#if defined(BENCHMARK)
+        "    -samples: points, rays and moves per benchmark | "
+        "default: 4096 | example: -samples 65536\n"
+        "    -repeat: runs per benchmark, the median and best are kept | "
+        "default: 7 | example: -repeat 21\n"
+        "    -t: max tessellation level | default: 5 | example: -t 10\n"
+        "    -e: max curve error in units, 0 is always max level | "
+        "default: 1 | example: -e 0.5"
+    );
+
+    SDL_Log(
+        "    -generate: write a synthetic map and benchmark it first | "
+        "default: off | example: -generate synth.bsp\n"
+        "    -rooms: rooms in the synthetic map | default: 64 | "
+        "example: -rooms 1024\n"
+        "    -pvs: chance that a room sees another | default: 0.1 | "
+        "example: -pvs 0.5\n"
+        "    -patches: curved patches per room | default: 4 | "
+        "example: -patches 32\n"
+        "    -entities: entities per room | default: 16 | "
+        "example: -entities 256"
+#elif defined(DEDICATED)
+        "    -players: simulated players | default: 16 | example: "
+        "-players 64\n"
+        "    -tickrate: server ticks per second | default: 60 | example: "
+        "-tickrate 125\n"
+        "    -time: seconds to run for, 0 is forever | default: 0 | "
+        "example: -time 30\n"
+        "    -nosleep: run ticks back to back instead of waiting for the "
+        "next tick | default: off | example: -nosleep\n"
+        "    -stats: append per tick stats to a file as json lines | "
+        "default: off | example: -stats stats.json"
+#else
+        "    -window: window mode | default: off | example: -window\n"
+        "    -d: main display index | default: 0 | example: -d 0\n"
+        "    -t: max tessellation level | default: 5 | example: -t 10\n"
+        "    -e: max curve error in units, 0 is always max level | "
+        "default: 1 | example: -e 0.5\n"
+        "    -w: window width | default: 1280 | example: -w 800\n"
+        "    -h: window height | default: 720 | example: -h 600\n"
+        "    -stats: append per frame stats to a file as json lines | "
+        "default: off | example: -stats stats.json"
+#endif
+    );
+
+    SDL_Log(
+        "    -j: threads, 0 is one per cpu | default: 0 | example: -j 4\n"
+        "    -hugepages: back map data with huge pages where supported | "
+        "default: off | example: -hugepages\n"
+#ifdef DEDICATED
+        "    -trace: profile and write a chrome trace on exit | "
+        "default: off | example: -trace trace.json\n"
+#else
+        "    -trace: profile and write a chrome trace when P is pressed | "
+        "default: off | example: -trace trace.json\n"
+#endif
+        "    -perf: count cycles, instructions and cache and branch misses "
+        "per phase, linux only | default: off | example: -perf\n"
+#if defined(BENCHMARK)
+        "    -load: ignored, the benchmarks always load the full map"
+#elif defined(DEDICATED)
+        "    -load: lumps to load, render, collision or full | "
+        "default: collision | example: -load full"
+#else
+        "    -load: lumps to load, render (noclip only) or full | "
+        "default: full | example: -load render"
+#endif
+    );
+}
+
+void parse_args(int argc, char* argv[])
+{
+    argv0 = argv[0];
+
+    ++argv, --argc;
+
+    for (; argc > 0; ++argv, --argc)
+    {
+        if (!strcmp(argv[0], "-j") && argc >= 2) {
+            job_thread_count = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-hugepages")) {
+            arena_huge_pages = 1;
+        }
+
+        else if (!strcmp(argv[0], "-trace") && argc >= 2) {
+            trace_file = argv[1];
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-perf")) {
+            perf_enabled = 1;
+        }
+
+        else if (!strcmp(argv[0], "-load") && argc >= 2) {
+            load_profile = argv[1];
+            ++argv, --argc;
+        }
+
+#if defined(BENCHMARK)
+        else if (!strcmp(argv[0], "-samples") && argc >= 2) {
+            bench_samples = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-repeat") && argc >= 2) {
+            bench_repeats = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-generate") && argc >= 2) {
+            synth_path = argv[1];
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-rooms") && argc >= 2) {
+            synth_rooms = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-pvs") && argc >= 2) {
+            synth_pvs = (float)SDL_strtod(argv[1], 0);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-patches") && argc >= 2) {
+            synth_patches = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-entities") && argc >= 2) {
+            synth_entities = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+#elif defined(DEDICATED)
+        else if (!strcmp(argv[0], "-players") && argc >= 2) {
+            sv_players = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-tickrate") && argc >= 2) {
+            sv_tickrate = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-time") && argc >= 2) {
+            sv_time = (float)SDL_strtod(argv[1], 0);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-nosleep")) {
+            sv_nosleep = 1;
+        }
+#endif
+
+#ifndef BENCHMARK
+        else if (!strcmp(argv[0], "-stats") && argc >= 2) {
+            stats_file = argv[1];
+            ++argv, --argc;
+        }
+#endif
+
+#if !defined(DEDICATED) || defined(BENCHMARK)
+        else if (!strcmp(argv[0], "-t") && argc >= 2) {
+            tessellation_level = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-e") && argc >= 2) {
+            tessellation_error = (float)SDL_strtod(argv[1], 0);
+            ++argv, --argc;
+        }
+#endif
+
+#ifndef DEDICATED
+        else if (!strcmp(argv[0], "-window")) {
+            gl_window_mode = 1;
+        }
+
+        else if (!strcmp(argv[0], "-d") && argc >= 2) {
+            gl_display = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-w") && argc >= 2) {
+            gl_width = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+
+        else if (!strcmp(argv[0], "-h") && argc >= 2) {
+            gl_height = SDL_atoi(argv[1]);
+            ++argv, --argc;
+        }
+#endif
+
+        else {
+            break;
+        }
+    }
+
+#ifdef BENCHMARK
+    bench_maps = argv;
+    bench_n_maps = argc;
+
+    if (!argc && !synth_path) {
+        print_usage();
+        exit(1);
+    }
+#else
+    if (argc >= 1) {
+        map_file = argv[0];
+    } else {
+        print_usage();
+        exit(1);
+    }
+#endif
+
+    if (tessellation_level <= 0) {
+        tessellation_level = 5;
+    }
+
+#if defined(BENCHMARK)
+    if (bench_samples <= 0) {
+        bench_samples = 4096;
+    }
+
+    if (bench_repeats <= 0) {
+        bench_repeats = 7;
+    }
+
+    /* one room would have no nodes */
+    synth_rooms = SDL_max(2, synth_rooms);
+    synth_patches = SDL_max(0, synth_patches);
+    synth_entities = SDL_max(0, synth_entities);
+
+    load_profile = "full";
+#elif defined(DEDICATED)
+    if (sv_players <= 0) {
+        sv_players = 16;
+    }
+
+    if (sv_tickrate <= 0) {
+        sv_tickrate = 60;
+    }
+
+    if (!load_profile) {
+        load_profile = "collision";
+    }
+#else
+    if (gl_width <= 0) {
+        gl_width = 1280;
+    }
+
+    if (gl_height <= 0) {
+        gl_height = 720;
+    }
+
+    /* the renderer walks the leaf faces, which collision doesn't load */
+    if (!load_profile || !strcmp(load_profile, "collision")) {
+        load_profile = "full";
+    }
+#endif
+
+    if (profile_lumps(load_profile) < 0) {
+        log_print(lninfo, "unknown load profile %s, expected render, "
+            "collision or full", load_profile);
+        exit(1);
+    }
+}
+
+void stats_add(struct frame_stats* sum, struct frame_stats* stats)
+{
+    int i;
+
+    sum->clusters += stats->clusters;
+    sum->leaves += stats->leaves;
+    sum->faces += stats->faces;
+    sum->patches += stats->patches;
+    sum->fallback_patches += stats->fallback_patches;
+    sum->triangles += stats->triangles;
+    sum->draw_calls += stats->draw_calls;
+    sum->state_changes += stats->state_changes;
+
+    for (i = 0; i < TRACE_SITES; ++i) {
+        sum->traces[i] += stats->traces[i];
+    }
+
+    sum->frame_ms += stats->frame_ms;
+    sum->update_ms += stats->update_ms;
+    sum->render_ms += stats->render_ms;
+}
+
+void stats_end_frame()
+{
+    last_frame_stats = frame_stats;
+    stats_add(&second_stats, &frame_stats);
+    ++second_frames;
+    memset(&frame_stats, 0, sizeof(frame_stats));
+}
+
+/*
+ * logs the per frame averages since the last report. with -stats they
+ * are also appended to that file, one json object per line
+ */
+
+void stats_report()
+{
+    struct frame_stats* sum;
+    double n;
+    char buf[1024];
+    int len;
+
+    if (!second_frames) {
+        return;
+    }
+
+    sum = &second_stats;
+    n = second_frames;
+
+    log_print(lninfo, "frame %.2fms update %.2fms render %.2fms | "
+        "%.0f clusters %.0f leaves %.0f faces %.0f patches %.0f fallback | "
+        "%.0f triangles %.0f draw calls %.0f state changes",
+        sum->frame_ms / n, sum->update_ms / n, sum->render_ms / n,
+        sum->clusters / n, sum->leaves / n, sum->faces / n,
+        sum->patches / n, sum->fallback_patches / n, sum->triangles / n,
+        sum->draw_calls / n, sum->state_changes / n);
+
+    log_print(lninfo, "traces | %.1f ground %.1f slide %.1f weapon "
+        "%.1f radius", sum->traces[TRACE_GROUND] / n,
+        sum->traces[TRACE_SLIDE] / n, sum->traces[TRACE_WEAPON] / n,
+        sum->traces[TRACE_RADIUS] / n);
+
+    if (stats_file && !stats_io)
+    {
+        stats_io = open_data_file(stats_file, "ab");
+
+        if (!stats_io) {
+            log_print(lninfo, "can't open %s: %s", stats_file,
+                SDL_GetError());
+            SDL_ClearError();
+            stats_file = 0;
+        }
+    }
+
+    if (stats_io)
+    {
+        len = SDL_snprintf(buf, sizeof(buf), "{\"time_ms\": %u, "
+            "\"frames\": %d, \"frame_ms\": %.3f, \"update_ms\": %.3f, "
+            "\"render_ms\": %.3f, \"clusters\": %.1f, \"leaves\": %.1f, "
+            "\"faces\": %.1f, \"patches\": %.1f, "
+            "\"fallback_patches\": %.1f, \"triangles\": %.1f, "
+            "\"draw_calls\": %.1f, \"state_changes\": %.1f, "
+            "\"traces\": {\"ground\": %.1f, \"slide\": %.1f, "
+            "\"weapon\": %.1f, \"radius\": %.1f}}\n",
+            SDL_GetTicks(), second_frames, sum->frame_ms / n,
+            sum->update_ms / n, sum->render_ms / n, sum->clusters / n,
+            sum->leaves / n, sum->faces / n, sum->patches / n,
+            sum->fallback_patches / n, sum->triangles / n,
+            sum->draw_calls / n, sum->state_changes / n,
+            sum->traces[TRACE_GROUND] / n, sum->traces[TRACE_SLIDE] / n,
+            sum->traces[TRACE_WEAPON] / n, sum->traces[TRACE_RADIUS] / n);
+
+        SDL_RWwrite(stats_io, buf, 1, SDL_min(len, (int)sizeof(buf) - 1));
+    }
+
+    memset(sum, 0, sizeof(*sum));
+    second_frames = 0;
+}
+
+void update_fps()
+{
+    static float one_second = 1;
+    static int ticks_per_second = 0;
+
+    one_second -= delta_time;
+
+    while (one_second <= 0)
+    {
+        log_dump("d", ticks_per_second);
+        log_dump("f", mag3(velocity));
+        stats_report();
+
+        /* the tessellation jobs add to the counters perf_report resets */
+        jobs_wait();
+        perf_report();
+        one_second = 1;
+        ticks_per_second = 0;
+    }
+
+    ++ticks_per_second;
+}
+
+/*
+ * quadratic bezier basis weights for every step of a curve subdivided
+ * into some number of segments. bezier_basis(level)[i * 3 + k] is the
+ * weight of control point k at step i, for levels 1 up to the max
+ *
+ * the weights only depend on the level, so they're computed once and
+ * shared by every patch. a patch vertex is the tensor product of the
+ * weights along the two directions
+ */
+
+float* bezier_weights;
+
+#define bezier_basis(level) \
+    (&bezier_weights[3 * ((level) - 1) * ((level) + 2) / 2])
+
+void init_bezier_weights(int max_level)
+{
+    int level, i;
+    float* w;
+
+    vec_clear(bezier_weights);
+    w = vec_reserve(bezier_weights, 3 * max_level * (max_level + 3) / 2);
+
+    for (level = 1; level <= max_level; ++level)
+    {
+        for (i = 0; i <= level; ++i)
+        {
+            float a, b;
+
+            a = (float)i / level;
+            b = 1 - a;
+            *w++ = b * b;
+            *w++ = 2 * b * a;
+            *w++ = a * a;
+        }
+    }
+}
+
+/*
+ * picks how many segments each direction of a sub-patch needs so that
+ * the flat triangles stay within tessellation_error units of the curve.
+ *
+ * a quadratic bezier has a constant second derivative 2 * (p0 - 2p1 + p2)
+ * and splitting it into n straight segments is off by at most
+ * |p0 - 2p1 + p2| / (4 * n * n), so the level is the smallest n that
+ * brings that under the tolerance for all 3 rows (or columns) of control
+ * points. tessellation_level caps it, a tolerance of zero means always
+ * use the cap
+ */
+
+int flatness_level(struct bsp_vertex* controls, int stride, int step)
+{
+    int i, j;
+    float max_sq;
+    int level;
+
+    if (tessellation_error <= 0) {
+        return tessellation_level;
+    }
+
+    max_sq = 0;
+
+    for (i = 0; i < 3; ++i)
+    {
+        struct bsp_vertex* c;
+        float d[3];
+        float sq;
+
+        c = &controls[i * stride];
+
+        for (j = 0; j < 3; ++j)
+        {
+            d[j] = c[0].position[j] - 2 * c[step].position[j] +
+                c[step * 2].position[j];
+        }
+
+        sq = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+        max_sq = SDL_max(max_sq, sq);
+    }
+
+    level = (int)SDL_ceil(SDL_sqrt(SDL_sqrt(max_sq) /
+        (4 * tessellation_error)));
+
+    return SDL_max(1, SDL_min(level, tessellation_level));
+}
+
+void patch_levels(struct patch* patch, struct bsp_vertex* controls)
+{
+    /* u runs along the control point columns, v along the rows */
+    patch->levels[0] = flatness_level(controls, 3, 1);
+    patch->levels[1] = flatness_level(controls, 1, 3);
+}
+
+/*
+ * position, texcoords and normal are the first 10 floats of a vertex, so
+ * each output vertex is a weighted sum of 9 rows of 10 floats. the inner
+ * loops have fixed trip counts and no dependencies between attributes so
+ * the compiler turns them into simd multiply-adds
+ *
+ * the color isn't interpolated, every vertex gets the first control
+ * point's color
+ */
+
+#define VERTEX_FLOATS 10
+
+void put_index(char* indices, int index_size, int i, int value)
+{
+    if (index_size == 2) {
+        ((unsigned short*)indices)[i] = (unsigned short)value;
+    } else {
+        ((int*)indices)[i] = value;
+    }
+}
+
+void tessellate(struct patch* patch, struct bsp_vertex* controls)
+{
+    int i, j, k;
+    int row, col;
+    int lu, lv;
+    float attrs[9][VERTEX_FLOATS];
+    float* bu;
+    float* bv;
+    struct bsp_vertex* vertices;
+    char* indices;
+
+    lu = patch->levels[0];
+    lv = patch->levels[1];
+    bu = bezier_basis(lu);
+    bv = bezier_basis(lv);
+
+    for (k = 0; k < 9; ++k)
+    {
+        SDL_memcpy(attrs[k], controls[k].position, sizeof(attrs[k]));
+
+        for (j = 0; j < 7; ++j) {
+            attrs[k][j] -= patch->origin[j];
+        }
+    }
+
+    vertices = patch_vertices(patch);
+
+    for (i = 0; i <= lu; ++i)
+    {
+        for (j = 0; j <= lv; ++j)
+        {
+            float w[9];
+            float sum[VERTEX_FLOATS];
+            struct bsp_vertex* vertex;
+
+            for (row = 0; row < 3; ++row)
+            {
+                for (col = 0; col < 3; ++col) {
+                    w[row * 3 + col] = bv[j * 3 + row] * bu[i * 3 + col];
+                }
+            }
+
+            for (k = 0; k < VERTEX_FLOATS; ++k) {
+                sum[k] = 0;
+            }
+
+            for (k = 0; k < 9; ++k)
+            {
+                int m;
+
+                for (m = 0; m < VERTEX_FLOATS; ++m) {
+                    sum[m] += w[k] * attrs[k][m];
+                }
+            }
+
+            vertex = &vertices[i * (lv + 1) + j];
+            SDL_memcpy(vertex->position, sum, sizeof(sum));
+            vertex->color = controls[0].color;
+        }
+    }
+
+    indices = patch_indices(patch);
+
+    for (i = 0; i < lu; ++i)
+    {
+        for (j = 0; j <= lv; ++j)
+        {
+            int n;
+
+            n = (i * (lv + 1) + j) * 2;
+            put_index(indices, patch->index_size, n + 1, i * (lv + 1) + j);
+            put_index(indices, patch->index_size, n, (i + 1) * (lv + 1) + j);
+        }
+    }
+}
+
+/*
+ * reserves the patch's range of the geometry arena. size is the running
+ * arena size and gets bumped past the patch
+ *
+ * any sane level fits in 16-bit indices, which halves the index memory
+ * and bandwidth. ranges are kept 4-byte aligned for the next vertices
+ */
+
+void layout_patch(struct patch* patch, int* size)
+{
+    int lu, lv;
+
+    lu = patch->levels[0];
+    lv = patch->levels[1];
+
+    patch->n_vertices = (lu + 1) * (lv + 1);
+    patch->vertices = *size;
+    *size += sizeof(struct bsp_vertex) * patch->n_vertices;
+
+    patch->n_indices = lu * (lv + 1) * 2;
+    patch->index_size = patch->n_vertices <= 0x10000 ? 2 : 4;
+    patch->indices = *size;
+    *size += patch->index_size * patch->n_indices;
+    *size = (*size + 3) & ~3;
+
+    patch->triangles_per_row = 2 * (lv + 1);
+    patch->n_rows = lu;
+}
+
+/* theres' multiple sets of bezier control points per face */
+
+void patch_controls(struct bsp_face* face, int x, int y,
+    struct bsp_vertex* controls)
+{
+    int row, col;
+
+    for (row = 0; row < 3; ++row)
+    {
+        for (col = 0; col < 3; ++col)
+        {
+            int index;
+
+            index = face->vertex +
+                y * 2 * face->size[0] + x * 2 +
+                row * face->size[0] + col;
+
+            controls[row * 3 + col] = map.vertices[index];
+        }
+    }
+}
+
+void tessellate_patch(int index)
+{
+    struct patch* patch;
+    struct bsp_vertex controls[9];
+
+    patch = &patches[index];
+    patch_controls(&map.faces[patch->face], patch->x, patch->y, controls);
+    tessellate(patch, controls);
+}
+
+/*
+ * data is the list of patch indices. the benchmarks call tessellate_patch
+ * directly so the counters aren't read inside their timed ops
+ */
+
+void tessellate_patches(void* data, int start, int end)
+{
+    int* indices;
+    int i;
+
+    indices = (int*)data;
+    prof_begin("tessellate_patches");
+    perf_begin(PERF_TESSELLATION);
+
+    for (i = start; i < end; ++i) {
+        tessellate_patch(indices[i]);
+    }
+
+    perf_end(PERF_TESSELLATION);
+    prof_end();
+}
+
+#define SURF_CLIP_EPSILON 0.125f
+
+enum tw_flags
+{
+    TW_STARTS_OUT = 1<<1,
+    TW_ENDS_OUT = 1<<2,
+    TW_ALL_SOLID = 1<<3,
+    TW_LAST_FLAG
+};
+
+struct trace_work
+{
+    float start[3];
+    float end[3];
+    float endpos[3];
+    float frac;
+    int flags;
+    float mins[3];
+    float maxs[3];
+    float center[3];
+    float offsets[8][3];
+    struct bsp_plane* plane;
+};
+
+/*
+ * - adjust plane dist to account for the bounding box
+ * - if both points are in front of the plane, we're done with this brush
+ * - if both points are behind the plane, we continue looping expecting
+ *   other planes to clip us
+ * - if we are entering the brush, clip start_frac to the distance
+ *   between the starting point and the brush minus the epsilon so we don't
+ *   actually touch
+ * - if we are exiting the brush, clip end_frac to the distance between
+ *   the starting point and the brush plus the epsilon so we don't
+ *   actually touch
+ * - keep collecting the maximum start_frac and minimum end_faction so
+ *   we get as close as possible to touching the brush but not quite
+ * - store the minimum start_frac out of all the brushes so we
+ *   clip against the closest brush
+ * - if the trace starts and ends inside the brush, negate the move
+ *
+ * (I assume this means that the brush sides are sorted from back to front)
+ */
+
+void trace_brush(struct trace_work* work, struct bsp_brush* brush)
+{
+    int i;
+    float start_frac;
+    float end_frac;
+    struct bsp_plane* closest_plane;
+
+    /* TODO: do optimized check for the first 6 planes which are axial */
+
+    start_frac = -1;
+    end_frac = 1;
+
+    for (i = 0; i < brush->n_brushsides; ++i)
+    {
+        int side_index;
+        int plane_index;
+        struct bsp_plane* plane;
+        int signbits;
+
+        float dist;
+        float start_distance, end_distance;
+        float frac;
+
+        side_index = brush->brushside + i;
+        plane_index = map.brushsides[side_index].plane;
+        plane = &map.planes[plane_index];
+        signbits = planes[plane_index].signbits;
+
+        dist = plane->dist - dot3(work->offsets[signbits], plane->normal);
+
+        start_distance = dot3(work->start, plane->normal) - dist;
+        end_distance = dot3(work->end, plane->normal) - dist;
+
+        /* TODO:
+         * for some reason these checks incorrectly report all solid
+         * when they shouldn't. for now I'm just ignoring them
+         */
+
+        if (start_distance > 0) {
+            work->flags |= TW_STARTS_OUT;
+        }
+
+        if (end_distance > 0) {
+            work->flags |= TW_ENDS_OUT;
+        }
+
+        if (start_distance > 0 &&
+            (end_distance >= SURF_CLIP_EPSILON ||
+             end_distance >= start_distance))
+        {
+            return;
+        }
+
+        if (start_distance <= 0 && end_distance <= 0) {
+            continue;
+        }
+
+        if (start_distance > end_distance)
+        {
+            frac = (start_distance - SURF_CLIP_EPSILON) /
+                (start_distance - end_distance);
+
+            if (frac > start_frac) {
+                start_frac = frac;
+                closest_plane = plane;
+            }
+        }
+
+        else
+        {
+            frac = (start_distance + SURF_CLIP_EPSILON) /
+                (start_distance - end_distance);
+
+            end_frac = SDL_min(end_frac, frac);
+        }
+    }
+
+    if (start_frac < end_frac &&
+        start_frac > -1 && start_frac < work->frac)
+    {
+        work->frac = SDL_max(start_frac, 0);
+        work->plane = closest_plane;
+    }
+
+    if (!(work->flags & (TW_STARTS_OUT | TW_ENDS_OUT))) {
+        work->frac = 0;
+    }
+}
+
+/*
+ * - for leaves, only trace brush if the contents are solid and the brush
+ *   has sides
+ * - for nodes, recurse into front/back if both start and end are in front
+ *   of, or behind the node's plane
+ * - if start -> end crosses over two nodes, we need to recurse into both
+ *   nodes and split the start -> end segment into two segment that are
+ *   just short of crossing over by adding SURFACE_CLIP_EPSILON
+ * - planes contain an enum that can tell us if they are axis aligned.
+ *   when they are axis aligned, we can skip some calculations because
+ *   the bounding box is also axis aligned
+ */
+
+void trace_leaf(struct trace_work* work, int index)
+{
+    int i;
+    struct bsp_leaf* leaf;
+
+    leaf = &map.leaves[index];
+
+    /* render profile, no collision data */
+    if (!map.leafbrushes) {
+        return;
+    }
+
+    for (i = 0; i < leaf->n_leafbrushes; ++i)
+    {
+        struct bsp_brush* brush;
+        int contents;
+        int brush_index;
+
+        brush_index = map.leafbrushes[leaf->leafbrush + i];
+        brush = &map.brushes[brush_index];
+        contents = map.textures[brush->texture].contents;
+
+        if (brush->n_brushsides && (contents & CONTENTS_SOLID))
+        {
+            trace_brush(work, brush);
+
+            if (!work->frac) {
+                return;
+            }
+        }
+    }
+
+    /* TODO: collision with patches */
+}
+
+void trace_node(struct trace_work* work, int index, float start_frac,
+    float end_frac, float* start, float* end)
+{
+    int i;
+    struct bsp_node* node;
+    struct bsp_plane* plane;
+    int plane_type;
+
+    float start_distance;
+    float end_distance;
+    float offset;
+
+    int side;
+    float idistance;
+    float frac1;
+    float frac2;
+    float mid_frac;
+    float mid[3];
+
+    if (index < 0) {
+        trace_leaf(work, (-index) - 1);
+        return;
+    }
+
+    node = &map.nodes[index];
+    plane = &map.planes[node->plane];
+    plane_type = planes[node->plane].type;
+
+    if (plane_type < 3)
+    {
+        start_distance = start[plane_type] - plane->dist;
+        end_distance = end[plane_type] - plane->dist;
+        offset = work->maxs[plane_type];
+    }
+    else
+    {
+        start_distance = dot3(start, plane->normal) - plane->dist;
+        end_distance = dot3(end, plane->normal) - plane->dist;
+
+        if (eq3(work->mins, work->maxs)) {
+            offset = 0;
+        } else {
+            /* "this is silly" - id Software */
+            offset = 2048;
+        }
+    }
+
+    if (start_distance >= offset + 1 && end_distance >= offset + 1) {
+        trace_node(work, node->child[0], start_frac, end_frac, start, end);
+        return;
+    }
+
+    if (start_distance < -offset - 1 && end_distance < -offset - 1) {
+        trace_node(work, node->child[1], start_frac, end_frac, start, end);
+        return;
+    }
+
+    if (start_distance < end_distance)
+    {
+        side = 1;
+        idistance = 1.0f / (start_distance - end_distance);
+        frac1 = (start_distance - offset + SURF_CLIP_EPSILON) * idistance;
+        frac2 = (start_distance + offset + SURF_CLIP_EPSILON) * idistance;
+    }
+
+    else if (start_distance > end_distance)
+    {
+        side = 0;
+        idistance = 1.0f / (start_distance - end_distance);
+        frac1 = (start_distance + offset + SURF_CLIP_EPSILON) * idistance;
+        frac2 = (start_distance - offset - SURF_CLIP_EPSILON) * idistance;
+    }
+
+    else
+    {
+        side = 0;
+        frac1 = 1;
+        frac2 = 0;
+    }
+
+    frac1 = SDL_max(0, SDL_min(1, frac1));
+    frac2 = SDL_max(0, SDL_min(1, frac2));
+
+    mid_frac = start_frac + (end_frac - start_frac) * frac1;
+
+    for (i = 0; i < 3; ++i) {
+        mid[i] = start[i] + (end[i] - start[i]) * frac1;
+    }
+
+    trace_node(work, node->child[side], start_frac, mid_frac, start, mid);
+
+    mid_frac = start_frac + (end_frac - start_frac) * frac2;
+
+    for (i = 0; i < 3; ++i) {
+        mid[i] = start[i] + (end[i] - start[i]) * frac2;
+    }
+
+    trace_node(work, node->child[side^1], mid_frac, end_frac, mid, end);
+}
+
+/*
+ * - adjust bounding box so it's symmetric. this is simply done by finding
+ *   the middle point and remembering it so start/end can be moved to align
+ *   with it
+ * - initialize offsets. this is a lookup table for mins/maxs with any
+ *   sign combination for the plane's normal. it ensures that we account
+ *   for the hitbox in the right orientation in trace_brush
+ *
+ * the bounds only need to be set up once for any number of sweeps with
+ * the same box
+ */
+
+void trace_bounds(struct trace_work* work, float* mins, float* maxs)
+{
+    int i;
+
+    for (i = 0; i < 3; ++i)
+    {
+        work->center[i] = (mins[i] + maxs[i]) * 0.5f;
+        work->mins[i] = mins[i] - work->center[i];
+        work->maxs[i] = maxs[i] - work->center[i];
+    }
+
+    work->offsets[0][0] = work->mins[0];
+    work->offsets[0][1] = work->mins[1];
+    work->offsets[0][2] = work->mins[2];
+
+    work->offsets[1][0] = work->maxs[0];
+    work->offsets[1][1] = work->mins[1];
+    work->offsets[1][2] = work->mins[2];
+
+    work->offsets[2][0] = work->mins[0];
+    work->offsets[2][1] = work->maxs[1];
+    work->offsets[2][2] = work->mins[2];
+
+    work->offsets[3][0] = work->maxs[0];
+    work->offsets[3][1] = work->maxs[1];
+    work->offsets[3][2] = work->mins[2];
+
+    work->offsets[4][0] = work->mins[0];
+    work->offsets[4][1] = work->mins[1];
+    work->offsets[4][2] = work->maxs[2];
+
+    work->offsets[5][0] = work->maxs[0];
+    work->offsets[5][1] = work->mins[1];
+    work->offsets[5][2] = work->maxs[2];
+
+    work->offsets[6][0] = work->mins[0];
+    work->offsets[6][1] = work->maxs[1];
+    work->offsets[6][2] = work->maxs[2];
+
+    work->offsets[7][0] = work->maxs[0];
+    work->offsets[7][1] = work->maxs[1];
+    work->offsets[7][2] = work->maxs[2];
+}
+
+/*
+ * - move start/end to align with the middle of the bounding box
+ * - do the tracing
+ * - if we hit anything, calculate end from the unmodified start/end
+ */
+
+int trace_count;
+
+void trace_sweep(struct trace_work* work, float* start, float* end)
+{
+    int i;
+
+    ++trace_count;
+    work->frac = 1;
+    work->flags = 0;
+
+    for (i = 0; i < 3; ++i) {
+        work->start[i] = start[i] + work->center[i];
+        work->end[i] = end[i] + work->center[i];
+    }
+
+    trace_node(work, 0, 0, 1, work->start, work->end);
+
+    if (work->frac == 1) {
+        cpy3(work->endpos, end);
+    } else {
+        for (i = 0; i < 3; ++i) {
+            work->endpos[i] = start[i] + work->frac * (end[i] - start[i]);
+        }
+    }
+}
+
+void trace(struct trace_work* work, float* start, float* end, float* mins,
+    float* maxs)
+{
+    trace_bounds(work, mins, maxs);
+    trace_sweep(work, start, end);
+}
+
+void trace_point(struct trace_work* work, float* start, float* end)
+{
+    float zero[3];
+
+    clr3(zero);
+    trace(work, start, end, zero, zero);
+}
+
+/*
+ * traces from one point to many points at once. the zero sized bounds are
+ * only set up once and the sweeps run back to back so the nodes near
+ * start stay in cache. fracs receives each sweep's frac
+ */
+
+void trace_point_batch(float* start, float* ends, int n, float* fracs)
+{
+    struct trace_work work;
+    float zero[3];
+    int i;
+
+    clr3(zero);
+    trace_bounds(&work, zero, zero);
+
+    for (i = 0; i < n; ++i) {
+        trace_sweep(&work, start, &ends[i * 3]);
+        fracs[i] = work.frac;
+    }
+}
+
+int plane_type_for_normal(float* normal)
+{
+    if (normal[0] == 1.0f || normal[0] == -1.0f) {
+        return PLANE_X;
+    }
+
+    if (normal[1] == 1.0f || normal[1] == -1.0f) {
+        return PLANE_Y;
+    }
+
+    if (normal[2] == 1.0f || normal[2] == -1.0f) {
+        return PLANE_Z;
+    }
+
+    return PLANE_NONAXIAL;
+}
+
+int signbits_for_normal(float* normal)
+{
+    int i;
+    int bits;
+
+    bits = 0;
+
+    for (i = 0; i < 3; ++i)
+    {
+        if (normal[i] < 0) {
+            bits |= 1<<i;
+        }
+    }
+
+    return bits;
+}
+
+void init_planes()
+{
+    int i;
+
+    planes = (struct plane*)
+        arena_alloc(&map_arena, map.n_planes * sizeof(struct plane));
+
+    for (i = 0; i < map.n_planes; ++i) {
+        planes[i].signbits = signbits_for_normal(map.planes[i].normal);
+        planes[i].type = plane_type_for_normal(map.planes[i].normal);
+    }
+}
+
+/*
+ * two sub-patches that share an edge must put the same number of vertices
+ * along it or the surface cracks where their levels differ. the edge of a
+ * sub-patch along u always uses its u level and the edge along v its v
+ * level, so every column of sub-patches in a face shares one u level and
+ * every row shares one v level. those are the level variables below
+ *
+ * edges are matched across faces by hashing the positions of their 3
+ * control points (snapped to 1/8 unit, in either direction), and the
+ * variables of matching edges are merged with union-find. each merged set
+ * ends up at the finest level of its members, so the coarse side of an
+ * edge gets bumped up to the finer one
+ *
+ * edges that only partially overlap another edge (t-junctions between
+ * patches of different control point counts) aren't matched
+ */
+
+struct stitch_edge
+{
+    int key[9];
+    int var; /* -1 for empty slots */
+};
+
+struct stitch_edge* stitch_edges;
+int stitch_mask;
+int* stitch_parents;
+int* stitch_levels;
+
+int stitch_find(int var)
+{
+    while (stitch_parents[var] != var)
+    {
+        stitch_parents[var] = stitch_parents[stitch_parents[var]];
+        var = stitch_parents[var];
+    }
+
+    return var;
+}
+
+void stitch_raise(int var, int level)
+{
+    var = stitch_find(var);
+    stitch_levels[var] = SDL_max(stitch_levels[var], level);
+}
+
+void stitch_union(int a, int b)
+{
+    a = stitch_find(a);
+    b = stitch_find(b);
+
+    if (a != b) {
+        stitch_parents[b] = a;
+        stitch_raise(a, stitch_levels[b]);
+    }
+}
+
+void stitch_edge(struct bsp_vertex* a, struct bsp_vertex* b,
+    struct bsp_vertex* c, int var)
+{
+    struct bsp_vertex* points[3];
+    struct stitch_edge* edge;
+    int key[9];
+    unsigned hash;
+    int i, j;
+
+    points[0] = a;
+    points[1] = b;
+    points[2] = c;
+
+    for (i = 0; i < 3; ++i)
+    {
+        for (j = 0; j < 3; ++j) {
+            key[i * 3 + j] = (int)SDL_floor(points[i]->position[j] * 8 + 0.5f);
+        }
+    }
+
+    /* the same edge seen from the other patch runs the other way */
+    if (memcmp(&key[0], &key[6], sizeof(int) * 3) > 0)
+    {
+        for (j = 0; j < 3; ++j)
+        {
+            int tmp;
+
+            tmp = key[j];
+            key[j] = key[6 + j];
+            key[6 + j] = tmp;
+        }
+    }
+
+    hash = 2166136261u;
+
+    for (i = 0; i < 9; ++i) {
+        hash = (hash ^ (unsigned)key[i]) * 16777619u;
+    }
+
+    for (i = hash & stitch_mask; ; i = (i + 1) & stitch_mask)
+    {
+        edge = &stitch_edges[i];
+
+        if (edge->var < 0)
+        {
+            memcpy(edge->key, key, sizeof(key));
+            edge->var = var;
+            return;
+        }
+
+        if (!memcmp(edge->key, key, sizeof(key))) {
+            stitch_union(edge->var, var);
+            return;
+        }
+    }
+}
+
+/*
+ * patches must already have their flatness levels. n_vars is the total
+ * width + height in sub-patches of every patch face
+ */
+
+void stitch_patches(int n_vars)
+{
+    int i, x, y;
+    int n_edges;
+    int capacity;
+    int var;
+    struct patch* patch;
+
+    vec_clear(stitch_parents);
+    vec_clear(stitch_levels);
+    vec_reserve(stitch_parents, n_vars);
+    vec_reserve(stitch_levels, n_vars);
+
+    for (i = 0; i < n_vars; ++i) {
+        vec_append(stitch_parents, i);
+        vec_append(stitch_levels, 1);
+    }
+
+    n_edges = vec_len(patches) * 4;
+
+    capacity = 16;
+
+    while (capacity < n_edges * 2) {
+        capacity *= 2;
+    }
+
+    vec_clear(stitch_edges);
+    vec_reserve(stitch_edges, capacity);
+    vec_hdr(stitch_edges)->n = capacity;
+    stitch_mask = capacity - 1;
+
+    for (i = 0; i < capacity; ++i) {
+        stitch_edges[i].var = -1;
+    }
+
+    var = 0;
+
+    for (i = 0; i < map.n_faces; ++i)
+    {
+        struct bsp_face* face;
+        int width, height;
+
+        face = &map.faces[i];
+
+        if (face->type != BSP_PATCH) {
+            continue;
+        }
+
+        width = (face->size[0] - 1) / 2;
+        height = (face->size[1] - 1) / 2;
+        patch = &patches[face_patches[i]];
+
+        for (y = 0; y < height; ++y)
+        {
+            for (x = 0; x < width; ++x)
+            {
+                struct bsp_vertex c[9];
+                int u, v;
+
+                u = var + x;
+                v = var + width + y;
+                patch_controls(face, x, y, c);
+
+                stitch_raise(u, patch[y * width + x].levels[0]);
+                stitch_raise(v, patch[y * width + x].levels[1]);
+                stitch_edge(&c[0], &c[1], &c[2], u);
+                stitch_edge(&c[6], &c[7], &c[8], u);
+                stitch_edge(&c[0], &c[3], &c[6], v);
+                stitch_edge(&c[2], &c[5], &c[8], v);
+            }
+        }
+
+        var += width + height;
+    }
+
+    var = 0;
+
+    for (i = 0; i < map.n_faces; ++i)
+    {
+        struct bsp_face* face;
+        int width, height;
+
+        face = &map.faces[i];
+
+        if (face->type != BSP_PATCH) {
+            continue;
+        }
+
+        width = (face->size[0] - 1) / 2;
+        height = (face->size[1] - 1) / 2;
+        patch = &patches[face_patches[i]];
+
+        for (y = 0; y < height; ++y)
+        {
+            for (x = 0; x < width; ++x, ++patch)
+            {
+                patch->levels[0] = stitch_levels[stitch_find(var + x)];
+                patch->levels[1] =
+                    stitch_levels[stitch_find(var + width + y)];
+            }
+        }
+
+        var += width + height;
+    }
+}
+
+/*
+ * maps reuse the same curved pieces all over the place, pillars and
+ * arches that only differ by where they are. tessellation happens
+ * relative to the first control point, so two patches whose control
+ * points match after subtracting it (and that ended up at the same
+ * levels) produce the exact same geometry. those share one range of the
+ * arena and get drawn with their own translation
+ *
+ * texcoords are made relative the same way, so instances with shifted
+ * texture or lightmap coordinates still match. the origin keeps the
+ * offset for when texturing is added
+ */
+
+struct patch_key
+{
+    float attrs[9][VERTEX_FLOATS];
+    int color;
+    int levels[2];
+};
+
+struct patch_key* patch_keys;
+int* dedup_table;
+
+int dedup_patches()
+{
+    int i, j;
+    int capacity;
+    int mask;
+    int n_unique;
+
+    capacity = 16;
+
+    while (capacity < vec_len(patches) * 2) {
+        capacity *= 2;
+    }
+
+    mask = capacity - 1;
+    vec_clear(dedup_table);
+    vec_reserve(dedup_table, capacity);
+    vec_hdr(dedup_table)->n = capacity;
+
+    for (i = 0; i < capacity; ++i) {
+        dedup_table[i] = -1;
+    }
+
+    vec_clear(patch_keys);
+    vec_reserve(patch_keys, vec_len(patches));
+    n_unique = 0;
+
+    for (i = 0; i < vec_len(patches); ++i)
+    {
+        struct patch* patch;
+        struct patch_key* key;
+        struct bsp_vertex controls[9];
+        unsigned char* bytes;
+        unsigned hash;
+        int k;
+
+        patch = &patches[i];
+        patch_controls(&map.faces[patch->face], patch->x, patch->y, controls);
+
+        key = vec_append_p(patch_keys);
+        memset(key, 0, sizeof(*key));
+
+        for (k = 0; k < 9; ++k)
+        {
+            SDL_memcpy(key->attrs[k], controls[k].position,
+                sizeof(key->attrs[k]));
+
+            for (j = 0; j < 7; ++j) {
+                key->attrs[k][j] -= patch->origin[j];
+            }
+        }
+
+        key->color = controls[0].color;
+        key->levels[0] = patch->levels[0];
+        key->levels[1] = patch->levels[1];
+
+        hash = 2166136261u;
+        bytes = (unsigned char*)key;
+
+        for (j = 0; j < (int)sizeof(*key); ++j) {
+            hash = (hash ^ bytes[j]) * 16777619u;
+        }
+
+        for (j = hash & mask; ; j = (j + 1) & mask)
+        {
+            if (dedup_table[j] < 0)
+            {
+                dedup_table[j] = i;
+                patch->source = i;
+                ++n_unique;
+                break;
+            }
+
+            if (!memcmp(&patch_keys[dedup_table[j]], key, sizeof(*key))) {
+                patch->source = dedup_table[j];
+                break;
+            }
+        }
+    }
+
+    /*
+     * patches nobody else shares are tessellated in place with a zero
+     * origin so render doesn't need to translate them. the table isn't
+     * needed anymore, reuse it to count the users of each source
+     */
+
+    for (i = 0; i < vec_len(patches); ++i) {
+        dedup_table[i] = 0;
+    }
+
+    for (i = 0; i < vec_len(patches); ++i) {
+        ++dedup_table[patches[i].source];
+    }
+
+    for (i = 0; i < vec_len(patches); ++i)
+    {
+        if (dedup_table[patches[i].source] == 1) {
+            memset(patches[i].origin, 0, sizeof(patches[i].origin));
+        }
+    }
+
+    return n_unique;
+}
+
+/*
+ * the geometry of every patch lives in one contiguous arena, so it can be
+ * uploaded or cached as a single blob and thrown away in one go when the
+ * map or tessellation level changes.
+ *
+ * load time only picks and stitches the levels and finds duplicates.
+ * faces are tessellated the first time they show up in the visible set:
+ * render queues them with request_tessellation and draws a coarse
+ * fallback until they're ready. once the frame is swapped,
+ * kick_tessellation lays out the patches of as many queued faces as fit
+ * in the per-frame budget, grows the arena, and hands them to the job
+ * threads while the main thread goes on with the next update.
+ * finish_tessellation waits for them at the start of the next render
+ *
+ * the jobs only write into their own preallocated ranges and never
+ * allocate, and the arena only moves while no job is running
+ */
+
+#define TESSELLATION_BUDGET 16384 /* vertices per frame */
+
+enum face_state
+{
+    FACE_UNTESSELLATED,
+    FACE_QUEUED,
+    FACE_TESSELLATED
+};
+
+unsigned char* face_states;
+int* tessellation_queue;
+int tessellation_queue_head;
+int* tessellating_faces;
+int* tessellating_patches;
+
+void init_patches()
+{
+    int i, x, y;
+    int width, height;
+    int n_triangles;
+    int n_vars;
+    int n_unique;
+
+    jobs_wait();
+    vec_clear(patches);
+    vec_clear(patch_geometry);
+    vec_clear(tessellation_queue);
+    vec_clear(tessellating_faces);
+    vec_clear(tessellating_patches);
+    tessellation_queue_head = 0;
+
+    face_patches = (int*)
+        arena_alloc(&map_arena, map.n_faces * sizeof(face_patches[0]));
+
+    face_states = (unsigned char*)arena_alloc(&map_arena, map.n_faces);
+    memset(face_states, FACE_UNTESSELLATED, map.n_faces);
+
+    init_bezier_weights(tessellation_level);
+    n_triangles = 0;
+    n_vars = 0;
+
+    for (i = 0; i < map.n_faces; ++i)
+    {
+        struct bsp_face* face;
+
+        face = &map.faces[i];
+        face_patches[i] = vec_len(patches);
+
+        if (face->type != BSP_PATCH) {
+            continue;
+        }
+
+        width = (face->size[0] - 1) / 2;
+        height = (face->size[1] - 1) / 2;
+
+        for (y = 0; y < height; ++y)
+        {
+            for (x = 0; x < width; ++x)
+            {
+                struct bsp_vertex controls[9];
+                struct patch* patch;
+
+                patch = vec_append_p(patches);
+                memset(patch, 0, sizeof(*patch));
+                patch->face = i;
+                patch->x = x;
+                patch->y = y;
+                patch->vertices = -1;
+                patch_controls(face, x, y, controls);
+                SDL_memcpy(patch->origin, controls[0].position,
+                    sizeof(patch->origin));
+                patch_levels(patch, controls);
+            }
+        }
+
+        n_vars += width + height;
+    }
+
+    stitch_patches(n_vars);
+    n_unique = dedup_patches();
+
+    for (i = 0; i < vec_len(patches); ++i) {
+        n_triangles += patches[i].levels[0] * patches[i].levels[1] * 2;
+    }
+
+    log_print(lninfo, "%d patches, %d unique, %d triangles",
+        vec_len(patches), n_unique, n_triangles);
+}
+
+void request_tessellation(int face_index)
+{
+    if (face_states[face_index] == FACE_UNTESSELLATED) {
+        face_states[face_index] = FACE_QUEUED;
+        vec_append(tessellation_queue, face_index);
+    }
+}
+
+void finish_tessellation()
+{
+    int i;
+
+    jobs_wait();
+
+    for (i = 0; i < vec_len(tessellating_faces); ++i) {
+        face_states[tessellating_faces[i]] = FACE_TESSELLATED;
+    }
+
+    vec_clear(tessellating_faces);
+    vec_clear(tessellating_patches);
+}
+
+void kick_tessellation()
+{
+    int budget;
+    int size;
+
+    finish_tessellation();
+
+    budget = TESSELLATION_BUDGET;
+    size = vec_len(patch_geometry);
+
+    /* always take at least one face so huge ones still get done */
+    while (budget > 0 &&
+        tessellation_queue_head < vec_len(tessellation_queue))
+    {
+        struct bsp_face* face;
+        struct patch* patch;
+        int face_index;
+        int i, npatches;
+
+        face_index = tessellation_queue[tessellation_queue_head++];
+        face = &map.faces[face_index];
+        patch = &patches[face_patches[face_index]];
+
+        npatches = (face->size[0] - 1) / 2;
+        npatches *= (face->size[1] - 1) / 2;
+
+        for (i = 0; i < npatches; ++i)
+        {
+            struct patch* source;
+
+            source = &patches[patch[i].source];
+
+            if (source->vertices < 0)
+            {
+                layout_patch(source, &size);
+                budget -= source->n_vertices;
+                vec_append(tessellating_patches, patch[i].source);
+            }
+        }
+
+        vec_append(tessellating_faces, face_index);
+    }
+
+    if (tessellation_queue_head >= vec_len(tessellation_queue)) {
+        vec_clear(tessellation_queue);
+        tessellation_queue_head = 0;
+    }
+
+    if (!vec_len(tessellating_patches)) {
+        return;
+    }
+
+    vec_grow(patch_geometry, size);
+    vec_hdr(patch_geometry)->n = size;
+
+    parallel_for_async(vec_len(tessellating_patches), 1, tessellate_patches,
+        tessellating_patches);
+}
+
+/*
+ * entities are linked into a quake 3 style area node tree, which is a
+ * kd-tree that splits the world bounds in half along x or y a fixed number
+ * of times. an entity lives in the deepest node that fully contains its
+ * bounds, so a box query only looks at the nodes the box overlaps
+ *
+ * entities are also linked into every bsp leaf their bounds touch and
+ * remember the clusters of those leaves, so pvs checks don't have to walk
+ * the bsp tree again. the clusters are kept as a sparse bitset, 32-bit
+ * words of a pvs row with the entity's bits set, so a pvs check is an AND
+ * per word instead of a test per cluster
+ *
+ * brush entities use their model's bounds, everything else is a point at
+ * its origin
+ */
+
+#define AREA_DEPTH 4
+#define AREA_NODES (1 << (AREA_DEPTH + 1))
+#define MAX_ENTITY_LEAVES 32
+#define MAX_ENTITY_CLUSTER_WORDS 16
+
+struct area_node
+{
+    int axis; /* -1 for the nodes at the bottom of the tree */
+    float dist;
+    int child[2]; /* front, back */
+    int first_entity; /* -1 if empty */
+};
+
+/*
+ * leaf refs are numbered entity * MAX_ENTITY_LEAVES + slot so the lists
+ * don't need a separate pool
+ */
+
+struct leaf_ref
+{
+    int leaf;
+    int prev;
+    int next;
+};
+
+struct entity_link
+{
+    float origin[3];
+    float mins[3];
+    float maxs[3];
+    int area_node; /* -1 if not linked */
+    int area_prev;
+    int area_next;
+    int n_leaves;
+    struct leaf_ref leaves[MAX_ENTITY_LEAVES];
+    int n_cluster_words; /* -1 if there were too many to remember */
+    int cluster_words[MAX_ENTITY_CLUSTER_WORDS];
+    Uint32 cluster_masks[MAX_ENTITY_CLUSTER_WORDS];
+};
+
+struct area_node area_nodes[AREA_NODES];
+int n_area_nodes;
+struct entity_link* entity_links;
+int* leaf_entities; /* first leaf ref in each leaf, -1 if empty */
+
+#define leaf_ref_entity(ref) ((ref) / MAX_ENTITY_LEAVES)
+#define leaf_ref_at(ref) \
+    (&entity_links[(ref) / MAX_ENTITY_LEAVES].leaves[(ref) % \
+        MAX_ENTITY_LEAVES])
+
+int create_area_node(int depth, float* mins, float* maxs)
+{
+    struct area_node* node;
+    int index;
+    float size[3];
+    float mins1[3], maxs1[3], mins2[3], maxs2[3];
+
+    index = n_area_nodes++;
+    node = &area_nodes[index];
+    node->first_entity = -1;
+
+    if (depth == AREA_DEPTH) {
+        node->axis = -1;
+        node->child[0] = node->child[1] = -1;
+        return index;
+    }
+
+    cpy3(size, maxs);
+    size[0] -= mins[0];
+    size[1] -= mins[1];
+    size[2] -= mins[2];
+
+    node->axis = size[0] > size[1] ? 0 : 1;
+    node->dist = 0.5f * (maxs[node->axis] + mins[node->axis]);
+
+    cpy3(mins1, mins);
+    cpy3(maxs1, maxs);
+    cpy3(mins2, mins);
+    cpy3(maxs2, maxs);
+    maxs1[node->axis] = mins2[node->axis] = node->dist;
+
+    node->child[0] = create_area_node(depth + 1, mins2, maxs2);
+    node->child[1] = create_area_node(depth + 1, mins1, maxs1);
+
+    return index;
+}
+
+/* returns 1 if the box is in front of the plane, 2 if behind, 3 if both */
+
+int box_on_plane_side(float* mins, float* maxs, struct bsp_plane* plane)
+{
+    int i;
+    float closest[3], farthest[3];
+    int sides;
+
+    for (i = 0; i < 3; ++i)
+    {
+        if (plane->normal[i] >= 0) {
+            closest[i] = mins[i];
+            farthest[i] = maxs[i];
+        } else {
+            closest[i] = maxs[i];
+            farthest[i] = mins[i];
+        }
+    }
+
+    sides = 0;
+
+    if (dot3(farthest, plane->normal) >= plane->dist) {
+        sides |= 1;
+    }
+
+    if (dot3(closest, plane->normal) < plane->dist) {
+        sides |= 2;
+    }
+
+    return sides;
+}
+
+void link_entity_leaf(struct entity_link* link, int entity, int leaf)
+{
+    struct leaf_ref* ref;
+    int ref_index;
+    int cluster;
+    int word;
+    int i;
+
+    if (link->n_leaves >= MAX_ENTITY_LEAVES) {
+        link->n_cluster_words = -1;
+        return;
+    }
+
+    ref_index = entity * MAX_ENTITY_LEAVES + link->n_leaves;
+    ref = &link->leaves[link->n_leaves++];
+    ref->leaf = leaf;
+    ref->prev = -1;
+    ref->next = leaf_entities[leaf];
+
+    if (ref->next >= 0) {
+        leaf_ref_at(ref->next)->prev = ref_index;
+    }
+
+    leaf_entities[leaf] = ref_index;
+
+    cluster = map.leaves[leaf].cluster;
+
+    if (cluster < 0 || link->n_cluster_words < 0) {
+        return;
+    }
+
+    word = cluster / 32;
+
+    for (i = 0; i < link->n_cluster_words; ++i)
+    {
+        if (link->cluster_words[i] == word) {
+            link->cluster_masks[i] |= (Uint32)1 << (cluster % 32);
+            return;
+        }
+    }
+
+    if (link->n_cluster_words >= MAX_ENTITY_CLUSTER_WORDS) {
+        link->n_cluster_words = -1;
+    } else {
+        link->cluster_words[i] = word;
+        link->cluster_masks[i] = (Uint32)1 << (cluster % 32);
+        ++link->n_cluster_words;
+    }
+}
+
+void link_entity_leaves(struct entity_link* link, int entity, int index)
+{
+    while (index >= 0)
+    {
+        struct bsp_node* node;
+        int sides;
+
+        node = &map.nodes[index];
+        sides = box_on_plane_side(link->mins, link->maxs,
+            &map.planes[node->plane]);
+
+        if (sides == 1) {
+            index = node->child[0];
+        } else if (sides == 2) {
+            index = node->child[1];
+        } else {
+            link_entity_leaves(link, entity, node->child[0]);
+            index = node->child[1];
+        }
+    }
+
+    link_entity_leaf(link, entity, (-index) - 1);
+}
+
+void unlink_entity(int entity)
+{
+    struct entity_link* link;
+    int i;
+
+    link = &entity_links[entity];
+
+    if (link->area_node < 0) {
+        return;
+    }
+
+    if (link->area_prev >= 0) {
+        entity_links[link->area_prev].area_next = link->area_next;
+    } else {
+        area_nodes[link->area_node].first_entity = link->area_next;
+    }
+
+    if (link->area_next >= 0) {
+        entity_links[link->area_next].area_prev = link->area_prev;
+    }
+
+    for (i = 0; i < link->n_leaves; ++i)
+    {
+        struct leaf_ref* ref;
+
+        ref = &link->leaves[i];
+
+        if (ref->prev >= 0) {
+            leaf_ref_at(ref->prev)->next = ref->next;
+        } else {
+            leaf_entities[ref->leaf] = ref->next;
+        }
+
+        if (ref->next >= 0) {
+            leaf_ref_at(ref->next)->prev = ref->prev;
+        }
+    }
+
+    link->area_node = -1;
+    link->n_leaves = 0;
+    link->n_cluster_words = 0;
+}
+
+/*
+ * (re)links an entity with the given absolute bounds. entities that move
+ * just get linked again every time they move
+ */
+
+void link_entity(int entity, float* mins, float* maxs)
+{
+    struct entity_link* link;
+    struct area_node* node;
+    int index;
+
+    unlink_entity(entity);
+
+    link = &entity_links[entity];
+    cpy3(link->mins, mins);
+    cpy3(link->maxs, maxs);
+
+    link_entity_leaves(link, entity, 0);
+
+    index = 0;
+
+    while (1)
+    {
+        node = &area_nodes[index];
+
+        if (node->axis < 0) {
+            break;
+        }
+
+        if (mins[node->axis] > node->dist) {
+            index = node->child[0];
+        } else if (maxs[node->axis] < node->dist) {
+            index = node->child[1];
+        } else {
+            break;
+        }
+    }
+
+    link->area_node = index;
+    link->area_prev = -1;
+    link->area_next = node->first_entity;
+
+    if (link->area_next >= 0) {
+        entity_links[link->area_next].area_prev = entity;
+    }
+
+    node->first_entity = entity;
+}
+
+/* adds a new unlinked entity link and returns its index */
+
+int alloc_entity_link()
+{
+    struct entity_link* link;
+
+    link = vec_append_p(entity_links);
+    clr3(link->origin);
+    link->area_node = -1;
+    link->n_leaves = 0;
+    link->n_cluster_words = 0;
+
+    return vec_len(entity_links) - 1;
+}
+
+int entity_bounds(int entity, float* origin, float* mins,
+    float* maxs)
+{
+    int i;
+    int has_origin;
+
+    cpy3(origin, &entity_origins[entity * 3]);
+    has_origin = (entity_components[entity] & COMPONENT_ORIGIN) != 0;
+
+    if (entity_components[entity] & COMPONENT_MODEL)
+    {
+        struct bsp_model* model;
+
+        i = entity_models[entity];
+
+        if (i <= 0 || i >= map.n_models) {
+            return 0;
+        }
+
+        model = &map.models[i];
+        cpy3(mins, model->mins);
+        cpy3(maxs, model->maxs);
+        add3(mins, origin);
+        add3(maxs, origin);
+
+        if (!has_origin)
+        {
+            for (i = 0; i < 3; ++i) {
+                origin[i] = (mins[i] + maxs[i]) * 0.5f;
+            }
+        }
+
+        return 1;
+    }
+
+    cpy3(mins, origin);
+    cpy3(maxs, origin);
+
+    return has_origin;
+}
+
+void init_entity_links()
+{
+    int i;
+    float mins[3], maxs[3];
+
+    /* the model is packed, don't pass pointers into it */
+    cpy3(mins, map.models[0].mins);
+    cpy3(maxs, map.models[0].maxs);
+
+    n_area_nodes = 0;
+    create_area_node(0, mins, maxs);
+
+    leaf_entities = (int*)
+        arena_alloc(&map_arena, map.n_leaves * sizeof(int));
+
+    for (i = 0; i < map.n_leaves; ++i) {
+        leaf_entities[i] = -1;
+    }
+
+    vec_clear(entity_links);
+
+    for (i = 0; i < vec_len(entities); ++i)
+    {
+        alloc_entity_link();
+
+        if (entity_bounds(i, entity_links[i].origin, mins, maxs))
+        {
+            link_entity(i, mins, maxs);
+        }
+    }
+}
+
+/*
+ * collects the entities whose bounds overlap the box. only the area nodes
+ * that the box overlaps are visited
+ */
+
+int entities_in_box(float* mins, float* maxs, int* results,
+    int max_results)
+{
+    int stack[AREA_DEPTH + 2];
+    int n_stack;
+    int n_results;
+
+    n_results = 0;
+    n_stack = 0;
+    stack[n_stack++] = 0;
+
+    while (n_stack)
+    {
+        struct area_node* node;
+        int i;
+
+        node = &area_nodes[stack[--n_stack]];
+
+        for (i = node->first_entity; i >= 0; i = entity_links[i].area_next)
+        {
+            struct entity_link* link;
+
+            link = &entity_links[i];
+
+            if (link->mins[0] > maxs[0] || link->maxs[0] < mins[0] ||
+                link->mins[1] > maxs[1] || link->maxs[1] < mins[1] ||
+                link->mins[2] > maxs[2] || link->maxs[2] < mins[2])
+            {
+                continue;
+            }
+
+            if (n_results >= max_results) {
+                return n_results;
+            }
+
+            results[n_results++] = i;
+        }
+
+        if (node->axis < 0) {
+            continue;
+        }
+
+        if (maxs[node->axis] > node->dist) {
+            stack[n_stack++] = node->child[0];
+        }
+
+        if (mins[node->axis] < node->dist) {
+            stack[n_stack++] = node->child[1];
+        }
+    }
+
+    return n_results;
+}
+
+/* collects the entities whose bounds touch a bsp leaf */
+
+int entities_in_leaf(int leaf, int* results, int max_results)
+{
+    int ref;
+    int n_results;
+
+    n_results = 0;
+
+    for (ref = leaf_entities[leaf];
+        ref >= 0 && n_results < max_results;
+        ref = leaf_ref_at(ref)->next)
+    {
+        results[n_results++] = leaf_ref_entity(ref);
+    }
+
+    return n_results;
+}
+
+/*
+ * 32 clusters of a pvs or phs row starting at cluster word * 32. rows are
+ * byte sized and unaligned, so the last word of a row is read a byte at a
+ * time. like the rest of the bsp code this assumes little endian
+ */
+
+Uint32 row_word(unsigned char* row, int word)
+{
+    Uint32 bits;
+    int start;
+    int i;
+
+    start = word * 4;
+
+    if (start + 4 <= map.visdata->sz_vecs) {
+        memcpy(&bits, &row[start], 4);
+        return bits;
+    }
+
+    bits = 0;
+
+    for (i = 0; start + i < map.visdata->sz_vecs; ++i) {
+        bits |= (Uint32)row[start + i] << (i * 8);
+    }
+
+    return bits;
+}
+
+/*
+ * whether any of the entity's clusters is set in a pvs or phs row. a null
+ * row means everything is visible
+ */
+
+int entity_in_row(struct entity_link* link, unsigned char* row)
+{
+    int i;
+
+    if (!row || link->n_cluster_words < 0) {
+        return 1;
+    }
+
+    for (i = 0; i < link->n_cluster_words; ++i)
+    {
+        if (row_word(row, link->cluster_words[i]) & link->cluster_masks[i]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int entity_in_pvs(int entity, int cluster)
+{
+    return entity_in_row(&entity_links[entity], bsp_pvs_row(&map, cluster));
+}
+
+int entity_in_phs(int entity, int cluster)
+{
+    return entity_in_row(&entity_links[entity], bsp_phs_row(&map, cluster));
+}
+
+/*
+ * splash damage style query. finds the entities within radius of origin
+ * that aren't blocked by world geometry
+ *
+ * - collect the entities in the sphere's bounding box from the area nodes
+ * - reject the ones that aren't in any cluster potentially visible from
+ *   the origin's cluster before doing anything else with them
+ * - distance check the closest point of their bounds
+ * - trace from the origin to all the candidates in one batch and keep the
+ *   ones that nothing is in the way of
+ *
+ * the scratch buffers are kept around between queries so once they have
+ * grown, a burst of explosions doesn't hit the allocator at all
+ */
+
+int* radius_candidates;
+float* radius_ends;
+float* radius_fracs;
+
+int radius_query(float* origin, float radius, int* results,
+    int max_results)
+{
+    int i, j;
+    int cluster;
+    float mins[3], maxs[3];
+    int n_candidates;
+    int n_results;
+
+    cluster = map.leaves[bsp_find_leaf(&map, origin)].cluster;
+
+    for (i = 0; i < 3; ++i) {
+        mins[i] = origin[i] - radius;
+        maxs[i] = origin[i] + radius;
+    }
+
+    vec_clear(radius_candidates);
+    vec_reserve(radius_candidates, vec_len(entity_links));
+    n_candidates = entities_in_box(mins, maxs, radius_candidates,
+        vec_len(entity_links));
+
+    vec_clear(radius_ends);
+    vec_reserve(radius_ends, n_candidates * 3);
+    vec_clear(radius_fracs);
+    vec_reserve(radius_fracs, n_candidates);
+
+    for (i = 0, j = 0; i < n_candidates; ++i)
+    {
+        struct entity_link* link;
+        float delta[3];
+        int k;
+
+        link = &entity_links[radius_candidates[i]];
+
+        if (!entity_in_pvs(radius_candidates[i], cluster)) {
+            continue;
+        }
+
+        for (k = 0; k < 3; ++k)
+        {
+            if (origin[k] < link->mins[k]) {
+                delta[k] = link->mins[k] - origin[k];
+            } else if (origin[k] > link->maxs[k]) {
+                delta[k] = origin[k] - link->maxs[k];
+            } else {
+                delta[k] = 0;
+            }
+        }
+
+        if (dot3(delta, delta) > radius * radius) {
+            continue;
+        }
+
+        cpy3(&radius_ends[j * 3], link->origin);
+        radius_candidates[j++] = radius_candidates[i];
+    }
+
+    n_candidates = j;
+    trace_point_batch(origin, radius_ends, n_candidates, radius_fracs);
+    frame_stats.traces[TRACE_RADIUS] += n_candidates;
+
+    n_results = 0;
+
+    for (i = 0; i < n_candidates && n_results < max_results; ++i)
+    {
+        if (radius_fracs[i] == 1) {
+            results[n_results++] = radius_candidates[i];
+        }
+    }
+
+    return n_results;
+}
+
+/*
+ * per client entity visibility for building snapshots
+ *
+ * each client's pvs row is looked up once, then every entity's clusters
+ * are tested against it. clients are independent so they are culled in
+ * parallel, one client per job index
+ *
+ * visible is a bitmask with one bit per entity link, it starts out null
+ * and grows as needed. entities that aren't linked anywhere are never
+ * visible
+ */
+
+struct client_view
+{
+    float origin[3];
+    int cluster;
+    unsigned char* visible;
+    int n_visible;
+};
+
+void cull_client_entities(void* data, int start, int end)
+{
+    struct client_view* views;
+    int i, j;
+    int n_entities;
+
+    views = (struct client_view*)data;
+    n_entities = vec_len(entity_links);
+    perf_begin(PERF_VISIBILITY);
+
+    for (i = start; i < end; ++i)
+    {
+        struct client_view* view;
+        unsigned char* row;
+
+        view = &views[i];
+        view->n_visible = 0;
+        memset(view->visible, 0, (n_entities + 7) / 8);
+
+        row = bsp_pvs_row(&map, view->cluster);
+
+        for (j = 0; j < n_entities; ++j)
+        {
+            struct entity_link* link;
+
+            link = &entity_links[j];
+
+            if (link->area_node < 0 || !entity_in_row(link, row)) {
+                continue;
+            }
+
+            view->visible[j / 8] |= 1 << (j % 8);
+            ++view->n_visible;
+        }
+    }
+
+    perf_end(PERF_VISIBILITY);
+}
+
+void cull_snapshot_entities(struct client_view* views, int n_views)
+{
+    int i;
+    int mask_size;
+    int old_tag;
+
+    mask_size = (vec_len(entity_links) + 7) / 8;
+    old_tag = mem_tag(MEM_VISIBILITY);
+
+    for (i = 0; i < n_views; ++i)
+    {
+        struct client_view* view;
+
+        view = &views[i];
+        view->cluster =
+            map.leaves[bsp_find_leaf(&map, view->origin)].cluster;
+
+        vec_grow(view->visible, mask_size);
+    }
+
+    mem_tag(old_tag);
+    prof_begin("cull_snapshot_entities");
+    parallel_for(n_views, 1, cull_client_entities, views);
+    prof_end();
+}
+
+/* reads the position and yaw a player spawning at this entity gets */
+
+void read_spawn(int spawn, float* pos, float* yaw)
+{
+    if (entity_components[spawn] & COMPONENT_ANGLES) {
+        *yaw = entity_angles[spawn * 3 + 1];
+    }
+
+    if (entity_components[spawn] & COMPONENT_ORIGIN) {
+        cpy3(pos, &entity_origins[spawn * 3]);
+    }
+
+    pos[2] += 60;
+}
+
+void init_spawn()
+{
+    int spawn;
+
+    spawn = entity_by_classname("info_player_deathmatch");
+    if (spawn < 0) {
+        return;
+    }
+
+    read_spawn(spawn, camera_pos, &camera_angle[0]);
+
+    log_print(lninfo, "[%f %f %f] %f degrees",
+        expand3(camera_pos), degrees(camera_angle[0]));
+}
+
+/*
+ * collects every face in a cluster that's visible from pos into
+ * visible_faces, each face only once. returns the number of faces
+ */
+
+int gather_visible_faces(float* pos)
+{
+    int i;
+    unsigned char* pvs;
+    int n_visible_faces;
+
+    pvs = bsp_pvs_row(&map, map.leaves[bsp_find_leaf(&map, pos)].cluster);
+
+    n_visible_faces = 0;
+    memset(visible_faces_mask, 0, (map.n_faces + 7) / 8);
+
+    for (i = 0; pvs && i < map.visdata->sz_vecs; ++i)
+    {
+        int bits;
+
+        for (bits = pvs[i]; bits; bits &= bits - 1) {
+            ++frame_stats.clusters;
+        }
+    }
+
+    for (i = 0; i < map.n_leaves; ++i)
+    {
+        int j;
+        int cluster;
+        int first_face;
+        int n_faces;
+
+        cluster = map.leaves[i].cluster;
+
+        /* outside the map or no vis data, draw everything that's inside */
+        if (cluster < 0 ||
+            (pvs && !(pvs[cluster / 8] & (1 << (cluster % 8)))))
+        {
+            continue;
+        }
+
+        first_face = map.leaves[i].leafface;
+        n_faces = map.leaves[i].n_leaffaces;
+        ++frame_stats.leaves;
+
+        for (j = first_face; j < first_face + n_faces; ++j)
+        {
+            int face_index;
+            int face_bit;
+
+            face_index = map.leaffaces[j];
+            face_bit = 1 << (face_index % 8);
+
+            if (visible_faces_mask[face_index / 8] & face_bit) {
+                continue;
+            }
+
+            visible_faces[n_visible_faces++] = face_index;
+            visible_faces_mask[face_index / 8] |= face_bit;
+        }
+    }
+
+    frame_stats.faces += n_visible_faces;
+
+    return n_visible_faces;
+}
+
+void init_map()
+{
+    unsigned start;
+    int old_tag;
+
+    start = SDL_GetTicks();
+
+    if (!map_file) {
+        return;
+    }
+
+    prof_begin("init_map");
+
+    /* the jobs might still be tessellating the old map */
+    jobs_wait();
+    arena_reset(&map_arena);
+
+    log_print(lninfo, "loading with the %s profile", load_profile);
+    old_tag = mem_tag(MEM_BSP);
+    prof_begin("bsp_load");
+
+    if (!bsp_load(&map, map_file, profile_lumps(load_profile))) {
+        exit(1);
+    }
+
+    prof_end();
+
+    log_puts("preprocessing planes");
+    mem_tag(MEM_COLLISION);
+    prof_begin("init_planes");
+    init_planes();
+    prof_end();
+
+    log_puts("building phs");
+    mem_tag(MEM_VISIBILITY);
+    prof_begin("bsp_build_phs");
+    bsp_build_phs(&map);
+    prof_end();
+
+#if !defined(DEDICATED) || defined(BENCHMARK)
+    log_puts("tessellating geometry");
+    mem_tag(MEM_PATCHES);
+    prof_begin("init_patches");
+    init_patches();
+    prof_end();
+
+    mem_tag(MEM_VISIBILITY);
+    visible_faces = (int*)
+        arena_alloc(&map_arena, sizeof(int) * map.n_faces);
+
+    visible_faces_mask = (unsigned char*)
+        arena_alloc(&map_arena, (map.n_faces + 7) / 8);
+#endif
+
+    /* the entity fields point into the lump, which lives with the map */
+    log_puts("parsing entities");
+    mem_tag(MEM_ENTITIES);
+    prof_begin("parse_entities");
+    parse_entities(map.entities, map.entities_len);
+    prof_end();
+    mem_tag(MEM_COLLISION);
+    prof_begin("init_entity_links");
+    init_entity_links();
+    prof_end();
+    mem_tag(old_tag);
+    prof_begin("init_spawn");
+    init_spawn();
+    prof_end();
+    prof_end();
+
+    log_print(lninfo, "completed in %fs, %d bytes in the map arena",
+        (SDL_GetTicks() - start) / 1000.0f, (int)arena_used(&map_arena));
+
+    mem_report(map_arena.tag_bytes);
+}
+
+#ifndef DEDICATED
+void init(int argc, char* argv[])
+{
+    parse_args(argc, argv);
+    prof_init(trace_file);
+    perf_init();
+
+    gl_init();
+
+    SDL_ShowCursor(SDL_DISABLE);
+    SDL_SetRelativeMouseMode(SDL_TRUE);
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gl_perspective(110, 0.1f, 10000.0f);
+    glMatrixMode(GL_MODELVIEW);
+
+    jobs_init(job_thread_count);
+    init_map();
+
+    /* nothing to collide with in the render profile */
+    if (!map.n_brushes) {
+        noclip = 1;
+    }
+}
+#endif
+
+void clamp_angles(float* angles, int n_angles)
+{
+    int i;
+
+    for (i = 0; i < n_angles; ++i)
+    {
+        for (; angles[i] < 0; angles[i] += 2*M_PI);
+        for (; angles[i] >= 2*M_PI; angles[i] -= 2*M_PI);
+    }
+}
+
+void trace_ground()
+{
+    float point[3];
+    struct trace_work work;
+
+    point[0] = camera_pos[0];
+    point[1] = camera_pos[1];
+    point[2] = camera_pos[2] - 0.25;
+
+    trace(&work, camera_pos, point, player_mins, player_maxs);
+    ++frame_stats.traces[TRACE_GROUND];
+
+    if (work.frac == 1 || (movement & MOVEMENT_JUMP_THIS_FRAME)) {
+        movement |= MOVEMENT_JUMPING;
+        ground_normal = 0;
+    } else {
+        movement &= ~MOVEMENT_JUMPING;
+        ground_normal = work.plane->normal;
+    }
+}
+
+void apply_jump()
+{
+    if (!(movement & MOVEMENT_JUMP)) {
+        return;
+    }
+
+    if ((movement & MOVEMENT_JUMPING) && !noclip) {
+        return;
+    }
+
+    movement |= MOVEMENT_JUMP_THIS_FRAME;
+    velocity[2] = 270;
+    movement &= ~MOVEMENT_JUMP; /* no auto bunnyhop */
+}
+
+void apply_friction()
+{
+    float speed;
+    float control;
+    float new_speed;
+
+    if (!noclip)
+    {
+        if ((movement & MOVEMENT_JUMPING) ||
+            (movement & MOVEMENT_JUMP_THIS_FRAME))
+        {
+            return;
+        }
+    }
+
+    speed = (float)SDL_sqrt(dot3(velocity, velocity));
+    if (speed < 1) {
+        velocity[0] = 0;
+        velocity[1] = 0;
+        return;
+    }
+
+    control = speed < cl_stop_speed ? cl_stop_speed : speed;
+    new_speed = speed - control * cl_movement_friction * delta_time;
+    new_speed = SDL_max(0, new_speed);
+    mul3_scalar(velocity, new_speed / speed);
+}
+
+void apply_acceleration(float* direction, float wishspeed,
+    float acceleration)
+{
+    float cur_speed;
+    float add_speed;
+    float accel_speed;
+    float amount[3];
+
+    if (!noclip && (movement & MOVEMENT_JUMPING)) {
+        wishspeed = SDL_min(cpm_wish_speed, wishspeed);
+    }
+
+    cur_speed = dot3(velocity, direction);
+    add_speed = wishspeed - cur_speed;
+
+    if (add_speed <= 0) {
+        return;
+    }
+
+    accel_speed = acceleration * delta_time * wishspeed;
+    accel_speed = SDL_min(accel_speed, add_speed);
+
+    cpy3(amount, direction);
+    mul3_scalar(amount, accel_speed);
+    add3(velocity, amount);
+}
+
+void apply_air_control(float* direction, float wishspeed)
+{
+    float zspeed;
+    float speed;
+    float dot;
+
+    if (wishdir[0] == 0 || wishspeed == 0) {
+        return;
+    }
+
+    zspeed = velocity[2];
+    velocity[2] = 0;
+    speed = mag3(velocity);
+    if (speed >= 0.0001f) {
+        div3_scalar(velocity, speed);
+    }
+    dot = dot3(velocity, direction);
+
+    if (dot > 0) {
+        /* can only change direction if we aren't trying to slow down */
+        float k;
+        float amount[3];
+
+        k = 32 * cpm_air_control_amount * dot * dot * delta_time;
+        mul3_scalar(velocity, speed);
+        cpy3(amount, direction);
+        mul3_scalar(amount, k);
+        nrm3(velocity);
+    }
+
+    mul3_scalar(velocity, speed);
+    velocity[2] = zspeed;
+}
+
+void apply_inputs()
+{
+    float direction[3];
+    float pitch_sin, pitch_cos, yaw_sin, yaw_cos;
+    float pitch_x;
+    float wishspeed;
+    float selected_acceleration;
+    float base_wishspeed;
+
+    /* camera look */
+    camera_angle[0] += 0.002f * wishlook[0];
+    camera_angle[1] += 0.002f * wishlook[1];
+    clamp_angles(camera_angle, 2);
+
+    if (noclip) {
+        pitch_sin = SDL_sinf(2*M_PI - camera_angle[1]);
+        pitch_cos = SDL_cosf(2*M_PI - camera_angle[1]);
+    } else {
+        pitch_sin = 0;
+        pitch_cos = 1;
+    }
+
+    yaw_sin = SDL_sinf(2*M_PI - camera_angle[0]);
+    yaw_cos = SDL_cosf(2*M_PI - camera_angle[0]);
+
+    /* this applies 2 rotations, pitch first then yaw */
+    pitch_x = wishdir[0] * pitch_cos + wishdir[2] * (-pitch_sin);
+    direction[0] = pitch_x * yaw_cos + wishdir[1] * (-yaw_sin);
+    direction[1] = pitch_x * yaw_sin + wishdir[1] * yaw_cos;
+    direction[2] = wishdir[0] * pitch_sin + wishdir[2] * pitch_cos;
+
+    /* movement */
+    wishspeed = (float)SDL_sqrt(dot3(direction, direction));
+    if (wishspeed >= 0.0001f) {
+        div3_scalar(direction, wishspeed);
+    }
+    wishspeed = SDL_min(wishspeed, sv_max_speed);
+
+    apply_jump();
+    apply_friction();
+
+    selected_acceleration = cl_movement_accelerate;
+    base_wishspeed = wishspeed;
+
+    /* cpm air acceleration | TODO: pull this out */
+    if (noclip || (movement & MOVEMENT_JUMPING) ||
+        (movement & MOVEMENT_JUMP_THIS_FRAME))
+    {
+        if (dot3(velocity, direction) < 0) {
+            selected_acceleration = cpm_air_stop_acceleration;
+        } else {
+            selected_acceleration = cl_movement_airaccelerate;
+        }
+
+        if (wishdir[1] != 0 && wishdir[0] == 0) {
+            wishspeed = SDL_min(wishspeed, cpm_wish_speed);
+            selected_acceleration = cpm_strafe_acceleration;
+        }
+    }
+
+    apply_acceleration(direction, wishspeed, selected_acceleration);
+    apply_air_control(direction, base_wishspeed);
+}
+
+void clip_velocity(float* in, float* normal, float* out, float overbounce)
+{
+    float backoff;
+    int i;
+
+    backoff = dot3(in, normal);
+
+    if (backoff < 0) {
+        backoff *= overbounce;
+    } else {
+        backoff /= overbounce;
+    }
+
+    for (i = 0; i < 3; ++i)
+    {
+        float change;
+
+        change = normal[i] * backoff;
+        out[i] = in[i] - change;
+    }
+}
+
+/*
+ * clip the velocity against all brushes until we stop colliding. this
+ * allows the player to slide against walls and the floor
+ */
+
+#define OVERCLIP 1.001f
+#define MAX_CLIP_PLANES 5
+
+int slide(int gravity)
+{
+    float end_velocity[3];
+    float planes[MAX_CLIP_PLANES][3];
+    int n_planes;
+    float time_left;
+    int n_bumps;
+    float end[3];
+
+    n_planes = 0;
+    time_left = delta_time;
+
+    if (gravity)
+    {
+        cpy3(end_velocity, velocity);
+        end_velocity[2] -= sv_gravity * delta_time;
+
+        /*
+         * not 100% sure why this is necessary, maybe to avoid tunneling
+         * through the floor when really close to it
+         */
+
+        velocity[2] = (end_velocity[2] + velocity[2]) * 0.5f;
+
+        /* slide against floor */
+        if (ground_normal) {
+            clip_velocity(velocity, ground_normal, velocity, OVERCLIP);
+        }
+    }
+
+    if (ground_normal) {
+        cpy3(planes[n_planes], ground_normal);
+        ++n_planes;
+    }
+
+    cpy3(planes[n_planes], velocity);
+    nrm3(planes[n_planes]);
+    ++n_planes;
+
+    for (n_bumps = 0; n_bumps < 4; ++n_bumps)
+    {
+        struct trace_work work;
+        int i;
+
+        /* calculate future position and attempt the move */
+        cpy3(end, velocity);
+        mul3_scalar(end, time_left);
+        add3(end, camera_pos);
+        trace(&work, camera_pos, end, player_mins, player_maxs);
+        ++frame_stats.traces[TRACE_SLIDE];
+
+        if (work.frac > 0) {
+            cpy3(camera_pos, work.endpos);
+        }
+
+        /* if nothing blocked us we are done */
+        if (work.frac == 1) {
+            break;
+        }
+
+        time_left -= time_left * work.frac;
+
+        if (n_planes >= MAX_CLIP_PLANES) {
+            clr3(velocity);
+            return 1;
+        }
+
+        /*
+         * if it's a plane we hit before, nudge velocity along it
+         * to prevent epsilon issues and dont re-test it
+         */
+
+        for (i = 0; i < n_planes; ++i)
+        {
+            if (dot3(work.plane->normal, planes[i]) > 0.99) {
+                add3(velocity, work.plane->normal);
+                break;
+            }
+        }
+
+        if (i < n_planes) {
+            continue;
+        }
+
+        /*
+         * entirely new plane, add it and clip velocity against all
+         * planes that the move interacts with
+         */
+
+        cpy3(planes[n_planes], work.plane->normal);
+        ++n_planes;
+
+        for (i = 0; i < n_planes; ++i)
+        {
+            float clipped[3];
+            float end_clipped[3];
+            int j;
+
+            if (dot3(velocity, planes[i]) >= 0.1) {
+                continue;
+            }
+
+            clip_velocity(velocity, planes[i], clipped, OVERCLIP);
+            clip_velocity(end_velocity, planes[i], end_clipped, OVERCLIP);
+
+            /*
+             * if the clipped move still hits another plane, slide along
+             * the line where the two planes meet (cross product) with the
+             * un-clipped velocity
+             *
+             * TODO: reduce nesting in here
+             */
+
+            for (j = 0; j < n_planes; ++j)
+            {
+                int k;
+                float dir[3];
+                float speed;
+
+                if (j == i) {
+                    continue;
+                }
 
-    struct bsp_brushside* brushsides;
-    int n_brushsides;
+                if (dot3(clipped, planes[j]) >= 0.1) {
+                    continue;
+                }
 
-    struct bsp_vertex* vertices;
-    int n_vertices;
+                clip_velocity(clipped, planes[j], clipped, OVERCLIP);
+                clip_velocity(end_clipped, planes[j], end_clipped,
+                    OVERCLIP);
 
-    int* meshverts;
-    int n_meshverts;
+                if (dot3(clipped, planes[i]) >= 0) {
+                    /* goes back into the first plane */
+                    continue;
+                }
 
-    struct bsp_effect* effects;
-    int n_effects;
+                cross3(planes[i], planes[j], dir);
+                nrm3(dir);
 
-    struct bsp_face* faces;
-    int n_faces;
+                speed = dot3(dir, velocity);
+                cpy3(clipped, dir);
+                mul3_scalar(clipped, speed);
 
-    struct bsp_lightmap* lightmaps;
-    int n_lightmaps;
+                speed = dot3(dir, end_velocity);
+                cpy3(end_clipped, dir);
+                mul3_scalar(end_clipped, speed);
 
-    struct bsp_lightvol* lightvols;
-    int n_lightvols;
+                /* if we still hit a plane, just give up and dead stop */
 
-    struct bsp_visdata* visdata;
-    unsigned char* visdata_vecs;
-};
+                for (k = 0; k < n_planes; ++k)
+                {
+                    if (k == j || k == i) {
+                        continue;
+                    }
 
-int bsp_load(struct bsp_file* file, char* path)
-{
-    char* p;
-    struct bsp_dirent* dirents;
+                    if (dot3(clipped, planes[k]) >= 0.1) {
+                        continue;
+                    }
 
-    log_puts(path);
+                    clr3(velocity);
+                    return 1;
+                }
+            }
 
-    p = read_entire_file(path);
-    if (!p) {
-        return 0;
+            /* resolved all collisions for this move */
+            cpy3(velocity, clipped);
+            cpy3(end_velocity, end_clipped);
+            break;
+        }
     }
 
-    if (vec_len(p) < (int)sizeof(struct bsp_header)) {
-        log_puts("E: file is too small, truncated header data");
-        return 0;
+    if (gravity) {
+        cpy3(velocity, end_velocity);
     }
 
-    file->raw_data = p;
-    file->header = (struct bsp_header*)p;
-
-    dirents = file->header->dirents;
-    file->entities = p + dirents[0].offset;
-    file->entities_len = dirents[0].length;
+    return n_bumps != 0;
+}
 
-#define lump(i, name, type) \
-    file->name = (type*)(p + dirents[i].offset); \
-    file->n_##name = dirents[i].length / sizeof(type); \
+void update_physics()
+{
+    float amount[3];
 
-    lump(1, textures, struct bsp_texture)
-    lump(2, planes, struct bsp_plane)
-    lump(3, nodes, struct bsp_node)
-    lump(4, leaves, struct bsp_leaf)
-    lump(5, leaffaces, int)
-    lump(6, leafbrushes, int)
-    lump(7, models, struct bsp_model)
-    lump(8, brushes, struct bsp_brush)
-    lump(9, brushsides, struct bsp_brushside)
-    lump(10, vertices, struct bsp_vertex)
-    lump(11, meshverts, int)
-    lump(12, effects, struct bsp_effect)
-    lump(13, faces, struct bsp_face)
-    lump(14, lightmaps, struct bsp_lightmap)
-    lump(15, lightvols, struct bsp_lightvol)
+    prof_begin("update_physics");
+    perf_begin(PERF_TRACE);
+    prof_begin("trace_ground");
+    trace_ground();
+    prof_end();
+    apply_inputs();
 
-#undef lump
+    if (!noclip) {
+        prof_begin("slide");
+        slide((movement & MOVEMENT_JUMPING) != 0);
+        prof_end();
+    }
 
-    file->visdata = (struct bsp_visdata*)(p + dirents[16].offset);
-    file->visdata_vecs = (unsigned char*)&file->visdata[1];
+    else
+    {
+        cpy3(amount, velocity);
+        mul3_scalar(amount, delta_time);
+        add3(camera_pos, amount);
+    }
 
-    return 1;
+    movement &= ~MOVEMENT_JUMP_THIS_FRAME;
+    perf_end(PERF_TRACE);
+    prof_end();
 }
 
+/* --------------------------------------------------------------------- */
+
 /*
- * the plane dist is the distance from the origin along the normal so if
- * we project the camera position onto the normal with the dot product and
- * subtract dist, we get the distance between the camera position and the
- * plane
+ * snapshot encoding
  *
- * note that leaf indices are negative, and that's how we tell we hit a
- * leaf while navigating the bsp tree
+ * every field is quantized to a fixed number of bits and snapshots are
+ * delta compressed against the last snapshot the client acknowledged:
  *
- * since 0 is taken by positive indices, leaf index -1 maps to leaf 0,
- * -2 to 1, and so on
+ * - each field gets a changed bit. changed fields are sent as a small
+ *   delta when it fits in DELTA_BITS, otherwise as the full value
+ * - entities are sorted by number and merged with the old snapshot's
+ *   entities. unchanged entities cost nothing, changed ones are sent as a
+ *   delta, new ones are sent as a delta from their baseline and ones
+ *   that went away are sent as a removal
+ * - entity numbers are sent as the gap from the previous number, a gap of
+ *   zero ends the list
+ *
+ * the quantized values are what gets stored in the frames on both ends so
+ * rounding never accumulates. the bit writer and reader work directly on
+ * the caller's buffers, which in the server are the loopback slots
  */
 
-int bsp_find_leaf(struct bsp_file* file, float* camera_pos)
+#define SNAPSHOT_BACKUP 32 /* must be a power of two */
+#define POS_BITS 21 /* 1/8 unit, +-131072 units */
+#define POS_SCALE 8
+#define ANGLE_BITS 16
+#define VELOCITY_BITS 16 /* 1/2 unit per second */
+#define VELOCITY_SCALE 2
+#define MOVEMENT_BITS 4
+#define DELTA_BITS 8
+#define ENTITY_BITS 16 /* minimum, widened at map load if needed */
+#define GAP_BITS 4
+
+/* bits for an entity number, set by sv_init from the entity count */
+int entity_bits = ENTITY_BITS;
+
+struct bit_writer
 {
-    int index;
+    unsigned char* data;
+    int size;
+    int bit;
+    int overflow;
+};
 
-    index = 0;
+struct bit_reader
+{
+    unsigned char* data;
+    int size;
+    int bit;
+    int overflow;
+};
 
-    while (index >= 0)
-    {
-        float distance;
-        struct bsp_node* node;
-        struct bsp_plane* plane;
+void bits_write(struct bit_writer* w, unsigned value, int n_bits)
+{
+    int i;
 
-        node = &file->nodes[index];
-        plane = &file->planes[node->plane];
+    if (w->bit + n_bits > w->size * 8) {
+        w->overflow = 1;
+        return;
+    }
 
-        distance = dot3(camera_pos, plane->normal) - plane->dist;
+    for (i = 0; i < n_bits; )
+    {
+        int byte;
+        int shift;
+        int n;
 
-        if (distance >= 0) {
-            index = node->child[0];
-        } else {
-            index = node->child[1];
+        byte = w->bit / 8;
+        shift = w->bit % 8;
+        n = SDL_min(8 - shift, n_bits - i);
+
+        if (!shift) {
+            w->data[byte] = 0;
         }
-    }
 
-    return (-index) - 1;
+        w->data[byte] |= ((value >> i) & ((1 << n) - 1)) << shift;
+        w->bit += n;
+        i += n;
+    }
 }
 
-/*
- * the visdata vecs are huge bitmasks. each bit is one y step and each
- * sz_vecs bytes is one x step
- *
- * cluster x is visible from cluster y if the y-th bit in the x-th bitmask
- * is set. it's basically a visibility matrix with every possible
- * combination of clusters packed as bitmask
- */
+unsigned bits_read(struct bit_reader* r, int n_bits)
+{
+    unsigned value;
+    int i;
 
-int bsp_cluster_visible(struct bsp_file* file, int from, int target)
+    if (r->bit + n_bits > r->size * 8) {
+        r->overflow = 1;
+        return 0;
+    }
+
+    value = 0;
+
+    for (i = 0; i < n_bits; )
+    {
+        int shift;
+        int n;
+
+        shift = r->bit % 8;
+        n = SDL_min(8 - shift, n_bits - i);
+        value |= (unsigned)((r->data[r->bit / 8] >> shift) & ((1 << n) - 1))
+            << i;
+
+        r->bit += n;
+        i += n;
+    }
+
+    return value;
+}
+
+int sign_extend(unsigned value, int n_bits)
 {
-    int index;
+    if (n_bits < 32 && (value & (1U << (n_bits - 1)))) {
+        value |= ~0U << n_bits;
+    }
 
-    index = from * file->visdata->sz_vecs + target / 8;
-    return (file->visdata_vecs[index] & (1 << (target % 8))) != 0;
+    return (int)value;
 }
 
-/* --------------------------------------------------------------------- */
+int quantize(float value, float scale)
+{
+    return (int)SDL_floor(value * scale + 0.5f);
+}
 
-/*
- * tiny lexer for the quake 3 entity syntax
- *
- * {
- * "key1" "value1"
- * "key2" "value2"
- * }
- * {
- * "key1" "value1"
- * "key2" "value2"
- * }
- * ...
- */
+struct player_state
+{
+    int camera_pos[3];
+    int camera_angle[2];
+    int velocity[3];
+    int movement;
+};
 
-enum entities_token
+struct entity_state
 {
-    ENTITIES_LAST_LITERAL_TOKEN = 255,
-    ENTITIES_STRING,
-    ENTITIES_LAST_TOKEN
+    int number;
+    int origin[3];
 };
 
-void describe_entities_token(char* dst, int dst_size, int kind)
+struct snapshot_frame
 {
-    switch (kind)
-    {
-    case ENTITIES_STRING:
-        SDL_snprintf(dst, dst_size, "%s", "string");
-        break;
+    int sequence; /* 0 if the slot is empty */
+    struct player_state player;
+    struct entity_state* entities;
+};
 
-    default:
-        if (kind >= 0 && kind <= ENTITIES_LAST_LITERAL_TOKEN) {
-            SDL_snprintf(dst, dst_size, "'%c'", (char)kind);
-        } else {
-            SDL_snprintf(dst, dst_size, "unknown (%d)", kind);
-        }
-    }
-}
+/* negative bits means the field is signed */
 
-struct entities_lexer
+struct net_field
 {
-    char* p;
-    int token_kind;
-    char* str;
-    int n_lines;
+    int offset;
+    int bits;
 };
 
-int lex_entities(struct entities_lexer* lex)
-{
-again:
-    switch (*lex->p)
-    {
-    case '\n':
-        ++lex->n_lines;
-    case '\t':
-    case '\v':
-    case '\f':
-    case '\r':
-    case ' ':
-        ++lex->p;
-        goto again;
+#define player_net_field(x, i, bits) \
+    { offsetof(struct player_state, x) + (i) * sizeof(int), bits }
+
+#define entity_net_field(x, i, bits) \
+    { offsetof(struct entity_state, x) + (i) * sizeof(int), bits }
+
+struct net_field player_fields[] = {
+    player_net_field(camera_pos, 0, -POS_BITS),
+    player_net_field(camera_pos, 1, -POS_BITS),
+    player_net_field(camera_pos, 2, -POS_BITS),
+    player_net_field(camera_angle, 0, ANGLE_BITS),
+    player_net_field(camera_angle, 1, ANGLE_BITS),
+    player_net_field(velocity, 0, -VELOCITY_BITS),
+    player_net_field(velocity, 1, -VELOCITY_BITS),
+    player_net_field(velocity, 2, -VELOCITY_BITS),
+    player_net_field(movement, 0, MOVEMENT_BITS)
+};
 
-    case '"':
-        lex->token_kind = ENTITIES_STRING;
-        ++lex->p;
-        lex->str = lex->p;
+struct net_field entity_fields[] = {
+    entity_net_field(origin, 0, -POS_BITS),
+    entity_net_field(origin, 1, -POS_BITS),
+    entity_net_field(origin, 2, -POS_BITS)
+};
 
-        for (; *lex->p != '"'; ++lex->p)
-        {
-            if (!*lex->p)
-            {
-                log_print(lninfo,
-                    "W: unterminated string \"%s\" at line %d",
-                    lex->str, lex->n_lines);
-                break;
-            }
-        }
+#define n_fields(fields) (int)(sizeof(fields) / sizeof(fields[0]))
+#define field_at(base, field) \
+    (*(int*)((char*)(base) + (field)->offset))
 
-        if (*lex->p) {
-            *lex->p++ = 0;
-        }
-        break;
+void quantize_player(struct player_state* state, float* pos,
+    float* angle, float* vel, int movement_bits)
+{
+    int i;
 
-    default:
-        lex->token_kind = (int)*lex->p;
-        ++lex->p;
+    for (i = 0; i < 3; ++i)
+    {
+        state->camera_pos[i] = quantize(pos[i], POS_SCALE);
+        state->velocity[i] = quantize(vel[i], VELOCITY_SCALE);
     }
 
-    return lex->token_kind;
-}
+    for (i = 0; i < 2; ++i)
+    {
+        state->camera_angle[i] =
+            quantize(angle[i], (1 << ANGLE_BITS) / (2 * M_PI)) &
+            ((1 << ANGLE_BITS) - 1);
+    }
 
-/* --------------------------------------------------------------------- */
+    state->movement = movement_bits & ((1 << MOVEMENT_BITS) - 1);
+}
 
-struct entity_field
+void quantize_entity(struct entity_state* state, int number,
+    float* origin)
 {
-    char* key;
-    char* value;
-};
+    int i;
 
-struct entity_field** entities;
+    state->number = number;
+
+    for (i = 0; i < 3; ++i) {
+        state->origin[i] = quantize(origin[i], POS_SCALE);
+    }
+}
 
-char* entity_get(struct entity_field* entity, char* key)
+void write_delta_fields(struct bit_writer* w, struct net_field* fields,
+    int n, void* from, void* to)
 {
     int i;
 
-    for (i = 0; i < vec_len(entity); ++i)
+    for (i = 0; i < n; ++i)
     {
-        if (!strcmp(entity[i].key, key)) {
-            return entity[i].value;
+        struct net_field* field;
+        int old_value, value, delta;
+
+        field = &fields[i];
+        old_value = field_at(from, field);
+        value = field_at(to, field);
+
+        if (value == old_value) {
+            bits_write(w, 0, 1);
+            continue;
         }
-    }
 
-    return 0;
+        bits_write(w, 1, 1);
+        delta = value - old_value;
+
+        if (delta >= -(1 << (DELTA_BITS - 1)) &&
+            delta < (1 << (DELTA_BITS - 1)))
+        {
+            bits_write(w, 1, 1);
+            bits_write(w, (unsigned)delta, DELTA_BITS);
+        }
+
+        else
+        {
+            bits_write(w, 0, 1);
+            bits_write(w, (unsigned)value, SDL_abs(field->bits));
+        }
+    }
 }
 
-struct entity_field* entity_by_classname(char* classname)
+void read_delta_fields(struct bit_reader* r, struct net_field* fields,
+    int n, void* from, void* to)
 {
     int i;
 
-    for (i = 0; i < vec_len(entities); ++i)
+    for (i = 0; i < n; ++i)
     {
-        char* cur_classname;
+        struct net_field* field;
+        int value;
 
-        cur_classname = entity_get(entities[i], "classname");
+        field = &fields[i];
+        value = field_at(from, field);
 
-        if (cur_classname && !strcmp(cur_classname, classname)) {
-            return entities[i];
+        if (bits_read(r, 1))
+        {
+            if (bits_read(r, 1)) {
+                value += sign_extend(bits_read(r, DELTA_BITS), DELTA_BITS);
+            } else if (field->bits < 0) {
+                value = sign_extend(bits_read(r, -field->bits),
+                    -field->bits);
+            } else {
+                value = (int)bits_read(r, field->bits);
+            }
         }
-    }
 
-    return 0;
+        field_at(to, field) = value;
+    }
 }
 
-int entities_expect(struct entities_lexer* lex, int kind)
+void write_entity_number(struct bit_writer* w, int gap)
 {
-    if (lex->token_kind != kind)
-    {
-        char got[64];
-        char exp[64];
-
-        describe_entities_token(got, sizeof(got), lex->token_kind);
-        describe_entities_token(exp, sizeof(exp), kind);
-
-        log_print(lninfo, "W: got %s, expected %s at line %d",
-            got, exp, lex->n_lines);
-
-        return 0;
+    if (gap >= (1 << entity_bits)) {
+        /* would be truncated, fail the whole snapshot instead */
+        w->overflow = 1;
+    } else if (gap < (1 << GAP_BITS)) {
+        bits_write(w, 1, 1);
+        bits_write(w, gap, GAP_BITS);
+    } else {
+        bits_write(w, 0, 1);
+        bits_write(w, gap, entity_bits);
     }
+}
 
-    lex_entities(lex);
+int read_entity_number(struct bit_reader* r)
+{
+    if (bits_read(r, 1)) {
+        return bits_read(r, GAP_BITS);
+    }
 
-    return 1;
+    return bits_read(r, entity_bits);
 }
 
-void parse_entities(char* data)
+/*
+ * encodes to as a delta from the frame the client acknowledged, or from
+ * nothing and the entity baselines if from is null. returns the number
+ * of bytes written or -1 if buf is too small or an entity number doesn't
+ * fit in entity_bits
+ */
+
+int snapshot_encode(struct snapshot_frame* to, struct snapshot_frame* from,
+    struct entity_state* baselines, unsigned char* buf, int size)
 {
-    int i;
-    struct entities_lexer lex;
+    struct bit_writer w;
+    struct player_state null_player;
+    struct entity_state* old_entities;
+    int n_old, n_new;
+    int i, j;
+    int last;
 
-    for (i = 0; i < vec_len(entities); ++i) {
-        vec_free(entities[i]);
-    }
+    w.data = buf;
+    w.size = size;
+    w.bit = 0;
+    w.overflow = 0;
 
-    vec_clear(entities);
+    memset(&null_player, 0, sizeof(null_player));
+    old_entities = from ? from->entities : 0;
+    n_old = vec_len(old_entities);
+    n_new = vec_len(to->entities);
 
-    memset(&lex, 0, sizeof(lex));
-    lex.p = data;
-    lex_entities(&lex);
+    bits_write(&w, (unsigned)to->sequence, 32);
+    bits_write(&w, from ? to->sequence - from->sequence : 0, 8);
 
-    do
+    write_delta_fields(&w, player_fields, n_fields(player_fields),
+        from ? &from->player : &null_player, &to->player);
+
+    last = -1;
+
+    for (i = 0, j = 0; i < n_old || j < n_new; )
     {
-        struct entity_field* fields = 0;
+        int old_number, new_number;
+        struct entity_state* ent;
 
-        if (!entities_expect(&lex, '{')) {
-            return;
-        }
+        old_number = i < n_old ? old_entities[i].number : 0x7fffffff;
+        new_number = j < n_new ? to->entities[j].number : 0x7fffffff;
 
-        while (lex.token_kind == ENTITIES_STRING)
+        if (old_number == new_number)
         {
-            struct entity_field field;
+            ent = &to->entities[j];
 
-            field.key = lex.str;
-            lex_entities(&lex);
+            if (memcmp(ent, &old_entities[i], sizeof(*ent)))
+            {
+                write_entity_number(&w, new_number - last);
+                bits_write(&w, 0, 1);
+                write_delta_fields(&w, entity_fields,
+                    n_fields(entity_fields), &old_entities[i], ent);
 
-            if (lex.token_kind != ENTITIES_STRING) {
-                return;
+                last = new_number;
             }
 
-            field.value = lex.str;
-            vec_append(fields, field);
-
-            lex_entities(&lex);
+            ++i, ++j;
         }
 
-        vec_append(entities, fields);
+        else if (new_number < old_number)
+        {
+            ent = &to->entities[j];
+            write_entity_number(&w, new_number - last);
+            bits_write(&w, 0, 1);
+            write_delta_fields(&w, entity_fields, n_fields(entity_fields),
+                &baselines[new_number], ent);
+
+            last = new_number;
+            ++j;
+        }
 
-        if (!entities_expect(&lex, '}')) {
-            return;
+        else
+        {
+            write_entity_number(&w, old_number - last);
+            bits_write(&w, 1, 1);
+            last = old_number;
+            ++i;
         }
     }
-    while (lex.token_kind);
-}
 
-/* --------------------------------------------------------------------- */
+    write_entity_number(&w, 0);
+
+    return w.overflow ? -1 : (w.bit + 7) / 8;
+}
 
 /*
- * quake3 uses a different coordinate system, so we use quake's matrix
- * as identity, where x, y, z are forward, left and up
+ * decodes a snapshot into frames[sequence % SNAPSHOT_BACKUP] and returns
+ * the sequence, or -1 if it's corrupt or deltas from a frame we no longer
+ * have
  */
 
-float quake_matrix[] = {
-    0, 0, -1, 0,
-    -1, 0, 0, 0,
-    0, 1, 0, 0,
-    0, 0, 0, 1
-};
-
-char* argv0;
-int running = 1;
-float delta_time;
-
-struct patch
+int snapshot_decode(unsigned char* buf, int len,
+    struct snapshot_frame* frames, struct entity_state* baselines)
 {
-    int n_vertices;
-    struct bsp_vertex* vertices;
-    int n_indices;
-    int* indices;
-    int n_rows;
-    int triangles_per_row;
-};
-
-char* map_file;
-struct bsp_file map;
-int* visible_faces;
-unsigned char* visible_faces_mask;
-struct patch** patches;
+    struct bit_reader r;
+    struct player_state null_player;
+    struct snapshot_frame* from;
+    struct snapshot_frame* to;
+    struct entity_state* old_entities;
+    int sequence;
+    int delta;
+    int n_old;
+    int i;
+    int number;
 
-enum plane_type
-{
-    PLANE_X,
-    PLANE_Y,
-    PLANE_Z,
-    PLANE_NONAXIAL,
-    LAST_PLANE_TYPE
-};
+    r.data = buf;
+    r.size = len;
+    r.bit = 0;
+    r.overflow = 0;
 
-struct plane
-{
-    int signbits;
-    int type;
-};
+    sequence = (int)bits_read(&r, 32);
+    delta = (int)bits_read(&r, 8);
 
-struct plane* planes;
+    if (r.overflow || sequence <= 0 || delta >= SNAPSHOT_BACKUP) {
+        return -1;
+    }
 
-int tessellation_level;
-float camera_pos[3];
-float camera_angle[2]; /* yaw, pitch */
-float velocity[3];
-int noclip;
+    from = 0;
 
-int movement;
-float wishdir[3]; /* movement inputs in local player space, not unit */
-int wishlook[2]; /* look inputs in screen space, not unit */
-float* ground_normal;
+    if (delta)
+    {
+        from = &frames[(sequence - delta) & (SNAPSHOT_BACKUP - 1)];
 
-enum movement_bits
-{
-    MOVEMENT_JUMP = 1<<1,
-    MOVEMENT_JUMP_THIS_FRAME = 1<<2,
-    MOVEMENT_JUMPING = 1<<3,
-    LAST_MOVEMENT_BIT
-};
+        if (from->sequence != sequence - delta) {
+            return -1;
+        }
+    }
 
-float player_mins[] = { -15, -15, -24 };
-float player_maxs[] = { 15, 15, 32 };
+    memset(&null_player, 0, sizeof(null_player));
+    to = &frames[sequence & (SNAPSHOT_BACKUP - 1)];
+    to->sequence = 0;
+    vec_clear(to->entities);
 
-float cl_forwardspeed = 400;
-float cl_sidespeed = 350;
-float cl_movement_accelerate = 15;
-float cl_movement_airaccelerate = 7;
-float cl_movement_friction = 8;
-float sv_gravity = 800;
-float sv_max_speed = 320;
-float cl_stop_speed = 200;
-float cpm_air_stop_acceleration = 2.5f;
-float cpm_air_control_amount = 150;
-float cpm_strafe_acceleration = 70;
-float cpm_wish_speed = 30;
+    read_delta_fields(&r, player_fields, n_fields(player_fields),
+        from ? &from->player : &null_player, &to->player);
 
-void print_usage()
-{
-    SDL_Log(
-        "usage: %s [options] /path/to/file.bsp\n"
-        "\n"
-        "available options:\n"
-        "    -window: window mode | default: off | example: -window\n"
-        "    -d: main display index | default: 0 | example: -d 0\n"
-        "    -t: tessellation level | default: 5 | example: -t 10\n"
-        "    -w: window width | default: 1280 | example: -w 800\n"
-        "    -h: window height | default: 720 | example: -h 600\n",
-        argv0
-    );
-}
+    old_entities = from ? from->entities : 0;
+    n_old = vec_len(old_entities);
+    i = 0;
+    number = -1;
 
-void parse_args(int argc, char* argv[])
-{
-    argv0 = argv[0];
+    while (!r.overflow)
+    {
+        int gap;
+        struct entity_state* ent;
 
-    ++argv, --argc;
+        gap = read_entity_number(&r);
 
-    for (; argc > 0; ++argv, --argc)
-    {
-        if (!strcmp(argv[0], "-window")) {
-            gl_window_mode = 1;
+        if (!gap) {
+            break;
         }
 
-        else if (!strcmp(argv[0], "-d") && argc >= 2) {
-            gl_display = SDL_atoi(argv[1]);
-            ++argv, --argc;
-        }
+        number += gap;
 
-        else if (!strcmp(argv[0], "-t") && argc >= 2) {
-            tessellation_level = SDL_atoi(argv[1]);
-            ++argv, --argc;
+        if (number >= vec_len(baselines)) {
+            return -1;
         }
 
-        else if (!strcmp(argv[0], "-w") && argc >= 2) {
-            gl_width = SDL_atoi(argv[1]);
-            ++argv, --argc;
+        /* everything before this is unchanged */
+        for (; i < n_old && old_entities[i].number < number; ++i) {
+            vec_append(to->entities, old_entities[i]);
         }
 
-        else if (!strcmp(argv[0], "-h") && argc >= 2) {
-            gl_height = SDL_atoi(argv[1]);
-            ++argv, --argc;
-        }
+        if (bits_read(&r, 1))
+        {
+            if (i < n_old && old_entities[i].number == number) {
+                ++i;
+            }
 
-        else {
-            break;
+            continue;
         }
-    }
 
-    if (argc >= 1) {
-        map_file = argv[0];
-    } else {
-        print_usage();
-        exit(1);
-    }
+        ent = vec_append_p(to->entities);
 
-    if (tessellation_level <= 0) {
-        tessellation_level = 5;
+        if (i < n_old && old_entities[i].number == number) {
+            read_delta_fields(&r, entity_fields, n_fields(entity_fields),
+                &old_entities[i++], ent);
+        } else {
+            read_delta_fields(&r, entity_fields, n_fields(entity_fields),
+                &baselines[number], ent);
+        }
+
+        ent->number = number;
     }
 
-    if (gl_width <= 0) {
-        gl_width = 1280;
+    for (; i < n_old; ++i) {
+        vec_append(to->entities, old_entities[i]);
     }
 
-    if (gl_height <= 0) {
-        gl_height = 720;
+    if (r.overflow) {
+        return -1;
     }
-}
 
-void update_fps()
-{
-    static float one_second = 1;
-    static int ticks_per_second = 0;
+    to->sequence = sequence;
 
-    one_second -= delta_time;
+    return sequence;
+}
 
-    while (one_second <= 0)
-    {
-        log_dump("d", ticks_per_second);
-        log_dump("f", mag3(velocity));
-        one_second = 1;
-        ticks_per_second = 0;
-    }
+#if defined(BENCHMARK)
 
-    ++ticks_per_second;
-}
+/* --------------------------------------------------------------------- */
 
 /*
- * this is slow but it makes code look nicer and we only use it on init
- * anyway so it's not a real performance hit
+ * microbenchmarks, see build_bench. every map on the command line is
+ * loaded in full and each benchmark runs over the same seeded samples,
+ * which are the centers of random leaves that belong to a cluster. so as
+ * long as the map and the options are the same, runs can be compared
+ * across commits
+ *
+ * each benchmark runs once to warm up and then bench_repeats times, and
+ * the median and best time per op are kept. the results are printed to
+ * stdout as json with one benchmark per line, the log goes to stderr
  */
 
-struct bsp_vertex mul_vertex(struct bsp_vertex* vertex, float scalar)
-{
-    struct bsp_vertex res;
+#include <stdio.h>
 
-    res = *vertex;
-    mul3_scalar(res.position, scalar);
-    mul2_scalar(res.texcoord[0], scalar);
-    mul2_scalar(res.texcoord[1], scalar);
-    mul3_scalar(res.normal, scalar);
+float* bench_points;
+float* bench_ends;
+float* bench_velocities;
+int* bench_clusters; /* cluster of each point and of each end */
+int* bench_patches; /* source patches, the rest share their geometry */
+char* bench_entities; /* untouched copy of the lump, parsing is in place */
+char* bench_json;
+volatile float bench_sink;
 
-    return res;
-}
+/* appends to a char vec */
 
-struct bsp_vertex add_vertices(struct bsp_vertex a, struct bsp_vertex b)
+void vec_printf(char** str, char* fmt, ...)
 {
-    add3(a.position, b.position);
-    add2(a.texcoord[0], b.texcoord[0]);
-    add2(a.texcoord[1], b.texcoord[1]);
-    add3(a.normal, b.normal);
-
-    return a;
-}
+    va_list va;
+    int len;
 
-#define add_vertices3(a, b, c) add_vertices(add_vertices(a, b), c)
+    va_start(va, fmt);
+    len = SDL_vsnprintf(0, 0, fmt, va);
+    va_end(va);
 
-void tessellate(struct patch* patch, struct bsp_vertex* controls,
-    int level)
-{
-    int i, j;
-    int l1;
-    struct bsp_vertex* vertices;
-    int* indices;
+    va_start(va, fmt);
+    SDL_vsnprintf(vec_reserve(*str, len + 1), len + 1, fmt, va);
+    va_end(va);
 
-    l1 = level + 1;
+    vec_hdr(*str)->n += len;
+}
 
-    patch->n_vertices = l1 * l1;
-    patch->vertices = (struct bsp_vertex*)
-        SDL_malloc(sizeof(struct bsp_vertex) * patch->n_vertices);
-    vertices = patch->vertices;
+void bench_string(char* str)
+{
+    vec_append(bench_json, '"');
 
-    for (i = 0; i <= level; ++i)
+    for (; *str; ++str)
     {
-        float a, b;
-
-        a = (float)i / level;
-        b = 1 - a;
+        if (*str == '"' || *str == '\\') {
+            vec_append(bench_json, '\\');
+        }
 
-        vertices[i] = add_vertices3(
-            mul_vertex(&controls[0], b * b),
-            mul_vertex(&controls[3], 2 * b * a),
-            mul_vertex(&controls[6], a * a));
+        vec_append(bench_json, *str);
     }
 
-    for (i = 1; i <= level; ++i)
-    {
-        float a, b;
-        struct bsp_vertex sum[3];
-
-        a = (float)i / level;
-        b = 1 - a;
-
-        for (j = 0; j < 3; ++j)
-        {
-            sum[j] = add_vertices3(
-                mul_vertex(&controls[3 * j + 0], b * b),
-                mul_vertex(&controls[3 * j + 1], 2 * b * a),
-                mul_vertex(&controls[3 * j + 2], a * a));
-        }
+    vec_append(bench_json, '"');
+}
 
-        for (j = 0; j <= level; ++j)
-        {
-            float c, d;
+void bench_find_leaf(void* data, int start, int end)
+{
+    int i;
 
-            c = (float)j / level;
-            d = 1 - c;
+    (void)data;
 
-            vertices[i * l1 + j] = add_vertices3(
-                mul_vertex(&sum[0], d * d),
-                mul_vertex(&sum[1], 2 * c * d),
-                mul_vertex(&sum[2], c * c));
-        }
+    for (i = start; i < end; ++i) {
+        bench_sink += bsp_find_leaf(&map, &bench_points[i * 3]);
     }
+}
+
+void bench_cluster_visible(void* data, int start, int end)
+{
+    int i;
 
-    patch->indices = SDL_malloc(sizeof(int) * level * l1 * 2);
-    indices = patch->indices;
+    (void)data;
 
-    for (i = 0; i < level; ++i)
+    for (i = start; i < end; ++i)
     {
-        for (j = 0; j <= level; ++j)
-        {
-            indices[(i * l1 + j) * 2 + 1] = i * l1 + j;
-            indices[(i * l1 + j) * 2] = (i + 1) * l1 + j;
-        }
+        bench_sink += bsp_cluster_visible(&map, bench_clusters[i * 2],
+            bench_clusters[i * 2 + 1]);
     }
+}
+
+void bench_trace_point(void* data, int start, int end)
+{
+    struct trace_work work;
+    int i;
+
+    (void)data;
 
-    patch->triangles_per_row = 2 * l1;
-    patch->n_rows = level;
+    for (i = start; i < end; ++i) {
+        trace_point(&work, &bench_points[i * 3], &bench_ends[i * 3]);
+        bench_sink += work.frac;
+    }
 }
 
-void tessellate_face(int face_index)
+void bench_trace_box(void* data, int start, int end)
 {
-    struct bsp_face* face;
-    int width, height;
-    int x, y, row, col;
+    struct trace_work work;
+    int i;
 
-    face = &map.faces[face_index];
+    (void)data;
 
-    if (face->type != BSP_PATCH) {
-        return;
+    for (i = start; i < end; ++i)
+    {
+        trace(&work, &bench_points[i * 3], &bench_ends[i * 3],
+            player_mins, player_maxs);
+        bench_sink += work.frac;
     }
+}
 
-    /* theres' multiple sets of bezier control points per face */
-    width = (face->size[0] - 1) / 2;
-    height = (face->size[1] - 1) / 2;
+void bench_slide(void* data, int start, int end)
+{
+    int i;
 
-    patches[face_index] =
-        SDL_malloc(width * height * sizeof(patches[0][0]));
+    (void)data;
 
-    /* TODO: there's way too much nesting in here, improve it */
-    for (y = 0; y < height; ++y)
+    for (i = start; i < end; ++i)
     {
-        for (x = 0; x < width; ++x)
-        {
-            struct patch* patch;
-            struct bsp_vertex controls[9];
-
-            for (row = 0; row < 3; ++row)
-            {
-                for (col = 0; col < 3; ++col)
-                {
-                    int index;
+        cpy3(camera_pos, &bench_points[i * 3]);
+        cpy3(velocity, &bench_velocities[i * 3]);
+        movement = MOVEMENT_JUMPING;
+        ground_normal = 0;
+        bench_sink += slide(1);
+    }
+}
 
-                    index = face->vertex +
-                        y * 2 * face->size[0] + x * 2 +
-                        row * face->size[0] + col;
+void bench_tessellate(void* data, int start, int end)
+{
+    int i;
+    int n;
 
-                    controls[row * 3 + col] = map.vertices[index];
-                }
-            }
+    (void)data;
+    n = vec_len(bench_patches);
 
-            patch = &patches[face_index][y * width + x];
-            tessellate(patch, controls, tessellation_level);
-        }
+    for (i = start; i < end; ++i) {
+        tessellate_patch(bench_patches[i % n]);
     }
 }
 
-#define SURF_CLIP_EPSILON 0.125f
+/* the copy is part of each op, it's cheap next to the parse */
 
-enum tw_flags
+void bench_parse_entities(void* data, int start, int end)
 {
-    TW_STARTS_OUT = 1<<1,
-    TW_ENDS_OUT = 1<<2,
-    TW_ALL_SOLID = 1<<3,
-    TW_LAST_FLAG
-};
+    int i;
 
-struct trace_work
-{
-    float start[3];
-    float end[3];
-    float endpos[3];
-    float frac;
-    int flags;
-    float mins[3];
-    float maxs[3];
-    float offsets[8][3];
-    struct bsp_plane* plane;
-};
+    (void)data;
 
-/*
- * - adjust plane dist to account for the bounding box
- * - if both points are in front of the plane, we're done with this brush
- * - if both points are behind the plane, we continue looping expecting
- *   other planes to clip us
- * - if we are entering the brush, clip start_frac to the distance
- *   between the starting point and the brush minus the epsilon so we don't
- *   actually touch
- * - if we are exiting the brush, clip end_frac to the distance between
- *   the starting point and the brush plus the epsilon so we don't
- *   actually touch
- * - keep collecting the maximum start_frac and minimum end_faction so
- *   we get as close as possible to touching the brush but not quite
- * - store the minimum start_frac out of all the brushes so we
- *   clip against the closest brush
- * - if the trace starts and ends inside the brush, negate the move
- *
- * (I assume this means that the brush sides are sorted from back to front)
- */
+    for (i = start; i < end; ++i) {
+        memcpy(map.entities, bench_entities, map.entities_len);
+        parse_entities(map.entities, map.entities_len);
+    }
+}
 
-void trace_brush(struct trace_work* work, struct bsp_brush* brush)
+void bench_gather_visible_faces(void* data, int start, int end)
 {
     int i;
-    float start_frac;
-    float end_frac;
-    struct bsp_plane* closest_plane;
-
-    /* TODO: do optimized check for the first 6 planes which are axial */
 
-    start_frac = -1;
-    end_frac = 1;
+    (void)data;
 
-    for (i = 0; i < brush->n_brushsides; ++i)
-    {
-        int side_index;
-        int plane_index;
-        struct bsp_plane* plane;
-        int signbits;
+    for (i = start; i < end; ++i) {
+        bench_sink += gather_visible_faces(&bench_points[i * 3]);
+    }
+}
 
-        float dist;
-        float start_distance, end_distance;
-        float frac;
+/* with -perf, the counters are averaged per op over all the timed runs */
 
-        side_index = brush->brushside + i;
-        plane_index = map.brushsides[side_index].plane;
-        plane = &map.planes[plane_index];
-        signbits = planes[plane_index].signbits;
+void bench_run(char* name, job_func* func, int ops)
+{
+    double* times;
+    double freq;
+    struct perf_thread* perf;
+    Uint64 counters_start[PERF_COUNTERS];
+    Uint64 counters_end[PERF_COUNTERS];
+    int i, j;
 
-        dist = plane->dist - dot3(work->offsets[signbits], plane->normal);
+    if (ops <= 0) {
+        return;
+    }
 
-        start_distance = dot3(work->start, plane->normal) - dist;
-        end_distance = dot3(work->end, plane->normal) - dist;
+    times = 0;
+    freq = (double)SDL_GetPerformanceFrequency();
+    perf = perf_enabled ? perf_thread() : 0;
+    func(0, 0, ops);
 
-        /* TODO:
-         * for some reason these checks incorrectly report all solid
-         * when they shouldn't. for now I'm just ignoring them
-         */
+    if (perf) {
+        perf_read(perf, counters_start);
+    }
 
-        if (start_distance > 0) {
-            work->flags |= TW_STARTS_OUT;
-        }
+    for (i = 0; i < bench_repeats; ++i)
+    {
+        Uint64 start;
+        double t;
 
-        if (end_distance > 0) {
-            work->flags |= TW_ENDS_OUT;
-        }
+        start = SDL_GetPerformanceCounter();
+        func(0, 0, ops);
+        t = (SDL_GetPerformanceCounter() - start) * 1e9 / freq / ops;
 
-        if (start_distance > 0 &&
-            (end_distance >= SURF_CLIP_EPSILON ||
-             end_distance >= start_distance))
-        {
-            return;
-        }
+        /* insertion sort, there's only a handful */
+        vec_reserve(times, 1);
 
-        if (start_distance <= 0 && end_distance <= 0) {
-            continue;
+        for (j = vec_len(times); j > 0 && times[j - 1] > t; --j) {
+            times[j] = times[j - 1];
         }
 
-        if (start_distance > end_distance)
-        {
-            frac = (start_distance - SURF_CLIP_EPSILON) /
-                (start_distance - end_distance);
+        times[j] = t;
+        ++vec_hdr(times)->n;
+    }
 
-            if (frac > start_frac) {
-                start_frac = frac;
-                closest_plane = plane;
-            }
-        }
+    vec_printf(&bench_json, ",\n        {\"name\": \"%s\", \"ops\": %d, "
+        "\"median_ns\": %.1f, \"best_ns\": %.1f", name, ops,
+        times[bench_repeats / 2], times[0]);
 
-        else
+    if (perf && perf_read(perf, counters_end))
+    {
+        for (i = 0; i < PERF_COUNTERS; ++i)
         {
-            frac = (start_distance + SURF_CLIP_EPSILON) /
-                (start_distance - end_distance);
-
-            end_frac = SDL_min(end_frac, frac);
+            if (perf->fds[i] >= 0)
+            {
+                vec_printf(&bench_json, ", \"%s\": %.2f",
+                    perf_counter_names[i], (double)(counters_end[i] -
+                    counters_start[i]) / ops / bench_repeats);
+            }
         }
     }
 
-    if (start_frac < end_frac &&
-        start_frac > -1 && start_frac < work->frac)
-    {
-        work->frac = SDL_max(start_frac, 0);
-        work->plane = closest_plane;
-    }
-
-    if (!(work->flags & (TW_STARTS_OUT | TW_ENDS_OUT))) {
-        work->frac = 0;
-    }
+    vec_printf(&bench_json, "}");
+    vec_free(times);
 }
 
 /*
- * - for leaves, only trace brush if the contents are solid and the brush
- *   has sides
- * - for nodes, recurse into front/back if both start and end are in front
- *   of, or behind the node's plane
- * - if start -> end crosses over two nodes, we need to recurse into both
- *   nodes and split the start -> end segment into two segment that are
- *   just short of crossing over by adding SURFACE_CLIP_EPSILON
- * - planes contain an enum that can tell us if they are axis aligned.
- *   when they are axis aligned, we can skip some calculations because
- *   the bounding box is also axis aligned
+ * maps with no vis data have no clusters, any leaf will do. the cluster
+ * is clamped so bsp_cluster_visible stays in bounds
  */
 
-void trace_leaf(struct trace_work* work, int index)
+void bench_sample(unsigned* seed, float* point, int* cluster)
 {
-    int i;
     struct bsp_leaf* leaf;
+    int i;
 
-    leaf = &map.leaves[index];
+    leaf = &map.leaves[0];
 
-    for (i = 0; i < leaf->n_leafbrushes; ++i)
+    for (i = 0; i < 16; ++i)
     {
-        struct bsp_brush* brush;
-        int contents;
-        int brush_index;
-
-        brush_index = map.leafbrushes[leaf->leafbrush + i];
-        brush = &map.brushes[brush_index];
-        contents = map.textures[brush->texture].contents;
-
-        if (brush->n_brushsides && (contents & CONTENTS_SOLID))
-        {
-            trace_brush(work, brush);
+        leaf = &map.leaves[rand_next(seed) % map.n_leaves];
 
-            if (!work->frac) {
-                return;
-            }
+        if (leaf->cluster >= 0) {
+            break;
         }
     }
 
-    /* TODO: collision with patches */
+    for (i = 0; i < 3; ++i) {
+        point[i] = (leaf->mins[i] + leaf->maxs[i]) * 0.5f;
+    }
+
+    *cluster = SDL_max(0, leaf->cluster);
 }
 
-void trace_node(struct trace_work* work, int index, float start_frac,
-    float end_frac, float* start, float* end)
+/* loading only runs once, it's slow and it's the same every time */
+
+void bench_map(char* path, int index)
 {
+    Uint64 start;
+    double load_ns;
+    unsigned seed;
     int i;
-    struct bsp_node* node;
-    struct bsp_plane* plane;
-    int plane_type;
 
-    float start_distance;
-    float end_distance;
-    float offset;
+    map_file = path;
+    start = SDL_GetPerformanceCounter();
+    init_map();
+    load_ns = (SDL_GetPerformanceCounter() - start) * 1e9 /
+        SDL_GetPerformanceFrequency();
+
+    vec_clear(bench_points);
+    vec_clear(bench_ends);
+    vec_clear(bench_velocities);
+    vec_clear(bench_clusters);
+    vec_clear(bench_patches);
+    vec_clear(bench_entities);
+
+    seed = 2463534242U;
+    vec_reserve(bench_points, bench_samples * 3);
+    vec_reserve(bench_ends, bench_samples * 3);
+    vec_reserve(bench_velocities, bench_samples * 3);
+    vec_reserve(bench_clusters, bench_samples * 2);
+
+    for (i = 0; i < bench_samples && map.n_leaves; ++i)
+    {
+        float* v;
 
-    int side;
-    float idistance;
-    float frac1;
-    float frac2;
-    float mid_frac;
-    float mid[3];
+        bench_sample(&seed, &bench_points[i * 3], &bench_clusters[i * 2]);
+        bench_sample(&seed, &bench_ends[i * 3], &bench_clusters[i * 2 + 1]);
 
-    if (index < 0) {
-        trace_leaf(work, (-index) - 1);
-        return;
+        v = &bench_velocities[i * 3];
+        v[0] = (float)((int)(rand_next(&seed) % 641) - 320);
+        v[1] = (float)((int)(rand_next(&seed) % 641) - 320);
+        v[2] = (float)((int)(rand_next(&seed) % 371) - 100);
     }
 
-    node = &map.nodes[index];
-    plane = &map.planes[node->plane];
-    plane_type = planes[node->plane].type;
-
-    if (plane_type < 3)
+    /* everything is tessellated up front, like after a look around */
+    for (i = 0; i < map.n_faces; ++i)
     {
-        start_distance = start[plane_type] - plane->dist;
-        end_distance = end[plane_type] - plane->dist;
-        offset = work->maxs[plane_type];
-    }
-    else
-    {
-        start_distance = dot3(start, plane->normal) - plane->dist;
-        end_distance = dot3(end, plane->normal) - plane->dist;
-
-        if (eq3(work->mins, work->maxs)) {
-            offset = 0;
-        } else {
-            /* "this is silly" - id Software */
-            offset = 2048;
+        if (map.faces[i].type == BSP_PATCH) {
+            request_tessellation(i);
         }
     }
 
-    if (start_distance >= offset + 1 && end_distance >= offset + 1) {
-        trace_node(work, node->child[0], start_frac, end_frac, start, end);
-        return;
+    do {
+        kick_tessellation();
     }
+    while (vec_len(tessellation_queue));
 
-    if (start_distance < -offset - 1 && end_distance < -offset - 1) {
-        trace_node(work, node->child[1], start_frac, end_frac, start, end);
-        return;
-    }
+    finish_tessellation();
 
-    if (start_distance < end_distance)
+    for (i = 0; i < vec_len(patches); ++i)
     {
-        side = 1;
-        idistance = 1.0f / (start_distance - end_distance);
-        frac1 = (start_distance - offset + SURF_CLIP_EPSILON) * idistance;
-        frac2 = (start_distance + offset + SURF_CLIP_EPSILON) * idistance;
+        if (patches[i].source == i) {
+            vec_append(bench_patches, i);
+        }
     }
 
-    else if (start_distance > end_distance)
+    vec_cat(bench_entities, map.entities, map.entities_len);
+    delta_time = 1.0f / 125;
+
+    vec_printf(&bench_json, "%s\n    {\"map\": ", index ? "," : "");
+    bench_string(path);
+    vec_printf(&bench_json, ", \"leaves\": %d, \"faces\": %d, "
+        "\"brushes\": %d, \"patches\": %d, \"entity_bytes\": %d, "
+        "\"results\": [\n"
+        "        {\"name\": \"load\", \"ops\": 1, \"median_ns\": %.1f, "
+        "\"best_ns\": %.1f, \"arena_bytes\": %d}",
+        map.n_leaves, map.n_faces, map.n_brushes, vec_len(patches),
+        map.entities_len, load_ns, load_ns, (int)arena_used(&map_arena));
+
+    if (map.n_leaves)
     {
-        side = 0;
-        idistance = 1.0f / (start_distance - end_distance);
-        frac1 = (start_distance + offset + SURF_CLIP_EPSILON) * idistance;
-        frac2 = (start_distance - offset - SURF_CLIP_EPSILON) * idistance;
+        bench_run("bsp_find_leaf", bench_find_leaf, bench_samples);
+        bench_run("bsp_cluster_visible", bench_cluster_visible,
+            bsp_pvs_row(&map, 0) ? bench_samples : 0);
+        bench_run("trace_point", bench_trace_point, bench_samples);
+        bench_run("trace_box", bench_trace_box, bench_samples);
+        bench_run("slide", bench_slide, bench_samples);
+        bench_run("gather_visible_faces", bench_gather_visible_faces,
+            SDL_max(1, bench_samples / 16));
     }
 
-    else
-    {
-        side = 0;
-        frac1 = 1;
-        frac2 = 0;
+    if (vec_len(bench_patches)) {
+        bench_run("tessellate", bench_tessellate, bench_samples);
     }
 
-    frac1 = SDL_max(0, SDL_min(1, frac1));
-    frac2 = SDL_max(0, SDL_min(1, frac2));
+    bench_run("parse_entities", bench_parse_entities,
+        map.entities_len ? SDL_max(1, bench_samples / 256) : 0);
+
+    vec_printf(&bench_json, "\n    ]}");
+}
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * synthetic maps, so the benchmarks can sweep map size without needing
+ * real maps. -generate writes one and benchmarks it before the others
+ *
+ * the map is a row of box rooms along x, one leaf and one cluster each.
+ * the rooms are separated by walls with a doorway. each room has a floor,
+ * a ceiling and two walls as solid brushes, with polygon faces on the
+ * inside. the floor also gets curved patches, and the room gets a spawn
+ * and some other entities. a room always sees its neighbours and sees
+ * each other room with probability synth_pvs
+ *
+ * the bsp tree halves the row at room boundaries until each leaf is one
+ * room. a leaf lists every brush that touches its slab of the row, so the
+ * walls between rooms are in both leaves
+ */
+
+#define SYNTH_ROOM 512 /* length of a room along x, walls included */
+#define SYNTH_WALL 16
+#define SYNTH_DOOR 64 /* half width of the doorways, they're 128 high */
+
+struct synth_room
+{
+    float mins[3]; /* inside of the room */
+    float maxs[3];
+    int first_brush;
+};
+
+unsigned synth_seed;
+struct synth_room* synth_room_list;
+char* synth_entity_lump;
+struct bsp_plane* synth_planes;
+struct bsp_node* synth_nodes;
+struct bsp_leaf* synth_leaves;
+int* synth_leaffaces;
+int* synth_leafbrushes;
+struct bsp_brush* synth_brushes;
+struct bsp_brushside* synth_brushsides;
+struct bsp_vertex* synth_vertices;
+int* synth_meshverts;
+struct bsp_face* synth_faces;
+unsigned char* synth_visdata; /* struct bsp_visdata followed by the rows */
+
+int synth_plane(float x, float y, float z, float dist)
+{
+    struct bsp_plane* plane;
+
+    plane = vec_append_p(synth_planes);
+    plane->normal[0] = x;
+    plane->normal[1] = y;
+    plane->normal[2] = z;
+    plane->dist = dist;
+
+    return vec_len(synth_planes) - 1;
+}
+
+void synth_brush(float x0, float y0, float z0, float x1, float y1, float z1)
+{
+    struct bsp_brush* brush;
+    int planes[6];
+    int i;
+
+    planes[0] = synth_plane(-1, 0, 0, -x0);
+    planes[1] = synth_plane(1, 0, 0, x1);
+    planes[2] = synth_plane(0, -1, 0, -y0);
+    planes[3] = synth_plane(0, 1, 0, y1);
+    planes[4] = synth_plane(0, 0, -1, -z0);
+    planes[5] = synth_plane(0, 0, 1, z1);
+
+    brush = vec_append_p(synth_brushes);
+    brush->brushside = vec_len(synth_brushsides);
+    brush->n_brushsides = 6;
+    brush->texture = 0;
 
-    mid_frac = start_frac + (end_frac - start_frac) * frac1;
+    for (i = 0; i < 6; ++i)
+    {
+        struct bsp_brushside* side;
 
-    for (i = 0; i < 3; ++i) {
-        mid[i] = start[i] + (end[i] - start[i]) * frac1;
+        side = vec_append_p(synth_brushsides);
+        side->plane = planes[i];
+        side->texture = 0;
     }
+}
 
-    trace_node(work, node->child[side], start_frac, mid_frac, start, mid);
+struct bsp_face* synth_face(int type, int n_vertices, float* normal)
+{
+    struct bsp_face* face;
 
-    mid_frac = start_frac + (end_frac - start_frac) * frac2;
+    face = vec_append_p(synth_faces);
+    memset(face, 0, sizeof(*face));
+    face->type = type;
+    face->effect = -1;
+    face->lm_index = -1;
+    face->vertex = vec_len(synth_vertices);
+    face->n_vertices = n_vertices;
+    face->meshvert = vec_len(synth_meshverts);
+    cpy3(face->normal, normal);
+
+    return face;
+}
 
-    for (i = 0; i < 3; ++i) {
-        mid[i] = start[i] + (end[i] - start[i]) * frac2;
+struct bsp_vertex* synth_vertex(float x, float y, float z, float* normal,
+    int color)
+{
+    struct bsp_vertex* vertex;
+
+    vertex = vec_append_p(synth_vertices);
+    memset(vertex, 0, sizeof(*vertex));
+    vertex->position[0] = x;
+    vertex->position[1] = y;
+    vertex->position[2] = z;
+    vertex->texcoord[0][0] = x / 128;
+    vertex->texcoord[0][1] = (y + z) / 128;
+    cpy3(vertex->normal, normal);
+    vertex->color = color;
+
+    return vertex;
+}
+
+/* corners go counter clockwise seen from the front */
+
+void synth_quad(float* corners, float nx, float ny, float nz, int color)
+{
+    static int const indices[] = { 0, 1, 2, 0, 2, 3 };
+    struct bsp_face* face;
+    float normal[3];
+    int i;
+
+    normal[0] = nx;
+    normal[1] = ny;
+    normal[2] = nz;
+    face = synth_face(BSP_POLYGON, 4, normal);
+    face->n_meshverts = 6;
+
+    for (i = 0; i < 4; ++i) {
+        synth_vertex(corners[i * 3], corners[i * 3 + 1], corners[i * 3 + 2],
+            normal, color);
     }
 
-    trace_node(work, node->child[side^1], mid_frac, end_frac, mid, end);
+    vec_cat(synth_meshverts, indices, 6);
 }
 
 /*
- * - adjust bounding box so it's symmetric. this is simply done by finding
- *   the middle point and moving start/end to align with it
- * - initialize offsets. this is a lookup table for mins/maxs with any
- *   sign combination for the plane's normal. it ensures that we account
- *   for the hitbox in the right orientation in trace_brush
- * - do the tracing
- * - if we hit anything, calculate end from the unmodified start/end
+ * a 5x5 bump on the floor. there's only a few heights so some of them
+ * end up identical and get shared by the patch dedup like real maps'
+ * repeated pillars and arches do
  */
 
-void trace(struct trace_work* work, float* start, float* end, float* mins,
-    float* maxs)
+void synth_patch(float x, float y, float z, int color)
+{
+    static float const shape[] = { 0, 0.5f, 1, 0.5f, 0 };
+    struct bsp_face* face;
+    float normal[3];
+    float height;
+    int i, j;
+
+    normal[0] = 0;
+    normal[1] = 0;
+    normal[2] = 1;
+    height = 16.0f * (1 + rand_next(&synth_seed) % 4);
+    face = synth_face(BSP_PATCH, 25, normal);
+    face->size[0] = 5;
+    face->size[1] = 5;
+
+    for (j = 0; j < 5; ++j)
+    {
+        for (i = 0; i < 5; ++i)
+        {
+            synth_vertex(x + i * 32.0f, y + j * 32.0f,
+                z + height * shape[i] * shape[j], normal, color);
+        }
+    }
+}
+
+void synth_entity_room(int index, struct synth_room* room)
 {
+    static char* const kinds[] = {
+        "light", "misc_model", "target_position", "info_notnull"
+    };
+
+    float center[3];
     int i;
 
-    work->frac = 1;
-    work->flags = 0;
+    for (i = 0; i < 3; ++i) {
+        center[i] = (room->mins[i] + room->maxs[i]) * 0.5f;
+    }
 
-    for (i = 0; i < 3; ++i)
+    vec_printf(&synth_entity_lump, "{\n\"classname\" "
+        "\"info_player_deathmatch\"\n\"origin\" \"%d %d %d\"\n"
+        "\"angle\" \"%d\"\n}\n", (int)center[0], (int)center[1],
+        (int)room->mins[2] + 40, (int)(rand_next(&synth_seed) % 360));
+
+    for (i = 0; i < synth_entities; ++i)
     {
-        float offset;
+        char* kind;
+        int x, y, z;
+
+        kind = kinds[i % 4];
+        x = (int)room->mins[0] + (int)(rand_next(&synth_seed) % 256);
+        y = (int)center[1];
+        z = (int)room->mins[2] + 8 + (int)(rand_next(&synth_seed) % 64);
+
+        vec_printf(&synth_entity_lump, "{\n\"classname\" \"%s\"\n"
+            "\"origin\" \"%d %d %d\"\n\"targetname\" \"room%d_%d\"\n",
+            kind, x, y, z, index, i);
+
+        switch (i % 4)
+        {
+        case 0:
+            vec_printf(&synth_entity_lump, "\"light\" \"%d\"\n"
+                "\"_color\" \"1 0.9 0.8\"\n",
+                200 + (int)(rand_next(&synth_seed) % 300));
+            break;
+        case 1:
+            vec_printf(&synth_entity_lump, "\"model\" "
+                "\"models/mapobjects/synthetic.md3\"\n"
+                "\"angles\" \"0 %d 0\"\n",
+                (int)(rand_next(&synth_seed) % 360));
+            break;
+        case 2:
+            vec_printf(&synth_entity_lump, "\"target\" \"room%d_0\"\n",
+                (index + 1) % synth_rooms);
+            break;
+        }
 
-        offset = (mins[i] + maxs[i]) * 0.5f;
-        work->mins[i] = mins[i] - offset;
-        work->maxs[i] = maxs[i] - offset;
-        work->start[i] = start[i] + offset;
-        work->end[i] = end[i] + offset;
+        vec_printf(&synth_entity_lump, "}\n");
     }
+}
 
-    work->offsets[0][0] = work->mins[0];
-    work->offsets[0][1] = work->mins[1];
-    work->offsets[0][2] = work->mins[2];
+void synth_room(int index)
+{
+    struct synth_room* room;
+    struct bsp_leaf* leaf;
+    float x0, x1, hy, h;
+    float corners[12];
+    int color;
+    int i;
 
-    work->offsets[1][0] = work->maxs[0];
-    work->offsets[1][1] = work->mins[1];
-    work->offsets[1][2] = work->mins[2];
+    x0 = (float)index * SYNTH_ROOM;
+    x1 = x0 + SYNTH_ROOM;
+    hy = 192.0f + rand_next(&synth_seed) % 4 * 64;
+    h = 192.0f + rand_next(&synth_seed) % 4 * 64;
+    color = (int)(rand_next(&synth_seed) | 0xFF000000);
+
+    room = vec_append_p(synth_room_list);
+    room->mins[0] = x0 + SYNTH_WALL / 2;
+    room->mins[1] = -hy;
+    room->mins[2] = 0;
+    room->maxs[0] = x1 - SYNTH_WALL / 2;
+    room->maxs[1] = hy;
+    room->maxs[2] = h;
+    room->first_brush = vec_len(synth_brushes);
+
+    /* floor, ceiling and walls */
+    synth_brush(x0, -hy - SYNTH_WALL, -SYNTH_WALL, x1, hy + SYNTH_WALL, 0);
+    synth_brush(x0, -hy - SYNTH_WALL, h, x1, hy + SYNTH_WALL, h + SYNTH_WALL);
+    synth_brush(x0, -hy - SYNTH_WALL, 0, x1, -hy, h);
+    synth_brush(x0, hy, 0, x1, hy + SYNTH_WALL, h);
+
+    leaf = vec_append_p(synth_leaves);
+    leaf->cluster = index;
+    leaf->area = 0;
+    leaf->leafface = vec_len(synth_leaffaces);
+    leaf->n_leaffaces = 0;
 
-    work->offsets[2][0] = work->mins[0];
-    work->offsets[2][1] = work->maxs[1];
-    work->offsets[2][2] = work->mins[2];
+    for (i = 0; i < 3; ++i) {
+        leaf->mins[i] = (int)room->mins[i];
+        leaf->maxs[i] = (int)room->maxs[i];
+    }
 
-    work->offsets[3][0] = work->maxs[0];
-    work->offsets[3][1] = work->maxs[1];
-    work->offsets[3][2] = work->mins[2];
+#define corner(i, x, y, z) \
+    (corners[i * 3] = x, corners[i * 3 + 1] = y, corners[i * 3 + 2] = z)
 
-    work->offsets[4][0] = work->mins[0];
-    work->offsets[4][1] = work->mins[1];
-    work->offsets[4][2] = work->maxs[2];
+    corner(0, x0, -hy, 0);
+    corner(1, x1, -hy, 0);
+    corner(2, x1, hy, 0);
+    corner(3, x0, hy, 0);
+    synth_quad(corners, 0, 0, 1, color);
 
-    work->offsets[5][0] = work->maxs[0];
-    work->offsets[5][1] = work->mins[1];
-    work->offsets[5][2] = work->maxs[2];
+    corner(0, x0, hy, h);
+    corner(1, x1, hy, h);
+    corner(2, x1, -hy, h);
+    corner(3, x0, -hy, h);
+    synth_quad(corners, 0, 0, -1, color);
 
-    work->offsets[6][0] = work->mins[0];
-    work->offsets[6][1] = work->maxs[1];
-    work->offsets[6][2] = work->maxs[2];
+    corner(0, x0, -hy, h);
+    corner(1, x1, -hy, h);
+    corner(2, x1, -hy, 0);
+    corner(3, x0, -hy, 0);
+    synth_quad(corners, 0, 1, 0, color);
 
-    work->offsets[7][0] = work->maxs[0];
-    work->offsets[7][1] = work->maxs[1];
-    work->offsets[7][2] = work->maxs[2];
+    corner(0, x0, hy, 0);
+    corner(1, x1, hy, 0);
+    corner(2, x1, hy, h);
+    corner(3, x0, hy, h);
+    synth_quad(corners, 0, -1, 0, color);
 
-    trace_node(work, 0, 0, 1, work->start, work->end);
+#undef corner
 
-    if (work->frac == 1) {
-        cpy3(work->endpos, end);
-    } else {
-        int i;
+    for (i = 0; i < synth_patches; ++i)
+    {
+        int cells;
 
-        for (i = 0; i < 3; ++i) {
-            work->endpos[i] = start[i] + work->frac * (end[i] - start[i]);
-        }
+        /* a grid of 128 unit cells clear of the walls */
+        cells = (int)(2 * hy / 128);
+        synth_patch(x0 + SYNTH_WALL + rand_next(&synth_seed) % 3 * 128.0f,
+            -hy + rand_next(&synth_seed) % cells * 128.0f, 0, color);
     }
+
+    for (i = leaf->leafface; i < vec_len(synth_faces); ++i) {
+        vec_append(synth_leaffaces, i);
+    }
+
+    leaf->n_leaffaces = vec_len(synth_leaffaces) - leaf->leafface;
+    synth_entity_room(index, room);
 }
 
-void trace_point(struct trace_work* work, float* start, float* end)
+/*
+ * the wall at the start of room index, between it and the previous room.
+ * the first and last ones close off the row and have no doorway
+ */
+
+void synth_divider(int index)
 {
-    float zero[3];
+    float x;
+    float hy, h;
 
-    clr3(zero);
-    trace(work, start, end, zero, zero);
+    x = (float)index * SYNTH_ROOM;
+    hy = 0;
+    h = 0;
+
+    if (index > 0) {
+        hy = synth_room_list[index - 1].maxs[1];
+        h = synth_room_list[index - 1].maxs[2];
+    }
+
+    if (index < synth_rooms) {
+        hy = SDL_max(hy, synth_room_list[index].maxs[1]);
+        h = SDL_max(h, synth_room_list[index].maxs[2]);
+    }
+
+    x -= SYNTH_WALL / 2;
+
+    if (index == 0 || index == synth_rooms) {
+        synth_brush(x, -hy, 0, x + SYNTH_WALL, hy, h);
+        return;
+    }
+
+    synth_brush(x, -hy, 0, x + SYNTH_WALL, -SYNTH_DOOR, h);
+    synth_brush(x, SYNTH_DOOR, 0, x + SYNTH_WALL, hy, h);
+    synth_brush(x, -SYNTH_DOOR, 128, x + SYNTH_WALL, SYNTH_DOOR, h);
 }
 
-int plane_type_for_normal(float* normal)
+/* returns the child index for rooms [first, end) */
+
+int synth_node(int first, int end)
 {
-    if (normal[0] == 1.0f || normal[0] == -1.0f) {
-        return PLANE_X;
+    struct bsp_node* node;
+    int index;
+    int middle;
+    int front, back;
+    int i;
+
+    if (end - first == 1) {
+        return -first - 1;
     }
 
-    if (normal[1] == 1.0f || normal[1] == -1.0f) {
-        return PLANE_Y;
+    index = vec_len(synth_nodes);
+    middle = (first + end) / 2;
+    node = vec_append_p(synth_nodes);
+    node->plane = synth_plane(1, 0, 0, (float)middle * SYNTH_ROOM);
+
+    for (i = 0; i < 3; ++i) {
+        node->mins[i] = (int)synth_room_list[first].mins[i] - SYNTH_WALL;
+        node->maxs[i] = (int)synth_room_list[first].maxs[i] + SYNTH_WALL;
     }
 
-    if (normal[2] == 1.0f || normal[2] == -1.0f) {
-        return PLANE_Z;
+    for (i = first; i < end; ++i)
+    {
+        int j;
+
+        for (j = 0; j < 3; ++j)
+        {
+            node->mins[j] = SDL_min(node->mins[j],
+                (int)synth_room_list[i].mins[j] - SYNTH_WALL);
+            node->maxs[j] = SDL_max(node->maxs[j],
+                (int)synth_room_list[i].maxs[j] + SYNTH_WALL);
+        }
     }
 
-    return PLANE_NONAXIAL;
+    front = synth_node(middle, end);
+    back = synth_node(first, middle);
+
+    /* the recursion might have moved the nodes */
+    synth_nodes[index].child[0] = front;
+    synth_nodes[index].child[1] = back;
+
+    return index;
 }
 
-int signbits_for_normal(float* normal)
+void synth_visibility()
 {
-    int i;
-    int bits;
+    struct bsp_visdata* visdata;
+    unsigned char* rows;
+    int sz_vecs;
+    int i, j;
 
-    bits = 0;
+    sz_vecs = (synth_rooms + 7) / 8;
+    vec_clear(synth_visdata);
+    vec_grow(synth_visdata, sizeof(*visdata) + synth_rooms * sz_vecs);
+    vec_hdr(synth_visdata)->n = sizeof(*visdata) + synth_rooms * sz_vecs;
+    memset(synth_visdata, 0, vec_len(synth_visdata));
 
-    for (i = 0; i < 3; ++i)
+    visdata = (struct bsp_visdata*)synth_visdata;
+    visdata->n_vecs = synth_rooms;
+    visdata->sz_vecs = sz_vecs;
+    rows = synth_visdata + sizeof(*visdata);
+
+#define see(a, b) (rows[(a) * sz_vecs + (b) / 8] |= 1 << ((b) % 8))
+
+    for (i = 0; i < synth_rooms; ++i)
     {
-        if (normal[i] < 0) {
-            bits |= 1<<i;
+        for (j = i; j < synth_rooms; ++j)
+        {
+            if (j - i <= 1 ||
+                rand_next(&synth_seed) % 65536 < synth_pvs * 65536)
+            {
+                see(i, j);
+                see(j, i);
+            }
         }
     }
 
-    return bits;
+#undef see
 }
 
-void init_planes()
+void synth_lump(SDL_RWops* io, struct bsp_dirent* dirent, void* data,
+    int length)
 {
-    int i;
+    static char const zeros[4];
 
-    planes = (struct plane*)
-        SDL_realloc(planes, map.n_planes * sizeof(struct plane));
+    dirent->offset = (int)SDL_RWtell(io);
+    dirent->length = length;
 
-    for (i = 0; i < map.n_planes; ++i) {
-        planes[i].signbits = signbits_for_normal(map.planes[i].normal);
-        planes[i].type = plane_type_for_normal(map.planes[i].normal);
+    if (length) {
+        SDL_RWwrite(io, data, length, 1);
     }
+
+    SDL_RWwrite(io, zeros, (4 - length % 4) % 4, 1);
 }
 
-void init_patches()
+int synth_write(char* path)
 {
+    SDL_RWops* io;
+    struct bsp_header header;
+    struct bsp_texture texture;
+    struct bsp_model model;
+    struct bsp_dirent* dirents;
     int i;
 
-    for (i = 0; patches && i < map.n_faces; ++i)
+    vec_clear(synth_room_list);
+    vec_clear(synth_entity_lump);
+    vec_clear(synth_planes);
+    vec_clear(synth_nodes);
+    vec_clear(synth_leaves);
+    vec_clear(synth_leaffaces);
+    vec_clear(synth_leafbrushes);
+    vec_clear(synth_brushes);
+    vec_clear(synth_brushsides);
+    vec_clear(synth_vertices);
+    vec_clear(synth_meshverts);
+    vec_clear(synth_faces);
+
+    synth_seed = 2463534242U;
+
+    vec_printf(&synth_entity_lump, "{\n\"classname\" \"worldspawn\"\n"
+        "\"message\" \"synthetic, %d rooms\"\n}\n", synth_rooms);
+
+    for (i = 0; i < synth_rooms; ++i) {
+        synth_room(i);
+    }
+
+    for (i = 0; i <= synth_rooms; ++i) {
+        synth_divider(i);
+    }
+
+    /* own brushes, the walls to either side and the dividers' brushes */
+    for (i = 0; i < synth_rooms; ++i)
     {
+        struct bsp_leaf* leaf;
         int j;
-        int npatches;
+        int first_divider;
 
-        npatches = (map.faces[i].size[0] - 1) / 2;
-        npatches *= (map.faces[i].size[1] - 1) / 2;
+        leaf = &synth_leaves[i];
+        leaf->leafbrush = vec_len(synth_leafbrushes);
 
-        for (j = 0; j < npatches; ++j)
-        {
-            SDL_free(patches[i][j].vertices);
-            SDL_free(patches[i][j].indices);
+        for (j = 0; j < 4; ++j) {
+            vec_append(synth_leafbrushes, synth_room_list[i].first_brush + j);
+        }
+
+        /* divider 0 has 1 brush, the rest have 3 */
+        first_divider = synth_rooms * 4 + (i ? 1 + (i - 1) * 3 : 0);
+
+        for (j = first_divider; j < first_divider + (i ? 3 : 1); ++j) {
+            vec_append(synth_leafbrushes, j);
+        }
+
+        first_divider += i ? 3 : 1;
+
+        for (j = 0; j < (i + 1 < synth_rooms ? 3 : 1); ++j) {
+            vec_append(synth_leafbrushes, first_divider + j);
         }
+
+        leaf->n_leafbrushes = vec_len(synth_leafbrushes) - leaf->leafbrush;
+    }
+
+    synth_node(0, synth_rooms);
+    synth_visibility();
+
+    memset(&texture, 0, sizeof(texture));
+    SDL_strlcpy(texture.name, "textures/synthetic/wall",
+        sizeof(texture.name));
+    texture.contents = CONTENTS_SOLID;
+
+    memset(&model, 0, sizeof(model));
+    model.mins[0] = -SYNTH_WALL;
+    model.mins[1] = -512 - SYNTH_WALL;
+    model.mins[2] = -SYNTH_WALL;
+    model.maxs[0] = (float)synth_rooms * SYNTH_ROOM + SYNTH_WALL;
+    model.maxs[1] = 512 + SYNTH_WALL;
+    model.maxs[2] = 512 + SYNTH_WALL;
+    model.n_faces = vec_len(synth_faces);
+    model.n_brushes = vec_len(synth_brushes);
+
+    io = open_data_file(path, "wb");
+    if (!io) {
+        log_puts(SDL_GetError());
+        SDL_ClearError();
+        return 0;
     }
 
-    patches = (struct patch**)
-        SDL_realloc(patches, map.n_faces * sizeof(patches[0]));
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "IBSP", 4);
+    header.version = 0x2e;
+    dirents = header.dirents;
+    SDL_RWwrite(io, &header, sizeof(header), 1);
+
+#define lump(i, vec) \
+    synth_lump(io, &dirents[i], vec, vec_len(vec) * sizeof((vec)[0]))
+
+    lump(0, synth_entity_lump);
+    synth_lump(io, &dirents[1], &texture, sizeof(texture));
+    lump(2, synth_planes);
+    lump(3, synth_nodes);
+    lump(4, synth_leaves);
+    lump(5, synth_leaffaces);
+    lump(6, synth_leafbrushes);
+    synth_lump(io, &dirents[7], &model, sizeof(model));
+    lump(8, synth_brushes);
+    lump(9, synth_brushsides);
+    lump(10, synth_vertices);
+    lump(11, synth_meshverts);
+    synth_lump(io, &dirents[12], 0, 0);
+    lump(13, synth_faces);
+    synth_lump(io, &dirents[14], 0, 0);
+    synth_lump(io, &dirents[15], 0, 0);
+    lump(16, synth_visdata);
+
+#undef lump
 
-    memset(patches, 0, map.n_faces * sizeof(patches[0]));
+    /* now that the offsets are known */
+    SDL_RWseek(io, 0, RW_SEEK_SET);
 
-    for (i = 0; i < map.n_faces; ++i) {
-        tessellate_face(i);
+    if (SDL_RWwrite(io, &header, sizeof(header), 1) != 1) {
+        log_print(lninfo, "failed to write %s: %s", path, SDL_GetError());
+        SDL_ClearError();
+        SDL_RWclose(io);
+        return 0;
     }
+
+    SDL_RWclose(io);
+
+    log_print(lninfo, "wrote %s: %d rooms, %d brushes, %d faces, "
+        "%d entity bytes", path, synth_rooms, vec_len(synth_brushes),
+        vec_len(synth_faces), vec_len(synth_entity_lump));
+
+    return 1;
 }
 
-void init_spawn()
+int main(int argc, char* argv[])
 {
-    struct entity_field* spawn;
-    char* angle;
-    char* origin;
     int i;
+    int n;
 
-    spawn = entity_by_classname("info_player_deathmatch");
-    if (!spawn) {
-        return;
+    mem_init();
+    log_init();
+    SDL_Init(SDL_INIT_TIMER);
+    parse_args(argc, argv);
+    prof_init(trace_file);
+    perf_init();
+    jobs_init(job_thread_count);
+
+    vec_printf(&bench_json, "{\"samples\": %d, \"repeats\": %d, "
+        "\"tessellation_level\": %d, \"tessellation_error\": %g, "
+        "\"maps\": [", bench_samples, bench_repeats, tessellation_level,
+        tessellation_error);
+
+    n = 0;
+
+    if (synth_path)
+    {
+        if (!synth_write(synth_path)) {
+            exit(1);
+        }
+
+        bench_map(synth_path, n++);
     }
 
-    angle = entity_get(spawn, "angle");
-    if (angle) {
-        camera_angle[0] = radians(atoi(angle));
+    for (i = 0; i < bench_n_maps; ++i) {
+        bench_map(bench_maps[i], n++);
     }
 
-    origin = entity_get(spawn, "origin");
+    vec_printf(&bench_json, "\n]}\n");
+    fwrite(bench_json, 1, vec_len(bench_json), stdout);
+    fflush(stdout);
+
+    jobs_shutdown();
+    prof_dump();
+
+    return 0;
+}
+
+#elif defined(DEDICATED)
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * headless dedicated server
+ *
+ * runs the physics for sv_players players at a fixed tick rate. every
+ * player belongs to a simulated client that lives in the same process and
+ * talks to the server through loopback queues the same way it would over
+ * the network: clients send usercmds, the server sends back snapshots
+ *
+ * the simulated clients wander around, jump and fire a rocket every now
+ * and then, which runs a splash damage query where it hits
+ *
+ * every sv_tickrate ticks it logs the tick times, how many traces a tick
+ * does, how many players a single core could keep up with at this tick
+ * rate and how big and how fast to encode the snapshots are
+ */
+
+#define MAX_PACKET 16384
+#define MAX_LOOPBACK 4
+#define SPLASH_RADIUS 120
+
+/*
+ * fixed size message queue. senders write straight into the next slot and
+ * receivers read straight out of it. when it's full, the oldest message
+ * is dropped
+ */
+
+struct packet
+{
+    int len;
+    unsigned char data[MAX_PACKET];
+};
+
+struct loopback
+{
+    struct packet packets[MAX_LOOPBACK];
+    int get;
+    int send;
+};
+
+unsigned char* loopback_reserve(struct loopback* lb)
+{
+    return lb->packets[lb->send % MAX_LOOPBACK].data;
+}
+
+void loopback_send(struct loopback* lb, int len)
+{
+    lb->packets[lb->send % MAX_LOOPBACK].len = len;
+    ++lb->send;
+    lb->get = SDL_max(lb->get, lb->send - MAX_LOOPBACK);
+}
+
+unsigned char* loopback_peek(struct loopback* lb, int* len)
+{
+    struct packet* packet;
 
-    for (i = 0; origin && *origin && i < 3; ++i) {
-        camera_pos[i] = (float)SDL_strtod(origin, &origin);
+    if (lb->get == lb->send) {
+        return 0;
     }
 
-    camera_pos[2] += 60;
+    packet = &lb->packets[lb->get % MAX_LOOPBACK];
+    *len = packet->len;
 
-    log_print(lninfo, "[%f %f %f] %f degrees",
-        expand3(camera_pos), degrees(camera_angle[0]));
+    return packet->data;
 }
 
-void init_map()
+void loopback_pop(struct loopback* lb)
+{
+    ++lb->get;
+}
+
+enum button_bits
+{
+    BUTTON_JUMP = 1<<1,
+    BUTTON_ATTACK = 1<<2,
+    LAST_BUTTON_BIT
+};
+
+struct usercmd
+{
+    int sequence;
+    int snapshot_ack; /* last snapshot the client got */
+    float wishdir[3];
+    int wishlook[2];
+    int buttons;
+};
+
+struct player
+{
+    float camera_pos[3];
+    float camera_angle[2];
+    float velocity[3];
+    int movement;
+    float* ground_normal;
+    int entity;
+};
+
+struct sv_client
 {
-    unsigned start;
-    char* entities_str;
+    struct player player;
+    struct usercmd cmd;
+    int old_buttons;
+    int snapshot_sequence;
+    struct snapshot_frame frames[SNAPSHOT_BACKUP];
+    struct loopback to_server;
+    struct loopback to_client;
+};
 
-    start = SDL_GetTicks();
+struct sim_client
+{
+    struct usercmd cmd;
+    unsigned seed;
+    int think_ticks;
+    int last_snapshot;
+    struct snapshot_frame frames[SNAPSHOT_BACKUP];
+};
 
-    if (!map_file) {
-        return;
-    }
+struct sv_stats
+{
+    int ticks;
+    Uint64 tick_time;
+    Uint64 max_tick_time;
+    int traces;
+    int explosions;
+    int splash_hits;
+    Uint64 encode_time;
+    int snapshots;
+    int snapshot_bytes;
+    int decode_errors;
+};
 
-    if (!bsp_load(&map, map_file)) {
-        exit(1);
-    }
+struct entity_state* sv_baselines;
+struct sv_client* sv_clients;
+struct client_view* sv_views;
+struct sim_client* sim_clients;
+struct sv_stats sv_stats;
 
-    log_puts("preprocessing planes");
-    init_planes();
+/*
+ * the physics code works on the globals, so players are swapped in and
+ * out of them around each update
+ */
 
-    log_puts("tessellating geometry");
-    init_patches();
+void player_load(struct player* player, struct usercmd* cmd,
+    int old_buttons)
+{
+    cpy3(camera_pos, player->camera_pos);
+    camera_angle[0] = player->camera_angle[0];
+    camera_angle[1] = player->camera_angle[1];
+    cpy3(velocity, player->velocity);
+    movement = player->movement;
+    ground_normal = player->ground_normal;
+
+    cpy3(wishdir, cmd->wishdir);
+    wishlook[0] = cmd->wishlook[0];
+    wishlook[1] = cmd->wishlook[1];
+
+    /* only jump when the button goes down, like the key in the client */
+    if ((cmd->buttons & BUTTON_JUMP) && !(old_buttons & BUTTON_JUMP)) {
+        movement |= MOVEMENT_JUMP;
+    } else if (!(cmd->buttons & BUTTON_JUMP)) {
+        movement &= ~MOVEMENT_JUMP;
+    }
+}
 
-    log_puts("parsing entities");
-    entities_str = SDL_malloc(map.entities_len + 1);
-    SDL_memcpy(entities_str, map.entities, map.entities_len);
-    entities_str[map.entities_len] = 0;
+void player_save(struct player* player)
+{
+    cpy3(player->camera_pos, camera_pos);
+    player->camera_angle[0] = camera_angle[0];
+    player->camera_angle[1] = camera_angle[1];
+    cpy3(player->velocity, velocity);
+    player->movement = movement;
+    player->ground_normal = ground_normal;
+}
 
-    parse_entities(entities_str);
-    init_spawn();
+void link_player(struct player* player)
+{
+    float mins[3], maxs[3];
 
-    SDL_free(entities_str);
+    cpy3(mins, player->camera_pos);
+    cpy3(maxs, player->camera_pos);
+    add3(mins, player_mins);
+    add3(maxs, player_maxs);
 
-    log_print(lninfo, "completed in %fs",
-        (SDL_GetTicks() - start) / 1000.0f);
+    cpy3(entity_links[player->entity].origin, player->camera_pos);
+    link_entity(player->entity, mins, maxs);
 }
 
-void init(int argc, char* argv[])
+/* same rotations as apply_inputs */
+
+void angle_forward(float* angles, float* forward)
 {
-    parse_args(argc, argv);
+    float pitch_cos;
 
-    gl_init();
+    pitch_cos = SDL_cosf(2*M_PI - angles[1]);
+    forward[0] = pitch_cos * SDL_cosf(2*M_PI - angles[0]);
+    forward[1] = pitch_cos * SDL_sinf(2*M_PI - angles[0]);
+    forward[2] = SDL_sinf(2*M_PI - angles[1]);
+}
 
-    SDL_ShowCursor(SDL_DISABLE);
-    SDL_SetRelativeMouseMode(SDL_TRUE);
+void sv_fire(struct player* player)
+{
+    static int* hits;
+    struct trace_work work;
+    float start[3];
+    float end[3];
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gl_perspective(110, 0.1f, 10000.0f);
-    glMatrixMode(GL_MODELVIEW);
+    cpy3(start, player->camera_pos);
+    start[2] += 30;
 
-    init_map();
+    angle_forward(player->camera_angle, end);
+    mul3_scalar(end, 8192);
+    add3(end, start);
 
-    visible_faces =
-        (int*)SDL_realloc(visible_faces, sizeof(int) * map.n_faces);
+    trace_point(&work, start, end);
+    ++frame_stats.traces[TRACE_WEAPON];
 
-    visible_faces_mask =
-        (unsigned char*)SDL_realloc(visible_faces_mask, map.n_faces / 8);
+    vec_grow(hits, vec_len(entity_links));
+    sv_stats.splash_hits += radius_query(work.endpos, SPLASH_RADIUS, hits,
+        vec_len(entity_links));
+    ++sv_stats.explosions;
 }
 
-void clamp_angles(float* angles, int n_angles)
+void sv_build_frame(struct sv_client* client, struct client_view* view)
 {
+    struct snapshot_frame* frame;
+    struct player* player;
     int i;
 
-    for (i = 0; i < n_angles; ++i)
-    {
-        for (; angles[i] < 0; angles[i] += 2*M_PI);
-        for (; angles[i] >= 2*M_PI; angles[i] -= 2*M_PI);
-    }
-}
+    player = &client->player;
+    frame = &client->frames[client->snapshot_sequence &
+        (SNAPSHOT_BACKUP - 1)];
 
-void trace_ground()
-{
-    float point[3];
-    struct trace_work work;
+    frame->sequence = client->snapshot_sequence;
+    quantize_player(&frame->player, player->camera_pos,
+        player->camera_angle, player->velocity, player->movement);
 
-    point[0] = camera_pos[0];
-    point[1] = camera_pos[1];
-    point[2] = camera_pos[2] - 0.25;
+    vec_clear(frame->entities);
 
-    trace(&work, camera_pos, point, player_mins, player_maxs);
+    for (i = 0; i < vec_len(entity_links); ++i)
+    {
+        if (!(view->visible[i / 8] & (1 << (i % 8)))) {
+            continue;
+        }
 
-    if (work.frac == 1 || (movement & MOVEMENT_JUMP_THIS_FRAME)) {
-        movement |= MOVEMENT_JUMPING;
-        ground_normal = 0;
-    } else {
-        movement &= ~MOVEMENT_JUMPING;
-        ground_normal = work.plane->normal;
+        if (i != player->entity) {
+            quantize_entity(vec_append_p(frame->entities), i,
+                entity_links[i].origin);
+        }
     }
 }
 
-void apply_jump()
+/* deltas from the last snapshot the client acked if we still have it */
+
+int sv_write_snapshot(struct sv_client* client, unsigned char* buf)
 {
-    if (!(movement & MOVEMENT_JUMP)) {
-        return;
-    }
+    struct snapshot_frame* to;
+    struct snapshot_frame* from;
+    int ack;
 
-    if ((movement & MOVEMENT_JUMPING) && !noclip) {
-        return;
+    to = &client->frames[client->snapshot_sequence & (SNAPSHOT_BACKUP - 1)];
+    from = 0;
+    ack = client->cmd.snapshot_ack;
+
+    if (ack > 0 && to->sequence - ack < SNAPSHOT_BACKUP)
+    {
+        from = &client->frames[ack & (SNAPSHOT_BACKUP - 1)];
+
+        if (from->sequence != ack) {
+            from = 0;
+        }
     }
 
-    movement |= MOVEMENT_JUMP_THIS_FRAME;
-    velocity[2] = 270;
-    movement &= ~MOVEMENT_JUMP; /* no auto bunnyhop */
+    return snapshot_encode(to, from, sv_baselines, buf, MAX_PACKET);
 }
 
-void apply_friction()
+void sv_init()
 {
-    float speed;
-    float control;
-    float new_speed;
+    int i;
+    int n_spawns;
+    int* spawns;
 
-    if (!noclip)
+    spawns = entities_of_class("info_player_deathmatch");
+    n_spawns = vec_len(spawns);
+    log_dump("d", n_spawns);
+
+    sv_clients = SDL_calloc(sv_players, sizeof(sv_clients[0]));
+    sv_views = SDL_calloc(sv_players, sizeof(sv_views[0]));
+    sim_clients = SDL_calloc(sv_players, sizeof(sim_clients[0]));
+
+    for (i = 0; i < sv_players; ++i)
     {
-        if ((movement & MOVEMENT_JUMPING) ||
-            (movement & MOVEMENT_JUMP_THIS_FRAME))
-        {
-            return;
-        }
-    }
+        struct player* player;
 
-    speed = (float)SDL_sqrt(dot3(velocity, velocity));
-    if (speed < 1) {
-        velocity[0] = 0;
-        velocity[1] = 0;
-        return;
-    }
+        player = &sv_clients[i].player;
+        player->movement = MOVEMENT_JUMPING;
 
-    control = speed < cl_stop_speed ? cl_stop_speed : speed;
-    new_speed = speed - control * cl_movement_friction * delta_time;
-    new_speed = SDL_max(0, new_speed);
-    mul3_scalar(velocity, new_speed / speed);
-}
+        if (n_spawns) {
+            read_spawn(spawns[i % n_spawns], player->camera_pos,
+                &player->camera_angle[0]);
+        }
 
-void apply_acceleration(float* direction, float wishspeed,
-    float acceleration)
-{
-    float cur_speed;
-    float add_speed;
-    float accel_speed;
-    float amount[3];
+        player->entity = alloc_entity_link();
+        link_player(player);
 
-    if (!noclip && (movement & MOVEMENT_JUMPING)) {
-        wishspeed = SDL_min(cpm_wish_speed, wishspeed);
+        sim_clients[i].seed = 2463534242U + i * 7919;
     }
 
-    cur_speed = dot3(velocity, direction);
-    add_speed = wishspeed - cur_speed;
+    /* new entities in a snapshot are sent as a delta from these */
+    vec_clear(sv_baselines);
 
-    if (add_speed <= 0) {
-        return;
+    for (i = 0; i < vec_len(entity_links); ++i) {
+        quantize_entity(vec_append_p(sv_baselines), i,
+            entity_links[i].origin);
     }
 
-    accel_speed = acceleration * delta_time * wishspeed;
-    accel_speed = SDL_min(accel_speed, add_speed);
+    entity_bits = ENTITY_BITS;
 
-    cpy3(amount, direction);
-    mul3_scalar(amount, accel_speed);
-    add3(velocity, amount);
+    while ((1 << entity_bits) < vec_len(sv_baselines)) {
+        ++entity_bits;
+    }
 }
 
-void apply_air_control(float* direction, float wishspeed)
+/* the simulated client picks new inputs every now and then */
+
+void sim_client_think(struct sim_client* sim)
 {
-    float zspeed;
-    float speed;
-    float dot;
+    struct usercmd* cmd;
 
-    if (wishdir[0] == 0 || wishspeed == 0) {
+    cmd = &sim->cmd;
+    ++cmd->sequence;
+    cmd->snapshot_ack = sim->last_snapshot;
+    cmd->wishlook[0] = cmd->wishlook[1] = 0;
+    cmd->buttons &= ~BUTTON_ATTACK;
+
+    if (--sim->think_ticks > 0) {
         return;
     }
 
-    zspeed = velocity[2];
-    velocity[2] = 0;
-    speed = mag3(velocity);
-    if (speed >= 0.0001f) {
-        div3_scalar(velocity, speed);
-    }
-    dot = dot3(velocity, direction);
+    sim->think_ticks = sv_tickrate / 4 + rand_next(&sim->seed) % sv_tickrate;
 
-    if (dot > 0) {
-        /* can only change direction if we aren't trying to slow down */
-        float k;
-        float amount[3];
+    cmd->wishdir[0] =
+        ((int)(rand_next(&sim->seed) % 3) - 1) * cl_forwardspeed;
 
-        k = 32 * cpm_air_control_amount * dot * dot * delta_time;
-        mul3_scalar(velocity, speed);
-        cpy3(amount, direction);
-        mul3_scalar(amount, k);
-        nrm3(velocity);
+    cmd->wishdir[1] =
+        ((int)(rand_next(&sim->seed) % 3) - 1) * cl_sidespeed;
+
+    cmd->wishlook[0] = (int)(rand_next(&sim->seed) % 400) - 200;
+    cmd->buttons = 0;
+
+    if (!(rand_next(&sim->seed) % 3)) {
+        cmd->buttons |= BUTTON_JUMP;
     }
 
-    mul3_scalar(velocity, speed);
-    velocity[2] = zspeed;
+    if (!(rand_next(&sim->seed) % 2)) {
+        cmd->buttons |= BUTTON_ATTACK;
+    }
 }
 
-void apply_inputs()
+/*
+ * decodes snapshots straight out of the loopback queue. since we're in
+ * the same process we can also check the result against what the server
+ * encoded
+ */
+
+void sim_client_frame(struct sim_client* sim, struct sv_client* client)
 {
-    float direction[3];
-    float pitch_sin, pitch_cos, yaw_sin, yaw_cos;
-    float pitch_x;
-    float wishspeed;
-    float selected_acceleration;
-    float base_wishspeed;
+    unsigned char* data;
+    int len;
 
-    /* camera look */
-    camera_angle[0] += 0.002f * wishlook[0];
-    camera_angle[1] += 0.002f * wishlook[1];
-    clamp_angles(camera_angle, 2);
+    while ((data = loopback_peek(&client->to_client, &len)))
+    {
+        int sequence;
+        struct snapshot_frame* got;
+        struct snapshot_frame* sent;
 
-    if (noclip) {
-        pitch_sin = SDL_sinf(2*M_PI - camera_angle[1]);
-        pitch_cos = SDL_cosf(2*M_PI - camera_angle[1]);
-    } else {
-        pitch_sin = 0;
-        pitch_cos = 1;
-    }
+        sequence = snapshot_decode(data, len, sim->frames, sv_baselines);
+        loopback_pop(&client->to_client);
 
-    yaw_sin = SDL_sinf(2*M_PI - camera_angle[0]);
-    yaw_cos = SDL_cosf(2*M_PI - camera_angle[0]);
+        if (sequence < 0) {
+            ++sv_stats.decode_errors;
+            continue;
+        }
 
-    /* this applies 2 rotations, pitch first then yaw */
-    pitch_x = wishdir[0] * pitch_cos + wishdir[2] * (-pitch_sin);
-    direction[0] = pitch_x * yaw_cos + wishdir[1] * (-yaw_sin);
-    direction[1] = pitch_x * yaw_sin + wishdir[1] * yaw_cos;
-    direction[2] = wishdir[0] * pitch_sin + wishdir[2] * pitch_cos;
+        sim->last_snapshot = sequence;
+        got = &sim->frames[sequence & (SNAPSHOT_BACKUP - 1)];
+        sent = &client->frames[sequence & (SNAPSHOT_BACKUP - 1)];
 
-    /* movement */
-    wishspeed = (float)SDL_sqrt(dot3(direction, direction));
-    if (wishspeed >= 0.0001f) {
-        div3_scalar(direction, wishspeed);
+        if (memcmp(&got->player, &sent->player, sizeof(got->player)) ||
+            vec_len(got->entities) != vec_len(sent->entities) ||
+            memcmp(got->entities, sent->entities,
+                vec_len(got->entities) * sizeof(got->entities[0])))
+        {
+            ++sv_stats.decode_errors;
+        }
     }
-    wishspeed = SDL_min(wishspeed, sv_max_speed);
 
-    apply_jump();
-    apply_friction();
+    sim_client_think(sim);
+    data = loopback_reserve(&client->to_server);
+    SDL_memcpy(data, &sim->cmd, sizeof(sim->cmd));
+    loopback_send(&client->to_server, sizeof(sim->cmd));
+}
 
-    selected_acceleration = cl_movement_accelerate;
-    base_wishspeed = wishspeed;
+void sv_read_commands(struct sv_client* client)
+{
+    unsigned char* data;
+    int len;
+    int got_cmd;
 
-    /* cpm air acceleration | TODO: pull this out */
-    if (noclip || (movement & MOVEMENT_JUMPING) ||
-        (movement & MOVEMENT_JUMP_THIS_FRAME))
+    got_cmd = 0;
+
+    while ((data = loopback_peek(&client->to_server, &len)))
     {
-        if (dot3(velocity, direction) < 0) {
-            selected_acceleration = cpm_air_stop_acceleration;
-        } else {
-            selected_acceleration = cl_movement_airaccelerate;
+        if (len == sizeof(client->cmd)) {
+            SDL_memcpy(&client->cmd, data, sizeof(client->cmd));
+            got_cmd = 1;
         }
 
-        if (wishdir[1] != 0 && wishdir[0] == 0) {
-            wishspeed = SDL_min(wishspeed, cpm_wish_speed);
-            selected_acceleration = cpm_strafe_acceleration;
-        }
+        loopback_pop(&client->to_server);
     }
 
-    apply_acceleration(direction, wishspeed, selected_acceleration);
-    apply_air_control(direction, base_wishspeed);
+    /* keep moving the same way but don't keep turning */
+    if (!got_cmd) {
+        client->cmd.wishlook[0] = client->cmd.wishlook[1] = 0;
+    }
 }
 
-void clip_velocity(float* in, float* normal, float* out, float overbounce)
+void sv_tick()
 {
-    float backoff;
     int i;
+    int old_tag;
+    Uint64 start;
 
-    backoff = dot3(in, normal);
+    old_tag = mem_tag(MEM_NET);
+    prof_begin("sv_tick");
 
-    if (backoff < 0) {
-        backoff *= overbounce;
-    } else {
-        backoff /= overbounce;
+    for (i = 0; i < sv_players; ++i) {
+        sv_read_commands(&sv_clients[i]);
     }
 
-    for (i = 0; i < 3; ++i)
+    for (i = 0; i < sv_players; ++i)
     {
-        float change;
+        struct sv_client* client;
 
-        change = normal[i] * backoff;
-        out[i] = in[i] - change;
+        client = &sv_clients[i];
+        player_load(&client->player, &client->cmd, client->old_buttons);
+        update_physics();
+        player_save(&client->player);
+        link_player(&client->player);
     }
-}
 
-/*
- * clip the velocity against all brushes until we stop colliding. this
- * allows the player to slide against walls and the floor
- */
+    for (i = 0; i < sv_players; ++i)
+    {
+        struct sv_client* client;
 
-#define OVERCLIP 1.001f
-#define MAX_CLIP_PLANES 5
+        client = &sv_clients[i];
 
-int slide(int gravity)
-{
-    float end_velocity[3];
-    float planes[MAX_CLIP_PLANES][3];
-    int n_planes;
-    float time_left;
-    int n_bumps;
-    float end[3];
+        if (client->cmd.buttons & ~client->old_buttons & BUTTON_ATTACK) {
+            sv_fire(&client->player);
+        }
 
-    n_planes = 0;
-    time_left = delta_time;
+        client->old_buttons = client->cmd.buttons;
 
-    if (gravity)
-    {
-        cpy3(end_velocity, velocity);
-        end_velocity[2] -= sv_gravity * delta_time;
+        cpy3(sv_views[i].origin, client->player.camera_pos);
+        sv_views[i].origin[2] += 30;
+    }
 
-        /*
-         * not 100% sure why this is necessary, maybe to avoid tunneling
-         * through the floor when really close to it
-         */
+    cull_snapshot_entities(sv_views, sv_players);
+
+    start = SDL_GetPerformanceCounter();
+    prof_begin("snapshots");
+
+    for (i = 0; i < sv_players; ++i)
+    {
+        struct sv_client* client;
+        int len;
 
-        velocity[2] = (end_velocity[2] + velocity[2]) * 0.5f;
+        client = &sv_clients[i];
+        ++client->snapshot_sequence;
+        sv_build_frame(client, &sv_views[i]);
 
-        /* slide against floor */
-        if (ground_normal) {
-            clip_velocity(velocity, ground_normal, velocity, OVERCLIP);
+        len = sv_write_snapshot(client,
+            loopback_reserve(&client->to_client));
+
+        /* too big, the client will get the next one */
+        if (len < 0) {
+            continue;
         }
-    }
 
-    if (ground_normal) {
-        cpy3(planes[n_planes], ground_normal);
-        ++n_planes;
+        loopback_send(&client->to_client, len);
+        sv_stats.snapshot_bytes += len;
+        ++sv_stats.snapshots;
     }
 
-    cpy3(planes[n_planes], velocity);
-    nrm3(planes[n_planes]);
-    ++n_planes;
+    prof_end();
+    sv_stats.encode_time += SDL_GetPerformanceCounter() - start;
+    prof_end();
+    mem_tag(old_tag);
+}
 
-    for (n_bumps = 0; n_bumps < 4; ++n_bumps)
+void sv_report()
+{
+    double freq;
+    double avg_ms;
+    double max_ms;
+    double tick_ms;
+    double encode_s;
+
+    freq = (double)SDL_GetPerformanceFrequency();
+    avg_ms = sv_stats.tick_time * 1000.0 / freq / sv_stats.ticks;
+    max_ms = sv_stats.max_tick_time * 1000.0 / freq;
+    tick_ms = 1000.0 / sv_tickrate;
+    encode_s = SDL_max(sv_stats.encode_time / freq, 1e-9);
+
+    log_print(lninfo, "%d ticks | tick %.3fms avg %.3fms max | "
+        "%.1f traces/tick | %d players %.1f players/core | "
+        "%d explosions %d splash hits",
+        sv_stats.ticks, avg_ms, max_ms,
+        (double)sv_stats.traces / sv_stats.ticks,
+        sv_players, avg_ms > 0 ? sv_players * tick_ms / avg_ms : 0.0,
+        sv_stats.explosions, sv_stats.splash_hits);
+
+    log_print(lninfo, "snapshots | %.1f bytes/client/tick | "
+        "encode %.0f snapshots/s %.2f MB/s | %d decode errors",
+        (double)sv_stats.snapshot_bytes / sv_stats.ticks / sv_players,
+        sv_stats.snapshots / encode_s,
+        sv_stats.snapshot_bytes / encode_s / (1024 * 1024),
+        sv_stats.decode_errors);
+
+    stats_report();
+    mem_report(map_arena.tag_bytes);
+    perf_report();
+    memset(&sv_stats, 0, sizeof(sv_stats));
+}
+
+int main(int argc, char* argv[])
+{
+    Uint64 freq;
+    Uint64 next_tick;
+    Uint64 tick_length;
+    Uint64 last_start;
+    int total_ticks;
+
+    mem_init();
+    log_init();
+    SDL_Init(SDL_INIT_TIMER);
+    parse_args(argc, argv);
+    prof_init(trace_file);
+    perf_init();
+    jobs_init(job_thread_count);
+    init_map();
+    mem_tag(MEM_NET);
+    sv_init();
+    mem_tag(MEM_OTHER);
+
+    delta_time = 1.0f / sv_tickrate;
+    freq = SDL_GetPerformanceFrequency();
+    tick_length = freq / sv_tickrate;
+    next_tick = SDL_GetPerformanceCounter();
+    last_start = next_tick;
+
+    for (total_ticks = 0;
+        sv_time <= 0 || total_ticks < sv_time * sv_tickrate;
+        ++total_ticks)
     {
-        struct trace_work work;
         int i;
+        Uint64 start;
+        Uint64 elapsed;
 
-        /* calculate future position and attempt the move */
-        cpy3(end, velocity);
-        mul3_scalar(end, time_left);
-        add3(end, camera_pos);
-        trace(&work, camera_pos, end, player_mins, player_maxs);
-
-        if (work.frac > 0) {
-            cpy3(camera_pos, work.endpos);
-        }
-
-        /* if nothing blocked us we are done */
-        if (work.frac == 1) {
-            break;
+        for (i = 0; i < sv_players; ++i) {
+            sim_client_frame(&sim_clients[i], &sv_clients[i]);
         }
 
-        time_left -= time_left * work.frac;
+        trace_count = 0;
+        start = SDL_GetPerformanceCounter();
+        sv_tick();
+        elapsed = SDL_GetPerformanceCounter() - start;
 
-        if (n_planes >= MAX_CLIP_PLANES) {
-            clr3(velocity);
-            return 1;
-        }
+        ++sv_stats.ticks;
+        sv_stats.tick_time += elapsed;
+        sv_stats.max_tick_time = SDL_max(sv_stats.max_tick_time, elapsed);
+        sv_stats.traces += trace_count;
 
         /*
-         * if it's a plane we hit before, nudge velocity along it
-         * to prevent epsilon issues and dont re-test it
+         * a tick is the server's frame, there's nothing to render. the
+         * frame time is from the start of the last tick, so it shows
+         * oversleeping, ticks falling behind and -nosleep speeds
          */
+        frame_stats.frame_ms = (float)((start - last_start) * 1000.0 / freq);
+        frame_stats.update_ms = (float)(elapsed * 1000.0 / freq);
+        last_start = start;
+        stats_end_frame();
 
-        for (i = 0; i < n_planes; ++i)
-        {
-            if (dot3(work.plane->normal, planes[i]) > 0.99) {
-                add3(velocity, work.plane->normal);
-                break;
-            }
+        if (sv_stats.ticks >= sv_tickrate) {
+            sv_report();
         }
 
-        if (i < n_planes) {
-            continue;
+        next_tick += tick_length;
+
+        while (!sv_nosleep && SDL_GetPerformanceCounter() < next_tick) {
+            SDL_Delay(1);
         }
+    }
 
-        /*
-         * entirely new plane, add it and clip velocity against all
-         * planes that the move interacts with
-         */
+    jobs_shutdown();
+    prof_dump();
 
-        cpy3(planes[n_planes], work.plane->normal);
-        ++n_planes;
+    return 0;
+}
 
-        for (i = 0; i < n_planes; ++i)
-        {
-            float clipped[3];
-            float end_clipped[3];
-            int j;
+#else
 
-            if (dot3(velocity, planes[i]) >= 0.1) {
-                continue;
-            }
+void update()
+{
+    prof_begin("update");
+    update_fps();
+    update_physics();
+    prof_end();
+}
 
-            clip_velocity(velocity, planes[i], clipped, OVERCLIP);
-            clip_velocity(end_velocity, planes[i], end_clipped, OVERCLIP);
+void render_mesh(struct bsp_face* face)
+{
+    int stride;
 
-            /*
-             * if the clipped move still hits another plane, slide along
-             * the line where the two planes meet (cross product) with the
-             * un-clipped velocity
-             *
-             * TODO: reduce nesting in here
-             */
+    stride = sizeof(struct bsp_vertex);
 
-            for (j = 0; j < n_planes; ++j)
-            {
-                int k;
-                float dir[3];
-                float speed;
+    gl_state(glEnableClientState(GL_VERTEX_ARRAY));
+    gl_state(glEnableClientState(GL_COLOR_ARRAY));
 
-                if (j == i) {
-                    continue;
-                }
+    gl_state(glVertexPointer(3, GL_FLOAT, stride,
+        &map.vertices[face->vertex].position));
 
-                if (dot3(clipped, planes[j]) >= 0.1) {
-                    continue;
-                }
+    gl_state(glColorPointer(4, GL_UNSIGNED_BYTE, stride,
+        &map.vertices[face->vertex].color));
 
-                clip_velocity(clipped, planes[j], clipped, OVERCLIP);
-                clip_velocity(end_clipped, planes[j], end_clipped,
-                    OVERCLIP);
+    if (map.mesh_index_sizes[face - map.faces] == 2)
+    {
+        glDrawElements(GL_TRIANGLES, face->n_meshverts, GL_UNSIGNED_SHORT,
+            &map.meshverts[face->meshvert]);
+    }
+    else
+    {
+        glDrawElements(GL_TRIANGLES, face->n_meshverts, GL_UNSIGNED_INT,
+            &map.wide_meshverts[
+                map.wide_meshvert_offsets[face - map.faces]]);
+    }
 
-                if (dot3(clipped, planes[i]) >= 0) {
-                    /* goes back into the first plane */
-                    continue;
-                }
+    gl_state(glDisableClientState(GL_VERTEX_ARRAY));
+    gl_state(glDisableClientState(GL_COLOR_ARRAY));
 
-                cross3(planes[i], planes[j], dir);
-                nrm3(dir);
+    frame_stats.triangles += face->n_meshverts / 3;
+    ++frame_stats.draw_calls;
+}
 
-                speed = dot3(dir, velocity);
-                cpy3(clipped, dir);
-                mul3_scalar(clipped, speed);
+void render_patch(struct patch* patch)
+{
+    int stride;
+    int i;
+    struct bsp_vertex* vertices;
+    char* indices;
+    GLenum type;
+    int translated;
 
-                speed = dot3(dir, end_velocity);
-                cpy3(end_clipped, dir);
-                mul3_scalar(end_clipped, speed);
+    stride = sizeof(struct bsp_vertex);
 
-                /* if we still hit a plane, just give up and dead stop */
+    gl_state(glEnableClientState(GL_VERTEX_ARRAY));
+    gl_state(glEnableClientState(GL_COLOR_ARRAY));
 
-                for (k = 0; k < n_planes; ++k)
-                {
-                    if (k == j || k == i) {
-                        continue;
-                    }
+    /* identical patches are drawn from the same geometry */
+    translated = patch->source != patch - patches ||
+        patch->origin[0] || patch->origin[1] || patch->origin[2];
 
-                    if (dot3(clipped, planes[k]) >= 0.1) {
-                        continue;
-                    }
+    if (translated) {
+        gl_state(glPushMatrix());
+        gl_state(glTranslatef(patch->origin[0], patch->origin[1],
+            patch->origin[2]));
+    }
 
-                    clr3(velocity);
-                    return 1;
-                }
-            }
+    patch = &patches[patch->source];
+    vertices = patch_vertices(patch);
+    indices = patch_indices(patch);
+    type = patch->index_size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
 
-            /* resolved all collisions for this move */
-            cpy3(velocity, clipped);
-            cpy3(end_velocity, end_clipped);
-            break;
-        }
+    gl_state(glVertexPointer(3, GL_FLOAT, stride,
+        &vertices[0].position));
+
+    gl_state(glColorPointer(4, GL_UNSIGNED_BYTE, stride,
+        &vertices[0].color));
+
+    for (i = 0; i < patch->n_rows; ++i)
+    {
+        glDrawElements(GL_TRIANGLE_STRIP, patch->triangles_per_row, type,
+            &indices[i * patch->triangles_per_row * patch->index_size]);
     }
 
-    if (gravity) {
-        cpy3(velocity, end_velocity);
+    if (translated) {
+        gl_state(glPopMatrix());
     }
 
-    return n_bumps != 0;
+    gl_state(glDisableClientState(GL_VERTEX_ARRAY));
+    gl_state(glDisableClientState(GL_COLOR_ARRAY));
+
+    frame_stats.triangles += patch->n_rows * (patch->triangles_per_row - 2);
+    frame_stats.draw_calls += patch->n_rows;
 }
 
-void update()
-{
-    float amount[3];
+/*
+ * stand-in for patches that aren't tessellated yet. every other control
+ * point lies on the curve, so those make a coarse version of the surface
+ */
 
-    update_fps();
-    trace_ground();
-    apply_inputs();
+void render_patch_fallback(struct bsp_face* face)
+{
+    int x, y;
+    struct bsp_vertex* controls;
 
-    if (!noclip) {
-        slide((movement & MOVEMENT_JUMPING) != 0);
-    }
+    controls = &map.vertices[face->vertex];
 
-    else
+    for (x = 0; x + 2 < face->size[0]; x += 2)
     {
-        cpy3(amount, velocity);
-        mul3_scalar(amount, delta_time);
-        add3(camera_pos, amount);
-    }
+        glBegin(GL_TRIANGLE_STRIP);
 
-    movement &= ~MOVEMENT_JUMP_THIS_FRAME;
+        for (y = 0; y < face->size[1]; y += 2)
+        {
+            struct bsp_vertex* a;
+            struct bsp_vertex* b;
+
+            a = &controls[y * face->size[0] + x + 2];
+            b = &controls[y * face->size[0] + x];
+
+            gl_state(glColor4ubv((GLubyte*)&a->color));
+            glVertex3f(expand3(a->position));
+            gl_state(glColor4ubv((GLubyte*)&b->color));
+            glVertex3f(expand3(b->position));
+        }
+
+        glEnd();
+
+        frame_stats.triangles += (face->size[1] + 1) / 2 * 2 - 2;
+        ++frame_stats.draw_calls;
+    }
 }
 
-void render_mesh(struct bsp_face* face)
+/*
+ * tiny 3x5 font for the stats overlay. each glyph is 5 rows of 3 bits,
+ * one octal digit per row starting from the top, high bit on the left
+ */
+
+char* font_chars = "0123456789abcdefghijklmnopqrstuvwxyz.:/()-%";
+
+int font_glyphs[] = {
+    075557, 026227, 071747, 071717, 055711, 074717, 074757, 071111,
+    075757, 075717, 025755, 065656, 034443, 065556, 074647, 074644,
+    034553, 055755, 072227, 011153, 055655, 044447, 057555, 065555,
+    025552, 065644, 025531, 065655, 034216, 072222, 055557, 055552,
+    055575, 055255, 055222, 071247, 000002, 002020, 011244, 012221,
+    042224, 000700, 051245
+};
+
+void draw_text(float x, float y, float scale, char* text)
 {
-    int stride;
+    for (; *text; ++text, x += 4 * scale)
+    {
+        char* c;
+        int glyph;
+        int row, col;
 
-    stride = sizeof(struct bsp_vertex);
+        c = SDL_strchr(font_chars, *text);
 
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glEnableClientState(GL_COLOR_ARRAY);
+        if (!c || *text == ' ') {
+            continue;
+        }
 
-    glVertexPointer(3, GL_FLOAT, stride,
-        &map.vertices[face->vertex].position);
+        glyph = font_glyphs[c - font_chars];
 
-    glColorPointer(4, GL_UNSIGNED_BYTE, stride,
-        &map.vertices[face->vertex].color);
+        for (row = 0; row < 5; ++row)
+        {
+            for (col = 0; col < 3; ++col)
+            {
+                float px, py;
 
-    glDrawElements(GL_TRIANGLES, face->n_meshverts, GL_UNSIGNED_INT,
-        &map.meshverts[face->meshvert]);
+                if (!(glyph & (1 << ((4 - row) * 3 + 2 - col)))) {
+                    continue;
+                }
 
-    glDisableClientState(GL_VERTEX_ARRAY);
-    glDisableClientState(GL_COLOR_ARRAY);
+                px = x + col * scale;
+                py = y + row * scale;
+                glVertex2f(px, py);
+                glVertex2f(px + scale, py);
+                glVertex2f(px + scale, py + scale);
+                glVertex2f(px, py + scale);
+            }
+        }
+    }
 }
 
-void render_patch(struct patch* patch)
+void render_stats_overlay()
 {
-    int stride;
+    struct frame_stats* st;
+    char lines[5][128];
+    float scale;
     int i;
 
-    stride = sizeof(struct bsp_vertex);
+    st = &last_frame_stats;
 
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glEnableClientState(GL_COLOR_ARRAY);
+    SDL_snprintf(lines[0], sizeof(lines[0]), "frame %.2fms update %.2fms "
+        "render %.2fms", st->frame_ms, st->update_ms, st->render_ms);
 
-    glVertexPointer(3, GL_FLOAT, stride, &patch->vertices[0].position);
-    glColorPointer(4, GL_UNSIGNED_BYTE, stride, &patch->vertices[0].color);
+    SDL_snprintf(lines[1], sizeof(lines[1]), "clusters %d leaves %d "
+        "faces %d", st->clusters, st->leaves, st->faces);
 
-    for (i = 0; i < patch->n_rows; ++i)
+    SDL_snprintf(lines[2], sizeof(lines[2]), "patches %d fallback %d",
+        st->patches, st->fallback_patches);
+
+    SDL_snprintf(lines[3], sizeof(lines[3]), "triangles %d draws %d "
+        "state changes %d", st->triangles, st->draw_calls,
+        st->state_changes);
+
+    SDL_snprintf(lines[4], sizeof(lines[4]), "traces ground %d slide %d "
+        "weapon %d radius %d", st->traces[TRACE_GROUND],
+        st->traces[TRACE_SLIDE], st->traces[TRACE_WEAPON],
+        st->traces[TRACE_RADIUS]);
+
+    scale = SDL_max(2, gl_height / 360);
+
+    gl_state(glMatrixMode(GL_PROJECTION));
+    gl_state(glPushMatrix());
+    gl_state(glLoadIdentity());
+    gl_state(glOrtho(0, gl_width, gl_height, 0, -1, 1));
+    gl_state(glMatrixMode(GL_MODELVIEW));
+    gl_state(glPushMatrix());
+    gl_state(glLoadIdentity());
+    gl_state(glDisable(GL_DEPTH_TEST));
+
+    glBegin(GL_QUADS);
+
+    for (i = 0; i < 5; ++i)
     {
-        glDrawElements(GL_TRIANGLE_STRIP,
-            patch->triangles_per_row, GL_UNSIGNED_INT,
-            &patch->indices[i * patch->triangles_per_row]);
+        /* dark shadow first so the text reads on bright walls too */
+        gl_state(glColor3ub(0, 0, 0));
+        draw_text(scale * 3, scale * (2 + i * 7) + scale / 2, scale,
+            lines[i]);
+        gl_state(glColor3ub(255, 255, 0));
+        draw_text(scale * 2.5f, scale * (2 + i * 7), scale, lines[i]);
     }
 
-    glDisableClientState(GL_VERTEX_ARRAY);
-    glDisableClientState(GL_COLOR_ARRAY);
+    glEnd();
+
+    gl_state(glEnable(GL_DEPTH_TEST));
+    gl_state(glPopMatrix());
+    gl_state(glMatrixMode(GL_PROJECTION));
+    gl_state(glPopMatrix());
+    gl_state(glMatrixMode(GL_MODELVIEW));
 }
 
 /*
@@ -2230,53 +8921,27 @@ void render_patch(struct patch* patch)
 void render()
 {
     int i, j;
-    int leaf_index;
-    struct bsp_leaf* leaf;
-    int cluster;
     int n_visible_faces;
 
-    leaf_index = bsp_find_leaf(&map, camera_pos);
-    leaf = &map.leaves[leaf_index];
-    cluster = leaf->cluster;
-
-    n_visible_faces = 0;
-    memset(visible_faces_mask, 0, map.n_faces / 8);
-
-    for (i = 0; i < map.n_leaves; ++i)
-    {
-        int j;
-        int first_face;
-        int n_faces;
-
-        if (!bsp_cluster_visible(&map, cluster, map.leaves[i].cluster)) {
-            continue;
-        }
-
-        first_face = map.leaves[i].leafface;
-        n_faces = map.leaves[i].n_leaffaces;
-
-        for (j = first_face; j < first_face + n_faces; ++j)
-        {
-            int face_index;
-            int face_bit;
-
-            face_index = map.leaffaces[j];
-            face_bit = 1 << (face_index % 8);
-
-            if (visible_faces_mask[face_index / 8] & face_bit) {
-                continue;
-            }
-
-            visible_faces[n_visible_faces++] = face_index;
-            visible_faces_mask[face_index / 8] |= face_bit;
-        }
-    }
-
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glLoadMatrixf(quake_matrix);
-    glRotatef(degrees(camera_angle[1]), 0, -1, 0);
-    glRotatef(degrees(camera_angle[0]), 0, 0, 1);
-    glTranslatef(-camera_pos[0], -camera_pos[1], -camera_pos[2] - 30);
+    prof_begin("render");
+    prof_begin("finish_tessellation");
+    finish_tessellation();
+    prof_end();
+
+    prof_begin("visibility");
+    perf_begin(PERF_VISIBILITY);
+    n_visible_faces = gather_visible_faces(camera_pos);
+    perf_end(PERF_VISIBILITY);
+    prof_end();
+
+    prof_begin("draw");
+    perf_begin(PERF_RENDER);
+    gl_state(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
+    gl_state(glLoadMatrixf(quake_matrix));
+    gl_state(glRotatef(degrees(camera_angle[1]), 0, -1, 0));
+    gl_state(glRotatef(degrees(camera_angle[0]), 0, 0, 1));
+    gl_state(glTranslatef(-camera_pos[0], -camera_pos[1],
+        -camera_pos[2] - 30));
 
     for (i = 0; i < n_visible_faces; ++i)
     {
@@ -2299,23 +8964,60 @@ void render()
             break;
 
         case BSP_PATCH:
+            if (face_states[face_index] != FACE_TESSELLATED) {
+                request_tessellation(face_index);
+                render_patch_fallback(face);
+                ++frame_stats.fallback_patches;
+                break;
+            }
+
+            ++frame_stats.patches;
+
             npatches = (face->size[0] - 1) / 2;
             npatches *= (face->size[1] - 1) / 2;
 
             for (j = 0; j < npatches; ++j) {
-                render_patch(&patches[face_index][j]);
+                render_patch(&patches[face_patches[face_index] + j]);
             }
             break;
         }
     }
 
+    perf_end(PERF_RENDER);
+    prof_end();
+
+    if (stats_overlay) {
+        render_stats_overlay();
+    }
+
+    prof_begin("swap");
     SDL_GL_SwapWindow(gl_window);
+    prof_end();
+
+    /* tessellates newly seen patches while we run the next update */
+    kick_tessellation();
+    prof_end();
 }
 
 void tick()
 {
+    Uint64 start;
+    Uint64 updated;
+    double ms;
+
+    prof_begin("frame");
+    ms = 1000.0 / SDL_GetPerformanceFrequency();
+    start = SDL_GetPerformanceCounter();
     update();
+    updated = SDL_GetPerformanceCounter();
     render();
+
+    frame_stats.frame_ms = delta_time * 1000;
+    frame_stats.update_ms = (float)((updated - start) * ms);
+    frame_stats.render_ms =
+        (float)((SDL_GetPerformanceCounter() - updated) * ms);
+    stats_end_frame();
+    prof_end();
 }
 
 /* --------------------------------------------------------------------- */
@@ -2354,6 +9056,12 @@ void handle(SDL_Event* e)
             noclip ^= 1;
             log_dump("d", noclip);
             break;
+        case SDLK_p:
+            prof_dump();
+            break;
+        case SDLK_TAB:
+            stats_overlay ^= 1;
+            break;
         case SDLK_SPACE:
             movement |= MOVEMENT_JUMP;
             break;
@@ -2402,6 +9110,8 @@ int main(int argc, char* argv[])
 {
     unsigned prev_ticks;
 
+    mem_init();
+    log_init();
     SDL_Init(SDL_INIT_VIDEO);
     init(argc, argv);
 
@@ -2424,5 +9134,9 @@ int main(int argc, char* argv[])
         tick();
     }
 
+    jobs_shutdown();
+
     return 0;
 }
+
+#endif /* DEDICATED */